@@ -0,0 +1,185 @@
+//
+//  TreeGenerator.cpp
+//  webkitCacher
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#include "TreeGenerator.hpp"
+#include <libgeneral/macros.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+#include <sys/stat.h>
+
+#define GENERATOR_CHUNK_SIZE (1024*1024)
+
+namespace {
+    struct FileExtension {
+        const char *ext;
+        bool text;
+    };
+    const FileExtension gExtensions[] = {
+        {".html", true},
+        {".js",   true},
+        {".css",  true},
+        {".json", true},
+        {".png",  false},
+        {".bin",  false},
+    };
+
+    struct FileContent {
+        uint64_t seed;
+        uint64_t size;
+        size_t extension;
+    };
+
+    uint64_t splitmix64(uint64_t &state){
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    void writeContent(int fd, const FileContent &content, std::vector<uint8_t> &buf){
+        uint64_t state = content.seed;
+        bool text = gExtensions[content.extension].text;
+        for (uint64_t offset = 0; offset < content.size;) {
+            size_t len = (content.size - offset < buf.size()) ? (size_t)(content.size - offset) : buf.size();
+            for (size_t i = 0; i < len; i+=8) {
+                uint64_t r = splitmix64(state);
+                for (size_t j = 0; j < 8 && i+j < len; j++, r >>= 8) {
+                    uint8_t c = (uint8_t)r;
+                    buf[i+j] = text ? (uint8_t)(' ' + c % 95) : c;
+                }
+            }
+            for (size_t didWrite = 0; didWrite < len;) {
+                ssize_t w = write(fd, buf.data() + didWrite, len - didWrite);
+                if (w < 0 && errno == EINTR) continue;
+                retassure(w > 0, "Failed to write file with err=%d (%s)",errno,strerror(errno));
+                didWrite += w;
+            }
+            offset += len;
+        }
+    }
+}
+
+#pragma mark TreeGenerator::Spec
+
+TreeGenerator::Spec::Spec()
+: seed(1), files(1000), depth(3), fanout(4),
+    distribution(LogNormal), sizeMin(0), sizeMedian(8*1024), sizeMax(16*1024*1024), sigma(1.5),
+    duplicateRatio(0.1)
+{
+    //
+}
+
+#pragma mark TreeGenerator
+
+TreeGenerator::TreeGenerator(const Spec &spec)
+: _spec(spec), _state(spec.seed)
+{
+    retassure(_spec.sizeMin <= _spec.sizeMax, "sizeMin must not be larger than sizeMax");
+    retassure(_spec.duplicateRatio >= 0 && _spec.duplicateRatio <= 1, "duplicateRatio must be between 0 and 1");
+}
+
+uint64_t TreeGenerator::next(){
+    return splitmix64(_state);
+}
+
+double TreeGenerator::nextDouble(){
+    return (next() >> 11) * (1.0 / 9007199254740992.0); //[0,1)
+}
+
+uint64_t TreeGenerator::nextSize(){
+    double size = 0;
+    switch (_spec.distribution) {
+        case Fixed:
+            return _spec.sizeMedian;
+        case Uniform:
+            return _spec.sizeMin + next() % (_spec.sizeMax - _spec.sizeMin + 1);
+        case LogNormal:
+        {
+            //Box-Muller
+            double u1 = 1.0 - nextDouble();
+            double u2 = nextDouble();
+            double z = sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+            size = (double)_spec.sizeMedian * exp(_spec.sigma * z);
+        }
+            break;
+    }
+    if (size < (double)_spec.sizeMin) return _spec.sizeMin;
+    if (size > (double)_spec.sizeMax) return _spec.sizeMax;
+    return (uint64_t)size;
+}
+
+TreeGenerator::Stats TreeGenerator::generate(std::string dir){
+    Stats ret = {};
+    std::vector<std::string> dirs;
+    std::vector<FileContent> uniqueContents;
+    std::vector<uint8_t> buf(GENERATOR_CHUNK_SIZE);
+
+    if (dir.back() != '/') dir += '/';
+    _state = _spec.seed;
+
+    retassure(!mkdir(dir.c_str(), 0755), "Failed to create directory '%s' with err=%d (%s)",dir.c_str(),errno,strerror(errno));
+
+    //directory skeleton: every directory above the maximum depth has fanout subdirectories
+    dirs.push_back("");
+    for (size_t level = 0, levelStart = 0; level < _spec.depth; level++) {
+        size_t levelEnd = dirs.size();
+        for (size_t d = levelStart; d < levelEnd; d++) {
+            for (size_t i = 0; i < _spec.fanout; i++) {
+                char name[0x20] = {};
+                snprintf(name, sizeof(name), "d%02zu/", i);
+                std::string sub = dirs[d] + name;
+                retassure(!mkdir((dir + sub).c_str(), 0755), "Failed to create directory '%s' with err=%d (%s)",(dir + sub).c_str(),errno,strerror(errno));
+                dirs.push_back(sub);
+            }
+        }
+        levelStart = levelEnd;
+    }
+    ret.directories = dirs.size();
+
+    for (size_t i = 0; i < _spec.files; i++) {
+        FileContent content = {};
+        std::string path;
+        int fd = -1;
+        cleanup([&]{
+            safeClose(fd);
+        });
+
+        if (uniqueContents.size() && nextDouble() < _spec.duplicateRatio) {
+            content = uniqueContents[next() % uniqueContents.size()];
+            ret.duplicates++;
+        }else{
+            content.seed = next();
+            content.size = nextSize();
+            content.extension = next() % (sizeof(gExtensions)/sizeof(*gExtensions));
+            uniqueContents.push_back(content);
+        }
+
+        {
+            char name[0x20] = {};
+            snprintf(name, sizeof(name), "f%06zu%s", i, gExtensions[content.extension].ext);
+            path = dirs[next() % dirs.size()] + name;
+        }
+
+        retassure((fd = open((dir + path).c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644)) != -1, "Failed to create file '%s' with err=%d (%s)",(dir + path).c_str(),errno,strerror(errno));
+        writeContent(fd, content, buf);
+
+        ret.files++;
+        ret.bytes += content.size;
+        ret.paths.push_back(path);
+    }
+    return ret;
+}
+
+TreeGenerator::SizeDistribution TreeGenerator::distributionForName(const std::string &name){
+    if (name == "fixed") return Fixed;
+    if (name == "uniform") return Uniform;
+    if (name == "lognormal") return LogNormal;
+    reterror("unknown size distribution '%s'",name.c_str());
+}
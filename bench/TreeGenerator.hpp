@@ -0,0 +1,70 @@
+//
+//  TreeGenerator.hpp
+//  webkitCacher
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#ifndef TreeGenerator_hpp
+#define TreeGenerator_hpp
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+/*
+ Generates reproducible synthetic web trees for benchmarking.
+ The same spec always produces the same tree, no standard library random distributions are used.
+ */
+class TreeGenerator {
+public:
+    enum SizeDistribution {
+        Fixed,      //every file has sizeMedian bytes
+        Uniform,    //uniform between sizeMin and sizeMax
+        LogNormal   //lognormal around sizeMedian, clamped to sizeMin and sizeMax
+    };
+
+    struct Spec {
+        uint64_t seed;
+        size_t files;
+        size_t depth;           //maximum directory depth below the root
+        size_t fanout;          //subdirectories per directory
+        SizeDistribution distribution;
+        uint64_t sizeMin;
+        uint64_t sizeMedian;
+        uint64_t sizeMax;
+        double sigma;           //spread of the LogNormal distribution
+        double duplicateRatio;  //fraction of files which repeat the content of an earlier file
+
+        Spec();
+    };
+
+    struct Stats {
+        size_t files;
+        size_t directories;
+        size_t duplicates;
+        uint64_t bytes;
+        std::vector<std::string> paths; //relative paths of all generated files
+    };
+
+private:
+    Spec _spec;
+    uint64_t _state;
+
+    uint64_t next();
+    double nextDouble();
+    uint64_t nextSize();
+
+public:
+    TreeGenerator(const Spec &spec);
+
+    /*
+     Creates the tree in dir, which must not exist yet.
+     */
+    Stats generate(std::string dir);
+
+    static SizeDistribution distributionForName(const std::string &name);
+};
+
+#endif /* TreeGenerator_hpp */
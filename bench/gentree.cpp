@@ -0,0 +1,117 @@
+//
+//  gentree.cpp
+//  webkitCacher
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "TreeGenerator.hpp"
+#include <libgeneral/macros.h>
+#include <getopt.h>
+
+static struct option longopts[] = {
+    { "help",           no_argument,        NULL, 'h' },
+    { "seed",           required_argument,  NULL, 's' },
+    { "files",          required_argument,  NULL, 'n' },
+    { "depth",          required_argument,  NULL, 'd' },
+    { "fanout",         required_argument,  NULL, 'f' },
+    { "distribution",   required_argument,  NULL, 'D' },
+    { "min-size",       required_argument,  NULL, 'a' },
+    { "median-size",    required_argument,  NULL, 'm' },
+    { "max-size",       required_argument,  NULL, 'z' },
+    { "sigma",          required_argument,  NULL, 'g' },
+    { "duplicates",     required_argument,  NULL, 'u' },
+    { NULL, 0, NULL, 0 }
+};
+
+void cmd_help(){
+    printf("Usage: wkc-gentree [OPTIONS] <directory>\n");
+    printf("Generates a reproducible synthetic web tree for benchmarking\n\n");
+    printf("  -h, --help\t\t\t\tprints usage information\n");
+    printf("  -s, --seed <N>\t\t\tseed of the generator (default 1)\n");
+    printf("  -n, --files <N>\t\t\tnumber of files (default 1000)\n");
+    printf("  -d, --depth <N>\t\t\tmaximum directory depth (default 3)\n");
+    printf("  -f, --fanout <N>\t\t\tsubdirectories per directory (default 4)\n");
+    printf("  -D, --distribution <name>\t\tfixed, uniform or lognormal (default lognormal)\n");
+    printf("  -a, --min-size <bytes>\t\tsmallest file (default 0)\n");
+    printf("  -m, --median-size <bytes>\t\tmedian file size (default 8192)\n");
+    printf("  -z, --max-size <bytes>\t\tlargest file (default 16MiB)\n");
+    printf("  -g, --sigma <x>\t\t\tspread of the lognormal distribution (default 1.5)\n");
+    printf("  -u, --duplicates <ratio>\t\tfraction of files repeating earlier content (default 0.1)\n");
+}
+
+int main_r(int argc, const char * argv[]) {
+    TreeGenerator::Spec spec;
+    int optindex = 0;
+    int opt = 0;
+
+    while ((opt = getopt_long(argc, (char* const *)argv, "hs:n:d:f:D:a:m:z:g:u:", longopts, &optindex)) > 0) {
+        switch (opt) {
+            case 'h':
+                cmd_help();
+                return 0;
+            case 's':
+                spec.seed = strtoull(optarg, NULL, 0);
+                break;
+            case 'n':
+                spec.files = strtoul(optarg, NULL, 0);
+                break;
+            case 'd':
+                spec.depth = strtoul(optarg, NULL, 0);
+                break;
+            case 'f':
+                spec.fanout = strtoul(optarg, NULL, 0);
+                break;
+            case 'D':
+                spec.distribution = TreeGenerator::distributionForName(optarg);
+                break;
+            case 'a':
+                spec.sizeMin = strtoull(optarg, NULL, 0);
+                break;
+            case 'm':
+                spec.sizeMedian = strtoull(optarg, NULL, 0);
+                break;
+            case 'z':
+                spec.sizeMax = strtoull(optarg, NULL, 0);
+                break;
+            case 'g':
+                spec.sigma = strtod(optarg, NULL);
+                break;
+            case 'u':
+                spec.duplicateRatio = strtod(optarg, NULL);
+                break;
+
+            default:
+                cmd_help();
+                return -1;
+        }
+    }
+
+    if (argc-optind != 1) {
+        cmd_help();
+        return -1;
+    }
+
+    {
+        TreeGenerator gen(spec);
+        auto stats = gen.generate(argv[optind]);
+        printf("Generated %zu files (%zu duplicates, %llu bytes) in %zu directories\n",stats.files,stats.duplicates,(unsigned long long)stats.bytes,stats.directories);
+    }
+    return 0;
+}
+
+int main(int argc, const char * argv[]) {
+#ifdef DEBUG
+    return main_r(argc, argv);
+#else
+    try {
+        return main_r(argc, argv);
+    } catch (tihmstar::exception &e) {
+        printf("wkc-gentree: failed with exception:\n");
+        e.dump();
+        return e.code();
+    }
+#endif
+}
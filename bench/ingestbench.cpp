@@ -0,0 +1,321 @@
+//
+//  ingestbench.cpp
+//  webkitCacher
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "TreeGenerator.hpp"
+#include "WebkitCacher.hpp"
+#include "ShardedBuild.hpp"
+#include <libgeneral/macros.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <chrono>
+#include <vector>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#define BENCH_URL "http://bench.local/"
+
+namespace {
+    struct Scenario {
+        const char *name;
+        size_t jobs;
+        bool bulk;
+        bool dedup;
+        WebkitCacher::StagingMode staging;
+        const char *profile;
+        size_t shards;
+    };
+
+    const Scenario gScenarios[] = {
+        {"autocommit",           1, false, false, WebkitCacher::StagingMode::Direct, "default",        0},
+        {"bulk",                 1, true,  false, WebkitCacher::StagingMode::Direct, "default",        0},
+        {"bulk-jobs4",           4, true,  false, WebkitCacher::StagingMode::Direct, "default",        0},
+        {"bulk-jobs4-dedup",     4, true,  true,  WebkitCacher::StagingMode::Direct, "default",        0},
+        {"staged-fast",          4, true,  true,  WebkitCacher::StagingMode::Memory, "fast",           0},
+        {"staged-fast-indexes",  4, true,  true,  WebkitCacher::StagingMode::Memory, "fast,indexes=1", 0},
+        {"sharded4-fast",        1, false, true,  WebkitCacher::StagingMode::Direct, "fast",           4},
+    };
+
+    struct RunResult {
+        bool ok;
+        double seconds;
+        uint64_t dbBytes;
+    };
+
+    struct ScenarioResult {
+        const Scenario *scenario;
+        RunResult run;
+        uint64_t peakRSSKiB;
+    };
+
+    const char *stagingName(WebkitCacher::StagingMode staging){
+        switch (staging) {
+            case WebkitCacher::StagingMode::Direct: return "direct";
+            case WebkitCacher::StagingMode::Memory: return "memory";
+            case WebkitCacher::StagingMode::TempFile: return "temp";
+        }
+        return "unknown";
+    }
+
+    RunResult runScenario(const Scenario &s, const std::string &tree, const std::string &dbPath, const TreeGenerator::Stats &stats, size_t redirects){
+        RunResult ret = {};
+        StorageProfile profile = StorageProfile::parse(s.profile);
+        auto start = std::chrono::steady_clock::now();
+        {
+            WebkitCacher wk(dbPath, s.staging, profile);
+            wk.setJobs(s.jobs);
+            wk.setDeduplicate(s.dedup);
+            if (s.shards) {
+                ShardedBuild sharded(wk, dbPath, s.shards);
+                sharded.setConfigure([&s](WebkitCacher &shard, size_t){
+                    shard.setJobs(s.jobs);
+                    shard.setDeduplicate(s.dedup);
+                });
+                sharded.cacheDirectory(BENCH_URL, tree);
+            }
+            if (s.bulk) wk.beginTransaction();
+            if (!s.shards) wk.cacheDirectory(BENCH_URL, tree);
+            for (size_t i = 0; i < redirects && stats.paths.size(); i++) {
+                wk.addRedirect(BENCH_URL "redirect/" + std::to_string(i), BENCH_URL + stats.paths[i % stats.paths.size()]);
+            }
+            if (s.bulk) wk.commitTransaction();
+            if (profile.compact) wk.compact();
+            if (s.staging != WebkitCacher::StagingMode::Direct) wk.publish();
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        ret.seconds = elapsed.count();
+        {
+            struct stat st = {};
+            if (!stat(dbPath.c_str(), &st)) ret.dbBytes = st.st_size;
+        }
+        ret.ok = true;
+        return ret;
+    }
+
+    /*
+     Every scenario runs in its own process, so peak RSS is measured per scenario.
+     */
+    ScenarioResult forkScenario(const Scenario &s, const std::string &tree, const std::string &workdir, const TreeGenerator::Stats &stats, size_t redirects){
+        ScenarioResult ret = {};
+        int fds[2] = {-1,-1};
+        pid_t pid = 0;
+        int status = 0;
+        struct rusage ru = {};
+        std::string dbPath = workdir + s.name + ".db";
+        ret.scenario = &s;
+
+        retassure(!pipe(fds), "Failed to create pipe");
+        retassure((pid = fork()) != -1, "Failed to fork");
+        if (!pid) {
+            RunResult res = {};
+            close(fds[0]);
+            try {
+                res = runScenario(s, tree, dbPath, stats, redirects);
+            } catch (tihmstar::exception &e) {
+                e.dump();
+                res.ok = false;
+            }
+            if (write(fds[1], &res, sizeof(res)) != sizeof(res)) _exit(1);
+            _exit(0);
+        }
+        close(fds[1]);
+        if (read(fds[0], &ret.run, sizeof(ret.run)) != sizeof(ret.run)) ret.run.ok = false;
+        close(fds[0]);
+        retassure(wait4(pid, &status, 0, &ru) == pid, "Failed to wait for scenario '%s'",s.name);
+#ifdef __APPLE__
+        ret.peakRSSKiB = ru.ru_maxrss / 1024;
+#else
+        ret.peakRSSKiB = ru.ru_maxrss;
+#endif
+        if (!WIFEXITED(status) || WEXITSTATUS(status)) ret.run.ok = false;
+        return ret;
+    }
+
+    int removeEntry(const char *path, const struct stat *, int, struct FTW *){
+        return remove(path);
+    }
+}
+
+static struct option longopts[] = {
+    { "help",           no_argument,        NULL, 'h' },
+    { "seed",           required_argument,  NULL, 's' },
+    { "files",          required_argument,  NULL, 'n' },
+    { "depth",          required_argument,  NULL, 'd' },
+    { "median-size",    required_argument,  NULL, 'm' },
+    { "max-size",       required_argument,  NULL, 'z' },
+    { "duplicates",     required_argument,  NULL, 'u' },
+    { "redirects",      required_argument,  NULL, 'r' },
+    { "scenario",       required_argument,  NULL, 'S' },
+    { "output",         required_argument,  NULL, 'o' },
+    { "workdir",        required_argument,  NULL, 'w' },
+    { "keep",           no_argument,        NULL, 'k' },
+    { NULL, 0, NULL, 0 }
+};
+
+void cmd_help(){
+    printf("Usage: wkc-bench [OPTIONS]\n");
+    printf("Benchmarks cache ingest on a synthetic web tree, results are written as JSON\n\n");
+    printf("  -h, --help\t\t\t\tprints usage information\n");
+    printf("  -s, --seed <N>\t\t\tseed of the tree generator (default 1)\n");
+    printf("  -n, --files <N>\t\t\tnumber of files (default 1000)\n");
+    printf("  -d, --depth <N>\t\t\tmaximum directory depth (default 3)\n");
+    printf("  -m, --median-size <bytes>\t\tmedian file size (default 8192)\n");
+    printf("  -z, --max-size <bytes>\t\tlargest file (default 16MiB)\n");
+    printf("  -u, --duplicates <ratio>\t\tfraction of files repeating earlier content (default 0.1)\n");
+    printf("  -r, --redirects <N>\t\t\tnumber of redirects added after caching (default 100)\n");
+    printf("  -S, --scenario <name>\t\t\tonly run this scenario, can be given multiple times\n");
+    printf("  -o, --output <file>\t\t\twrite JSON results to file instead of stdout\n");
+    printf("  -w, --workdir <dir>\t\t\tdirectory for tree and databases (default: temporary directory)\n");
+    printf("  -k, --keep\t\t\t\tdon't delete the work directory\n");
+    printf("\nScenarios:\n");
+    for (auto &s : gScenarios) {
+        printf("  %s\n",s.name);
+    }
+}
+
+int main_r(int argc, const char * argv[]) {
+    TreeGenerator::Spec spec;
+    size_t redirects = 100;
+    std::vector<std::string> selected;
+    const char *output = NULL;
+    std::string workdir;
+    bool keep = false;
+    bool createdWorkdir = false;
+    FILE *out = stdout;
+    std::vector<ScenarioResult> results;
+    cleanup([&]{
+        if (out && out != stdout) fclose(out);
+        if (createdWorkdir && !keep) nftw(workdir.c_str(), removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+    });
+
+    int optindex = 0;
+    int opt = 0;
+
+    while ((opt = getopt_long(argc, (char* const *)argv, "hs:n:d:m:z:u:r:S:o:w:k", longopts, &optindex)) > 0) {
+        switch (opt) {
+            case 'h':
+                cmd_help();
+                return 0;
+            case 's':
+                spec.seed = strtoull(optarg, NULL, 0);
+                break;
+            case 'n':
+                spec.files = strtoul(optarg, NULL, 0);
+                break;
+            case 'd':
+                spec.depth = strtoul(optarg, NULL, 0);
+                break;
+            case 'm':
+                spec.sizeMedian = strtoull(optarg, NULL, 0);
+                break;
+            case 'z':
+                spec.sizeMax = strtoull(optarg, NULL, 0);
+                break;
+            case 'u':
+                spec.duplicateRatio = strtod(optarg, NULL);
+                break;
+            case 'r':
+                redirects = strtoul(optarg, NULL, 0);
+                break;
+            case 'S':
+                selected.push_back(optarg);
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'w':
+                workdir = optarg;
+                break;
+            case 'k':
+                keep = true;
+                break;
+
+            default:
+                cmd_help();
+                return -1;
+        }
+    }
+
+    if (workdir.empty()) {
+        char tmpl[] = "/tmp/wkc-bench.XXXXXX";
+        retassure(mkdtemp(tmpl), "Failed to create work directory");
+        workdir = tmpl;
+        createdWorkdir = true;
+    }else{
+        retassure(!mkdir(workdir.c_str(), 0755), "Work directory '%s' must not exist",workdir.c_str());
+        createdWorkdir = true;
+    }
+    if (workdir.back() != '/') workdir += '/';
+
+    if (output) {
+        retassure(out = fopen(output, "w"), "Failed to open '%s'",output);
+    }
+
+    fprintf(stderr, "Generating tree with %zu files in '%s'\n",spec.files,workdir.c_str());
+    TreeGenerator gen(spec);
+    auto stats = gen.generate(workdir + "tree");
+
+    for (auto &s : gScenarios) {
+        if (selected.size()) {
+            bool found = false;
+            for (auto &sel : selected) found |= (sel == s.name);
+            if (!found) continue;
+        }
+        fprintf(stderr, "Running scenario '%s'\n",s.name);
+        results.push_back(forkScenario(s, workdir + "tree", workdir, stats, redirects));
+        auto &r = results.back();
+        fprintf(stderr, "  %s: %.3f seconds, %.0f files/s, %.2f MB/s, peak RSS %llu KiB, db %llu bytes\n",
+                r.run.ok ? "ok" : "FAILED", r.run.seconds,
+                r.run.seconds ? stats.files / r.run.seconds : 0,
+                r.run.seconds ? stats.bytes / r.run.seconds / 1e6 : 0,
+                (unsigned long long)r.peakRSSKiB, (unsigned long long)r.run.dbBytes);
+    }
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"version\": \"%s\",\n",VERSION_STRING);
+    fprintf(out, "  \"tree\": {\"seed\": %llu, \"files\": %zu, \"directories\": %zu, \"duplicates\": %zu, \"bytes\": %llu, \"redirects\": %zu},\n",
+            (unsigned long long)spec.seed, stats.files, stats.directories, stats.duplicates, (unsigned long long)stats.bytes, redirects);
+    fprintf(out, "  \"results\": [\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        auto &r = results[i];
+        fprintf(out, "    {\"scenario\": \"%s\", \"ok\": %s, \"jobs\": %zu, \"bulk\": %s, \"dedup\": %s, \"staging\": \"%s\", \"profile\": \"%s\", \"shards\": %zu, "
+                "\"wall_seconds\": %.6f, \"files_per_second\": %.1f, \"mb_per_second\": %.3f, \"peak_rss_kib\": %llu, \"db_bytes\": %llu}%s\n",
+                r.scenario->name, r.run.ok ? "true" : "false", r.scenario->jobs,
+                r.scenario->bulk ? "true" : "false", r.scenario->dedup ? "true" : "false",
+                stagingName(r.scenario->staging), r.scenario->profile, r.scenario->shards,
+                r.run.seconds,
+                r.run.seconds ? stats.files / r.run.seconds : 0,
+                r.run.seconds ? stats.bytes / r.run.seconds / 1e6 : 0,
+                (unsigned long long)r.peakRSSKiB, (unsigned long long)r.run.dbBytes,
+                i+1 < results.size() ? "," : "");
+    }
+    fprintf(out, "  ]\n");
+    fprintf(out, "}\n");
+
+    for (auto &r : results) {
+        if (!r.run.ok) return 1;
+    }
+    return 0;
+}
+
+int main(int argc, const char * argv[]) {
+#ifdef DEBUG
+    return main_r(argc, argv);
+#else
+    try {
+        return main_r(argc, argv);
+    } catch (tihmstar::exception &e) {
+        printf("wkc-bench: failed with exception:\n");
+        e.dump();
+        return e.code();
+    }
+#endif
+}
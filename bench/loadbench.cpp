@@ -0,0 +1,347 @@
+//
+//  loadbench.cpp
+//  webkitCacher
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sqlite3.h>
+#include <libgeneral/macros.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+
+#define READ_CHUNK_SIZE (1024*1024)
+
+namespace {
+    typedef std::chrono::steady_clock clock;
+
+    /*
+     Queries ApplicationCacheStorage runs when it opens the database and loads a cache group, in that order.
+     */
+    enum QueryID {
+        DeletedFiles = 0,
+        HostHashes,
+        Groups,
+        Cache,
+        Whitelist,
+        AllowsAll,
+        Fallback,
+        Quota,
+        Usage,
+        QueryCount
+    };
+
+    struct Query {
+        const char *name;
+        const char *sql;
+    };
+
+    const Query gQueries[QueryCount] = {
+        {"deleted_files",   "SELECT DeletedCacheResources.path FROM DeletedCacheResources LEFT JOIN CacheResourceData "
+                            "ON DeletedCacheResources.path = CacheResourceData.path WHERE CacheResourceData.path IS NULL"},
+        {"host_hashes",     "SELECT manifestHostHash FROM CacheGroups"},
+        {"groups",          "SELECT id, manifestURL, newestCache, origin FROM CacheGroups WHERE newestCache IS NOT NULL"},
+        {"cache",           "SELECT url, type, mimeType, textEncodingName, headers, CacheResourceData.data, CacheResourceData.path "
+                            "FROM CacheEntries INNER JOIN CacheResources ON CacheEntries.resource = CacheResources.id "
+                            "INNER JOIN CacheResourceData ON CacheResourceData.id = CacheResources.data WHERE CacheEntries.cache = ?"},
+        {"whitelist",       "SELECT url FROM CacheWhitelistURLs WHERE cache = ?"},
+        {"allows_all",      "SELECT wildcard FROM CacheAllowsAllNetworkRequests WHERE cache = ?"},
+        {"fallback",        "SELECT namespace, fallbackURL FROM FallbackURLs WHERE cache = ?"},
+        {"quota",           "SELECT quota FROM Origins WHERE origin = ?"},
+        {"usage",           "SELECT SUM(Caches.size) FROM Caches INNER JOIN CacheGroups ON Caches.cacheGroup = CacheGroups.id WHERE CacheGroups.origin = ?"},
+    };
+
+    struct QueryStats {
+        uint64_t rows;
+        std::vector<double> samples; //seconds per execution
+    };
+
+    struct Group {
+        int id;
+        int newestCache;
+        std::string origin;
+    };
+
+    struct LoadResult {
+        double seconds;
+        uint64_t resources;
+        uint64_t payloadBytes;
+    };
+
+    /*
+     Drops the file from the page cache, so the next read has to go to the disk.
+     */
+    void evictFile(const std::string &path){
+        int fd = -1;
+        cleanup([&]{
+            safeClose(fd);
+        });
+        if ((fd = open(path.c_str(), O_RDONLY)) == -1) return;
+#ifdef POSIX_FADV_DONTNEED
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+    }
+
+    uint64_t readFile(const std::string &path, std::vector<uint8_t> &chunk){
+        int fd = -1;
+        cleanup([&]{
+            safeClose(fd);
+        });
+        uint64_t total = 0;
+        ssize_t didRead = 0;
+        retassure((fd = open(path.c_str(), O_RDONLY)) != -1, "Failed to open flat file '%s'",path.c_str());
+        while ((didRead = read(fd, chunk.data(), chunk.size())) > 0) total += didRead;
+        retassure(didRead == 0, "Failed to read flat file '%s'",path.c_str());
+        return total;
+    }
+
+    class Loader {
+        std::string _dbPath;
+        std::string _flatFileDir;
+        std::vector<QueryStats> &_stats;
+        std::vector<uint8_t> _chunk;
+        sqlite3 *_db;
+
+        /*
+         Times prepare, bind, all steps and the consumption of the rows, the way WebKit runs every query on its own statement.
+         */
+        void run(QueryID q, std::function<void(sqlite3_stmt *stmt)> bind, std::function<void(sqlite3_stmt *stmt)> row){
+            sqlite3_stmt *stmt = NULL;
+            cleanup([&]{
+                safeFreeCustom(stmt, sqlite3_finalize);
+            });
+            int sqlite_err = 0;
+            auto start = clock::now();
+            retassure(!(sqlite_err = sqlite3_prepare_v2(_db, gQueries[q].sql, -1, &stmt, NULL)), "Failed to prepare '%s' with error=%d (%s)",gQueries[q].name,sqlite_err,sqlite3_errmsg(_db));
+            if (bind) bind(stmt);
+            while ((sqlite_err = sqlite3_step(stmt)) == SQLITE_ROW) {
+                if (row) row(stmt);
+                _stats[q].rows++;
+            }
+            retassure(sqlite_err == SQLITE_DONE, "Failed to run '%s' with error=%d",gQueries[q].name,sqlite_err);
+            std::chrono::duration<double> elapsed = clock::now() - start;
+            _stats[q].samples.push_back(elapsed.count());
+        }
+
+    public:
+        Loader(const std::string &dbPath, std::vector<QueryStats> &stats)
+        : _dbPath(dbPath), _stats(stats), _chunk(READ_CHUNK_SIZE), _db(NULL)
+        {
+            size_t lastSlash = dbPath.rfind('/');
+            _flatFileDir = (lastSlash == std::string::npos ? std::string() : dbPath.substr(0,lastSlash+1)) + "ApplicationCache/";
+        }
+
+        ~Loader(){
+            safeFreeCustom(_db, sqlite3_close);
+        }
+
+        void evict(){
+            evictFile(_dbPath);
+            {
+                sqlite3 *db = NULL;
+                sqlite3_stmt *stmt = NULL;
+                cleanup([&]{
+                    safeFreeCustom(stmt, sqlite3_finalize);
+                    safeFreeCustom(db, sqlite3_close);
+                });
+                if (sqlite3_open_v2(_dbPath.c_str(), &db, SQLITE_OPEN_READONLY, NULL)) return;
+                if (sqlite3_prepare_v2(db, "SELECT path FROM CacheResourceData WHERE path NOT NULL", -1, &stmt, NULL)) return;
+                while (sqlite3_step(stmt) == SQLITE_ROW) {
+                    const char *path = (const char *)sqlite3_column_text(stmt, 0);
+                    if (path) evictFile(_flatFileDir + path);
+                }
+            }
+            evictFile(_dbPath); //reading the paths pulled some pages back in
+        }
+
+        LoadResult load(){
+            LoadResult ret = {};
+            std::vector<Group> groups;
+            int sqlite_err = 0;
+            auto start = clock::now();
+
+            retassure(!(sqlite_err = sqlite3_open_v2(_dbPath.c_str(), &_db, SQLITE_OPEN_READONLY, NULL)), "Failed to open '%s' with error=%d",_dbPath.c_str(),sqlite_err);
+
+            run(DeletedFiles, nullptr, nullptr);
+            run(HostHashes, nullptr, nullptr);
+            run(Groups, nullptr, [&](sqlite3_stmt *stmt){
+                const char *origin = (const char *)sqlite3_column_text(stmt, 3);
+                groups.push_back({sqlite3_column_int(stmt, 0),sqlite3_column_int(stmt, 2),origin ? origin : ""});
+            });
+
+            for (auto &g : groups) {
+                auto bindCache = [&](sqlite3_stmt *stmt){
+                    sqlite3_bind_int(stmt, 1, g.newestCache);
+                };
+                auto bindOrigin = [&](sqlite3_stmt *stmt){
+                    sqlite3_bind_text(stmt, 1, g.origin.c_str(), (int)g.origin.size(), SQLITE_STATIC);
+                };
+                run(Cache, bindCache, [&](sqlite3_stmt *stmt){
+                    const char *path = (const char *)sqlite3_column_text(stmt, 6);
+                    if (path && *path) {
+                        ret.payloadBytes += readFile(_flatFileDir + path, _chunk);
+                    }else{
+                        sqlite3_column_blob(stmt, 5);
+                        ret.payloadBytes += sqlite3_column_bytes(stmt, 5);
+                    }
+                    ret.resources++;
+                });
+                run(Whitelist, bindCache, nullptr);
+                run(AllowsAll, bindCache, nullptr);
+                run(Fallback, bindCache, nullptr);
+                run(Quota, bindOrigin, nullptr);
+                run(Usage, bindOrigin, nullptr);
+            }
+
+            safeFreeCustom(_db, sqlite3_close);
+            std::chrono::duration<double> elapsed = clock::now() - start;
+            ret.seconds = elapsed.count();
+            return ret;
+        }
+    };
+
+    double percentile(std::vector<double> samples, double p){
+        if (samples.empty()) return 0;
+        std::sort(samples.begin(), samples.end());
+        size_t idx = (size_t)(p * (samples.size()-1) + 0.5);
+        return samples[idx];
+    }
+
+    double sum(const std::vector<double> &samples){
+        double ret = 0;
+        for (auto s : samples) ret += s;
+        return ret;
+    }
+}
+
+static struct option longopts[] = {
+    { "help",           no_argument,        NULL, 'h' },
+    { "iterations",     required_argument,  NULL, 'n' },
+    { "warm",           no_argument,        NULL, 'w' },
+    { "output",         required_argument,  NULL, 'o' },
+    { NULL, 0, NULL, 0 }
+};
+
+void cmd_help(){
+    printf("Usage: wkc-loadbench [OPTIONS] <ApplicationCache.db file>\n");
+    printf("Replays the queries WebKit runs to load every cache group of the database, results are written as JSON\n\n");
+    printf("  -h, --help\t\t\t\tprints usage information\n");
+    printf("  -n, --iterations <N>\t\t\tnumber of loads (default 10)\n");
+    printf("  -w, --warm\t\t\t\tdon't drop the database and flat files from the page cache before every load\n");
+    printf("  -o, --output <file>\t\t\twrite JSON results to file instead of stdout\n");
+}
+
+int main_r(int argc, const char * argv[]) {
+    size_t iterations = 10;
+    bool warm = false;
+    const char *output = NULL;
+    const char *dbPath = NULL;
+    FILE *out = stdout;
+    cleanup([&]{
+        if (out && out != stdout) fclose(out);
+    });
+    std::vector<QueryStats> stats(QueryCount);
+    std::vector<double> loads;
+    LoadResult last = {};
+
+    int optindex = 0;
+    int opt = 0;
+
+    while ((opt = getopt_long(argc, (char* const *)argv, "hn:wo:", longopts, &optindex)) > 0) {
+        switch (opt) {
+            case 'h':
+                cmd_help();
+                return 0;
+            case 'n':
+                iterations = strtoul(optarg, NULL, 0);
+                break;
+            case 'w':
+                warm = true;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+
+            default:
+                cmd_help();
+                return -1;
+        }
+    }
+
+    if (argc-optind != 1) {
+        cmd_help();
+        return -1;
+    }
+    dbPath = argv[optind];
+    {
+        struct stat st = {};
+        retassure(!stat(dbPath, &st), "Database '%s' doesn't exist",dbPath);
+    }
+    if (output) {
+        retassure(out = fopen(output, "w"), "Failed to open '%s'",output);
+    }
+
+    Loader loader(dbPath, stats);
+    for (size_t i = 0; i < iterations; i++) {
+        if (!warm) loader.evict();
+        last = loader.load();
+        loads.push_back(last.seconds);
+    }
+
+    fprintf(stderr, "%s load of %zu resources (%llu bytes), %zu iterations\n",warm ? "Warm" : "Cold",
+            (size_t)last.resources,(unsigned long long)last.payloadBytes,iterations);
+    fprintf(stderr, "  load: mean %.3f ms, p50 %.3f ms, max %.3f ms\n",
+            loads.size() ? sum(loads)*1e3/loads.size() : 0,percentile(loads, 0.5)*1e3,percentile(loads, 1)*1e3);
+    fprintf(stderr, "Query               calls    mean us     p50 us     p99 us     max us\n");
+    for (int q = 0; q < QueryCount; q++) {
+        auto &s = stats[q].samples;
+        fprintf(stderr, "%-16s %8zu %10.1f %10.1f %10.1f %10.1f\n",gQueries[q].name,s.size(),
+                s.size() ? sum(s)*1e6/s.size() : 0,percentile(s, 0.5)*1e6,percentile(s, 0.99)*1e6,percentile(s, 1)*1e6);
+    }
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"version\": \"%s\",\n",VERSION_STRING);
+    fprintf(out, "  \"database\": \"%s\",\n",dbPath);
+    fprintf(out, "  \"cold\": %s,\n",warm ? "false" : "true");
+    fprintf(out, "  \"iterations\": %zu,\n",iterations);
+    fprintf(out, "  \"resources\": %llu,\n",(unsigned long long)last.resources);
+    fprintf(out, "  \"payload_bytes\": %llu,\n",(unsigned long long)last.payloadBytes);
+    fprintf(out, "  \"load_seconds\": {\"mean\": %.6f, \"p50\": %.6f, \"max\": %.6f},\n",
+            loads.size() ? sum(loads)/loads.size() : 0,percentile(loads, 0.5),percentile(loads, 1));
+    fprintf(out, "  \"queries\": [\n");
+    for (int q = 0; q < QueryCount; q++) {
+        auto &s = stats[q].samples;
+        fprintf(out, "    {\"query\": \"%s\", \"calls\": %zu, \"rows\": %llu, \"total_seconds\": %.6f, "
+                "\"mean_us\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f}%s\n",
+                gQueries[q].name,s.size(),(unsigned long long)stats[q].rows,sum(s),
+                s.size() ? sum(s)*1e6/s.size() : 0,percentile(s, 0.5)*1e6,percentile(s, 0.99)*1e6,percentile(s, 1)*1e6,
+                q+1 < QueryCount ? "," : "");
+    }
+    fprintf(out, "  ]\n");
+    fprintf(out, "}\n");
+    return 0;
+}
+
+int main(int argc, const char * argv[]) {
+#ifdef DEBUG
+    return main_r(argc, argv);
+#else
+    try {
+        return main_r(argc, argv);
+    } catch (tihmstar::exception &e) {
+        printf("wkc-loadbench: failed with exception:\n");
+        e.dump();
+        return e.code();
+    }
+#endif
+}
@@ -0,0 +1,118 @@
+//
+//  patchtest.cpp
+//  webkitCacher
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "WebkitCacher.hpp"
+#include "CacheReader.hpp"
+#include "CachePatch.hpp"
+#include <libgeneral/macros.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#define TEST_URL "http://patchtest.local/"
+
+namespace {
+    typedef std::map<std::string, std::string> Files; //name below TEST_URL, content
+
+    int removeEntry(const char *path, const struct stat *, int, struct FTW *){
+        return remove(path);
+    }
+
+    void buildDatabase(const std::string &path, const Files &files){
+        WebkitCacher wk(path);
+        for (auto &f : files) {
+            wk.putResource(TEST_URL + f.first, "", f.second.data(), f.second.size());
+        }
+    }
+
+    Files readDatabase(const std::string &path){
+        Files ret;
+        CacheReader reader(path);
+        for (auto &r : reader.resources()) {
+            if (r.isRedirect() || r.url.compare(0, sizeof(TEST_URL)-1, TEST_URL) || r.url == TEST_URL "cache.cache") continue;
+            auto src = reader.open(r);
+            std::string content;
+            content.resize((size_t)src->size());
+            if (content.size()) retassure(src->readAt(0, &content[0], content.size()) == content.size(), "Failed to read '%s'",r.url.c_str());
+            ret[r.url.substr(sizeof(TEST_URL)-1)] = content;
+        }
+        return ret;
+    }
+
+    /*
+     Builds both databases, patches a copy of the old one and checks that it ends up with the files of the new one.
+     */
+    void checkPatch(const std::string &workdir, const char *name, const Files &oldFiles, const Files &newFiles){
+        std::string oldPath = workdir + name + "-old.db";
+        std::string newPath = workdir + name + "-new.db";
+        std::string patchPath = workdir + name + ".wkcpatch";
+
+        buildDatabase(oldPath, oldFiles);
+        buildDatabase(newPath, newFiles);
+        CachePatch::diff(oldPath, newPath, patchPath);
+        {
+            WebkitCacher wk(oldPath);
+            CachePatch::apply(wk, oldPath, patchPath);
+        }
+        retassure(readDatabase(oldPath) == newFiles, "%s: patched database differs from the new database",name);
+
+        //the old database is gone now, so the patch must not apply a second time
+        try {
+            WebkitCacher wk(oldPath);
+            CachePatch::apply(wk, oldPath, patchPath);
+        } catch (tihmstar::exception &e) {
+            retassure(readDatabase(oldPath) == newFiles, "%s: refused patch modified the database",name);
+            printf("%s: ok\n",name);
+            return;
+        }
+        reterror("%s: patch was applied to a database it wasn't made from",name);
+    }
+}
+
+int main_r(int argc, const char * argv[]) {
+    std::string workdir;
+    cleanup([&]{
+        if (workdir.size()) nftw(workdir.c_str(), removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+    });
+
+    {
+        char tmpl[] = "/tmp/wkc-patchtest.XXXXXX";
+        retassure(mkdtemp(tmpl), "Failed to create work directory");
+        workdir = tmpl;
+        workdir += '/';
+    }
+
+    checkPatch(workdir, "swap",
+               {{"a.js","AAAA"},{"b.js","BBBB"},{"c.js","CCCC"}},
+               {{"a.js","BBBB"},{"b.js","AAAA"},{"c.js","CCCC"}});
+    checkPatch(workdir, "rotate",
+               {{"a.js","AAAA"},{"b.js","BBBB"},{"c.js","CCCC"}},
+               {{"a.js","CCCC"},{"b.js","AAAA"},{"c.js","BBBB"}});
+    checkPatch(workdir, "copy-and-change",
+               {{"a.js","AAAA"},{"b.js","BBBB"}},
+               {{"a.js","BBBB"},{"b.js","bbbb"},{"d.js","AAAA"}});
+    return 0;
+}
+
+int main(int argc, const char * argv[]) {
+#ifdef DEBUG
+    return main_r(argc, argv);
+#else
+    try {
+        return main_r(argc, argv);
+    } catch (tihmstar::exception &e) {
+        printf("wkc-patchtest: failed with exception:\n");
+        e.dump();
+        return e.code();
+    }
+#endif
+}
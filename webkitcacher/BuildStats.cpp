@@ -0,0 +1,186 @@
+//
+//  BuildStats.cpp
+//  webkitCacher
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#include "BuildStats.hpp"
+
+#pragma mark BuildStats::Scope
+
+BuildStats::Scope::Scope(BuildStats &stats, Phase phase)
+: _stats(stats)
+{
+    _stats.enter(phase);
+}
+
+BuildStats::Scope::~Scope(){
+    _stats.leave();
+}
+
+#pragma mark BuildStats
+
+BuildStats::BuildStats()
+: _phaseNanoseconds{}, _phaseCalls{}, _counters{}
+{
+    _stack.reserve(16);
+}
+
+void BuildStats::accountElapsed(){
+    clock::time_point now = clock::now();
+    if (_stack.size()) {
+        _phaseNanoseconds[_stack.back()] += std::chrono::duration_cast<std::chrono::nanoseconds>(now - _last).count();
+    }
+    _last = now;
+}
+
+void BuildStats::enter(Phase phase){
+    accountElapsed();
+    _stack.push_back(phase);
+    _phaseCalls[phase]++;
+}
+
+void BuildStats::leave(){
+    accountElapsed();
+    if (_stack.size()) _stack.pop_back();
+}
+
+uint64_t BuildStats::counter(Counter counter) const{
+    return _counters[counter];
+}
+
+void BuildStats::addCounters(const BuildStats &other){
+    for (int i=0; i<CounterCount; i++) _counters[i] += other._counters[i];
+}
+
+double BuildStats::seconds(Phase phase) const{
+    return _phaseNanoseconds[phase] / 1e9;
+}
+
+uint64_t BuildStats::calls(Phase phase) const{
+    return _phaseCalls[phase];
+}
+
+double BuildStats::totalSeconds() const{
+    uint64_t total = 0;
+    for (int i=0; i<PhaseCount; i++) total += _phaseNanoseconds[i];
+    return total / 1e9;
+}
+
+const char *BuildStats::phaseName(Phase phase){
+    switch (phase) {
+        case Other:         return "other";
+        case Index:         return "index";
+        case Walk:          return "walk";
+        case Read:          return "read";
+        case Hash:          return "hash";
+        case Prepare:       return "prepare";
+        case Dedupe:        return "dedupe";
+        case DataWrite:     return "data_write";
+        case FlatFile:      return "flat_file";
+        case Resources:     return "resources";
+        case Entries:       return "entries";
+        case CachesSize:    return "caches_size";
+        case Remove:        return "remove";
+        case Merge:         return "merge";
+        case Commit:        return "commit";
+        case Compact:       return "compact";
+        case Publish:       return "publish";
+        default:            return "unknown";
+    }
+}
+
+const char *BuildStats::counterName(Counter counter){
+    switch (counter) {
+        case Directories:           return "directories";
+        case Files:                 return "files";
+        case FileBytes:             return "file_bytes";
+        case BytesRead:             return "bytes_read";
+        case StatementsPrepared:    return "statements_prepared";
+        case StatementsExecuted:    return "statements_executed";
+        case RowsInserted:          return "rows_inserted";
+        case RowsUpdated:           return "rows_updated";
+        case RowsDeleted:           return "rows_deleted";
+        case Queries:               return "queries";
+        case Redirects:             return "redirects";
+        default:                    return "unknown";
+    }
+}
+
+void BuildStats::printSummary(FILE *f) const{
+    double total = totalSeconds();
+    fprintf(f, "Phase           seconds      %%      calls\n");
+    for (int i=0; i<PhaseCount; i++) {
+        Phase p = (Phase)i;
+        if (!_phaseCalls[p]) continue;
+        fprintf(f, "%-14s %9.3f %6.1f %10llu\n",phaseName(p),seconds(p),total ? seconds(p)*100/total : 0,(unsigned long long)_phaseCalls[p]);
+    }
+    fprintf(f, "%-14s %9.3f\n","total",total);
+    fprintf(f, "\n");
+    for (int i=0; i<CounterCount; i++) {
+        fprintf(f, "%-20s %llu\n",counterName((Counter)i),(unsigned long long)_counters[i]);
+    }
+}
+
+void BuildStats::writeJSON(FILE *f) const{
+    bool first = true;
+    fprintf(f, "{\n  \"total_seconds\": %.6f,\n  \"phases\": {",totalSeconds());
+    for (int i=0; i<PhaseCount; i++) {
+        Phase p = (Phase)i;
+        fprintf(f, "%s\n    \"%s\": {\"seconds\": %.6f, \"calls\": %llu}",first ? "" : ",",phaseName(p),seconds(p),(unsigned long long)_phaseCalls[p]);
+        first = false;
+    }
+    fprintf(f, "\n  },\n  \"counters\": {");
+    first = true;
+    for (int i=0; i<CounterCount; i++) {
+        fprintf(f, "%s\n    \"%s\": %llu",first ? "" : ",",counterName((Counter)i),(unsigned long long)_counters[i]);
+        first = false;
+    }
+    fprintf(f, "\n  }\n}\n");
+}
+
+#pragma mark StatsResourceSource
+
+StatsResourceSource::StatsResourceSource(ResourceSource &src, BuildStats &stats)
+: _src(src), _stats(stats), _readFailed(false)
+{
+    //
+}
+
+uint64_t StatsResourceSource::size(){
+    return _src.size();
+}
+
+size_t StatsResourceSource::readAt(uint64_t offset, void *buf, size_t len){
+    BuildStats::Scope scope(_stats, BuildStats::Read);
+    size_t didRead = 0;
+    try {
+        didRead = _src.readAt(offset, buf, len);
+    } catch (...) {
+        _readFailed = true;
+        throw;
+    }
+    _stats.add(BuildStats::BytesRead, didRead);
+    return didRead;
+}
+
+bool StatsResourceSource::readFailed() const{
+    return _readFailed;
+}
+
+const void *StatsResourceSource::buffer(){
+    return _src.buffer();
+}
+
+int StatsResourceSource::fileDescriptor(){
+    return _src.fileDescriptor();
+}
+
+const char *StatsResourceSource::filePath(){
+    return _src.filePath();
+}
+
+bool StatsResourceSource::readsOnce(){
+    return _src.readsOnce();
+}
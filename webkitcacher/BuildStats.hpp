@@ -0,0 +1,123 @@
+//
+//  BuildStats.hpp
+//  webkitCacher
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#ifndef BuildStats_hpp
+#define BuildStats_hpp
+
+#include <stdint.h>
+#include <stdio.h>
+#include <chrono>
+#include <vector>
+#include "ResourceSource.hpp"
+
+/*
+ Per phase timers and counters of a cache build.
+ Phases nest, time is always accounted to the innermost phase only, so the phase times add up to the total.
+ Only meant to be used from the thread driving WebkitCacher.
+ */
+class BuildStats {
+public:
+    enum Phase {
+        Other = 0,      //inside a public call, but in no other phase
+        Index,          //loading the in-memory index
+        Walk,           //directory walk, or waiting for the ingest pipeline
+        Read,           //reading resource payloads
+        Hash,
+        Prepare,        //sqlite3_prepare_v2
+        Dedupe,         //looking up and comparing identical payloads
+        DataWrite,      //CacheResourceData rows
+        FlatFile,       //creating flat files
+        Resources,      //CacheResources rows
+        Entries,        //CacheEntries rows
+        CachesSize,     //Caches rows
+        Remove,         //removing stale resources
+        Merge,          //merging shard databases
+        Commit,
+        Compact,
+        Publish,
+        PhaseCount
+    };
+
+    enum Counter {
+        Directories = 0,
+        Files,
+        FileBytes,
+        BytesRead,
+        StatementsPrepared,
+        StatementsExecuted,
+        RowsInserted,
+        RowsUpdated,
+        RowsDeleted,
+        Queries,
+        Redirects,
+        CounterCount
+    };
+
+    class Scope {
+        BuildStats &_stats;
+    public:
+        Scope(BuildStats &stats, Phase phase);
+        ~Scope();
+    };
+
+private:
+    typedef std::chrono::steady_clock clock;
+
+    clock::time_point _last;
+    std::vector<Phase> _stack;
+    uint64_t _phaseNanoseconds[PhaseCount];
+    uint64_t _phaseCalls[PhaseCount];
+    uint64_t _counters[CounterCount];
+
+    void accountElapsed();
+
+public:
+    BuildStats();
+
+    void enter(Phase phase);
+    void leave();
+
+    inline void add(Counter counter, uint64_t n = 1){_counters[counter] += n;}
+    uint64_t counter(Counter counter) const;
+    /*
+     Adds the counters of a build on another thread. Its phase times overlap with the ones here
+     and would break the total, so they are not added.
+     */
+    void addCounters(const BuildStats &other);
+    double seconds(Phase phase) const;
+    uint64_t calls(Phase phase) const;
+    double totalSeconds() const;
+
+    static const char *phaseName(Phase phase);
+    static const char *counterName(Counter counter);
+
+    void printSummary(FILE *f) const;
+    void writeJSON(FILE *f) const;
+};
+
+/*
+ Forwards to another ResourceSource and accounts reads to the Read phase.
+ Remembers whether a read failed, so callers can tell errors of the source from their own.
+ */
+class StatsResourceSource : public ResourceSource {
+    ResourceSource &_src;
+    BuildStats &_stats;
+    bool _readFailed;
+public:
+    StatsResourceSource(ResourceSource &src, BuildStats &stats);
+    
+    bool readFailed() const;
+
+    virtual uint64_t size() override;
+    virtual size_t readAt(uint64_t offset, void *buf, size_t len) override;
+    virtual const void *buffer() override;
+    virtual int fileDescriptor() override;
+    virtual const char *filePath() override;
+    virtual bool readsOnce() override;
+};
+
+#endif /* BuildStats_hpp */
@@ -0,0 +1,349 @@
+//
+//  CachePatch.cpp
+//  webkitCacher
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#include "CachePatch.hpp"
+#include "CacheReader.hpp"
+#include "ContentHash.hpp"
+#include "WebkitCacher.hpp"
+#include <libgeneral/macros.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <map>
+#include <unordered_map>
+#include <vector>
+
+#define PATCH_MAGIC "WKCPATCH"
+#define PATCH_VERSION 2
+#define PATCH_CHUNK_SIZE (1024*1024)
+
+namespace {
+    class PatchWriter {
+        FILE *_f;
+        std::string _path;
+    public:
+        PatchWriter(const std::string &path) : _f(NULL), _path(path){
+            retassure(_f = fopen(path.c_str(), "wb"), "Failed to create patch '%s' with err=%d (%s)",path.c_str(),errno,strerror(errno));
+        }
+        ~PatchWriter(){
+            safeFreeCustom(_f, fclose);
+        }
+        void write(const void *buf, size_t len){
+            retassure(fwrite(buf, 1, len, _f) == len, "Failed to write patch '%s'",_path.c_str());
+        }
+        void u8(uint8_t v){
+            write(&v, 1);
+        }
+        void u32(uint32_t v){
+            uint8_t b[4] = {(uint8_t)v, (uint8_t)(v >> 8), (uint8_t)(v >> 16), (uint8_t)(v >> 24)};
+            write(b, sizeof(b));
+        }
+        void u64(uint64_t v){
+            u32((uint32_t)v);
+            u32((uint32_t)(v >> 32));
+        }
+        void str(const std::string &s){
+            u32((uint32_t)s.size());
+            write(s.data(), s.size());
+        }
+        void close(){
+            retassure(!fflush(_f) && !fsync(fileno(_f)), "Failed to write patch '%s'",_path.c_str());
+            retassure(!fclose(_f), "Failed to write patch '%s'",_path.c_str());
+            _f = NULL;
+        }
+    };
+    
+    class PatchReader {
+        int _fd;
+        uint64_t _pos;
+        std::string _path;
+    public:
+        PatchReader(const std::string &path) : _fd(-1), _pos(0), _path(path){
+            retassure((_fd = open(path.c_str(), O_RDONLY)) != -1, "Failed to open patch '%s' with err=%d (%s)",path.c_str(),errno,strerror(errno));
+        }
+        ~PatchReader(){
+            safeClose(_fd);
+        }
+        int fd() const {return _fd;}
+        uint64_t pos() const {return _pos;}
+        void skip(uint64_t len){_pos += len;}
+        void read(void *buf, size_t len){
+            FileRangeResourceSource src(_fd, _pos, len);
+            retassure(src.readAt(0, buf, len) == len, "Truncated patch '%s'",_path.c_str());
+            _pos += len;
+        }
+        uint8_t u8(){
+            uint8_t v = 0;
+            read(&v, 1);
+            return v;
+        }
+        uint32_t u32(){
+            uint8_t b[4] = {};
+            read(b, sizeof(b));
+            return (uint32_t)b[0] | ((uint32_t)b[1] << 8) | ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+        }
+        uint64_t u64(){
+            uint64_t lo = u32();
+            return lo | ((uint64_t)u32() << 32);
+        }
+        std::string str(){
+            std::string ret;
+            ret.resize(u32());
+            if (ret.size()) read(&ret[0], ret.size());
+            return ret;
+        }
+    };
+    
+    typedef CacheReader::Resource Resource;
+    
+    /*
+     Hashes payloads of one database on demand, each payload at most once.
+     */
+    class PayloadHasher {
+        CacheReader &_reader;
+        std::vector<uint8_t> &_chunk;
+        std::unordered_map<int, uint64_t> _hashForDataID;
+    public:
+        PayloadHasher(CacheReader &reader, std::vector<uint8_t> &chunk) : _reader(reader), _chunk(chunk) {}
+        uint64_t hash(const Resource &r){
+            auto it = _hashForDataID.find(r.dataID);
+            if (it != _hashForDataID.end()) return it->second;
+            auto src = _reader.open(r);
+            uint64_t h = ContentHash::hash(*src, _chunk.data(), _chunk.size());
+            _hashForDataID[r.dataID] = h;
+            return h;
+        }
+    };
+    
+    /*
+     Hash over URL, size and payload hash of every resource which is reachable by URL, in URL order.
+     */
+    uint64_t resourcesIdentity(const std::vector<Resource> &resources, PayloadHasher &hasher){
+        std::map<std::string, const Resource *> forUrl;
+        ContentHash identity;
+        for (auto &r : resources) {
+            forUrl.insert({r.url,&r}); //first resource with this URL wins, same as WebkitCacher
+        }
+        for (auto &r : forUrl) {
+            uint64_t v[3] = {r.second->size, r.second->contentLength, hasher.hash(*r.second)};
+            identity.update(r.first.c_str(), r.first.size()+1);
+            for (auto n : v) {
+                uint8_t b[8] = {};
+                for (int i=0; i<8; i++) b[i] = (uint8_t)(n >> (i*8));
+                identity.update(b, sizeof(b));
+            }
+        }
+        return identity.digest();
+    }
+    
+    //redirects point to the first regular resource with the same payload
+    std::unordered_map<int, const Resource *> regularResourceForDataID(const std::vector<Resource> &resources){
+        std::unordered_map<int, const Resource *> ret;
+        for (auto &r : resources) {
+            if (!r.isRedirect()) ret.insert({r.dataID,&r});
+        }
+        return ret;
+    }
+}
+
+CachePatch::Summary CachePatch::diff(const std::string &oldDatabase, const std::string &newDatabase, const std::string &patchPath){
+    Summary ret = {};
+    CacheReader oldReader(oldDatabase);
+    CacheReader newReader(newDatabase);
+    std::vector<Resource> oldResources = oldReader.resources();
+    std::vector<Resource> newResources = newReader.resources();
+    std::unordered_map<std::string, const Resource *> oldForUrl;
+    std::unordered_map<std::string, const Resource *> newForUrl;
+    std::unordered_multimap<uint64_t, const Resource *> oldForSize;
+    auto oldRegular = regularResourceForDataID(oldResources);
+    auto newRegular = regularResourceForDataID(newResources);
+    std::vector<uint8_t> chunk(PATCH_CHUNK_SIZE);
+    PayloadHasher oldHasher(oldReader, chunk);
+    PayloadHasher newHasher(newReader, chunk);
+    std::vector<std::pair<const Resource *, const Resource *>> copies; //new resource, old source
+    std::vector<const Resource *> puts;
+    std::vector<std::pair<std::string, std::string>> redirects;
+    std::vector<std::string> removes;
+    
+    for (auto &r : oldResources) {
+        oldForUrl.insert({r.url,&r}); //first resource with this URL wins, same as WebkitCacher
+        if (!r.isRedirect()) oldForSize.insert({r.size,&r});
+    }
+    for (auto &r : newResources) {
+        newForUrl.insert({r.url,&r});
+    }
+    
+    for (auto &r : newResources) {
+        if (newForUrl[r.url] != &r) continue; //shadowed by an earlier resource with this URL
+        auto old = oldForUrl.find(r.url);
+        const Resource *o = (old != oldForUrl.end()) ? old->second : NULL;
+        
+        if (r.isRedirect()) {
+            auto target = newRegular.find(r.dataID);
+            if (target == newRegular.end()) continue; //dangling, nothing a patch could point it to
+            if (o && o->isRedirect()) {
+                auto oldTarget = oldRegular.find(o->dataID);
+                if (oldTarget != oldRegular.end() && oldTarget->second->url == target->second->url
+                    && oldHasher.hash(*oldTarget->second) == newHasher.hash(*target->second)) {
+                    continue; //still points to the same URL, whose payload may have changed on its own
+                }
+            }
+            redirects.push_back({r.url,target->second->url});
+            continue;
+        }
+        
+        if (o && !o->isRedirect() && o->mimeType == r.mimeType && o->size == r.size
+            && oldHasher.hash(*o) == newHasher.hash(r)) {
+            continue; //unchanged
+        }
+        
+        const Resource *source = NULL;
+        auto range = oldForSize.equal_range(r.size);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (oldForUrl[it->second->url] != it->second) continue; //unreachable by URL
+            if (oldHasher.hash(*it->second) == newHasher.hash(r)) {
+                source = it->second;
+                break;
+            }
+        }
+        if (source && r.size) {
+            copies.push_back({&r,source});
+        }else{
+            puts.push_back(&r);
+        }
+    }
+    
+    for (auto &r : oldResources) {
+        if (oldForUrl[r.url] != &r) continue;
+        if (newForUrl.find(r.url) == newForUrl.end()) removes.push_back(r.url);
+    }
+    
+    {
+        PatchWriter w(patchPath);
+        w.write(PATCH_MAGIC, sizeof(PATCH_MAGIC)-1);
+        w.u32(PATCH_VERSION);
+        w.u64(resourcesIdentity(oldResources, oldHasher));
+        for (auto &c : copies) {
+            w.u8(Op::Copy);
+            w.str(c.first->url);
+            w.str(c.first->mimeType);
+            w.str(c.second->url);
+            ret.copies++;
+        }
+        for (auto r : puts) {
+            auto src = newReader.open(*r);
+            uint64_t size = src->size();
+            w.u8(Op::Put);
+            w.str(r->url);
+            w.str(r->mimeType);
+            w.u64(size);
+            for (uint64_t offset = 0; offset < size;) {
+                size_t len = src->readAt(offset, chunk.data(), chunk.size());
+                retassure(len, "Failed to read resource '%s'",r->url.c_str());
+                w.write(chunk.data(), len);
+                offset += len;
+            }
+            ret.puts++;
+            ret.payloadBytes += size;
+        }
+        for (auto &r : redirects) {
+            w.u8(Op::Redirect);
+            w.str(r.first);
+            w.str(r.second);
+            ret.redirects++;
+        }
+        for (auto &u : removes) {
+            w.u8(Op::Remove);
+            w.str(u);
+            ret.removes++;
+        }
+        w.u8(Op::End);
+        w.close();
+    }
+    return ret;
+}
+
+uint64_t CachePatch::baseIdentity(const std::string &database){
+    CacheReader reader(database);
+    std::vector<uint8_t> chunk(PATCH_CHUNK_SIZE);
+    PayloadHasher hasher(reader, chunk);
+    return resourcesIdentity(reader.resources(), hasher);
+}
+
+CachePatch::Summary CachePatch::apply(WebkitCacher &wk, const std::string &database, const std::string &patchPath){
+    Summary ret = {};
+    PatchReader r(patchPath);
+    bool committed = false;
+    cleanup([&]{
+        if (!committed) wk.rollbackTransaction();
+    });
+    std::vector<WebkitCacher::ResourceCopy> copies;
+    
+    {
+        char magic[sizeof(PATCH_MAGIC)-1] = {};
+        r.read(magic, sizeof(magic));
+        retassure(!memcmp(magic, PATCH_MAGIC, sizeof(magic)), "'%s' is not a webkitcacher patch",patchPath.c_str());
+        uint32_t version = r.u32();
+        retassure(version == PATCH_VERSION, "Unsupported patch version %u",version);
+        uint64_t base = r.u64();
+        retassure(base == baseIdentity(database), "Patch '%s' was made from a different database than '%s'",patchPath.c_str(),database.c_str());
+    }
+    
+    wk.beginTransaction();
+    while (true) {
+        uint8_t op = r.u8();
+        if (op != Op::Copy && copies.size()) {
+            //sources are resolved before any copy is written, copies may swap payloads
+            wk.copyResources(copies);
+            ret.copies += copies.size();
+            copies.clear();
+        }
+        if (op == Op::End) break;
+        switch (op) {
+            case Op::Put:
+            {
+                std::string url = r.str();
+                std::string mimeType = r.str();
+                uint64_t size = r.u64();
+                FileRangeResourceSource data(r.fd(), r.pos(), size); //payload is streamed from the patch
+                wk.putResource(url, mimeType, data);
+                r.skip(size);
+                ret.puts++;
+                ret.payloadBytes += size;
+                break;
+            }
+            case Op::Copy:
+            {
+                WebkitCacher::ResourceCopy c;
+                c.url = r.str();
+                c.mimeType = r.str();
+                c.sourceUrl = r.str();
+                copies.push_back(c);
+                break;
+            }
+            case Op::Redirect:
+            {
+                std::string url = r.str();
+                std::string targetUrl = r.str();
+                wk.addRedirect(url, targetUrl);
+                ret.redirects++;
+                break;
+            }
+            case Op::Remove:
+                wk.deleteResource(r.str());
+                ret.removes++;
+                break;
+            default:
+                reterror("Unknown patch record %u at offset %llu",op,(unsigned long long)r.pos()-1);
+        }
+    }
+    wk.commitTransaction();
+    committed = true;
+    return ret;
+}
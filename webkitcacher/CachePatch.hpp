@@ -0,0 +1,69 @@
+//
+//  CachePatch.hpp
+//  webkitCacher
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#ifndef CachePatch_hpp
+#define CachePatch_hpp
+
+#include <stdint.h>
+#include <string>
+
+class WebkitCacher;
+
+/*
+ Resource level delta between two databases built by webkitcacher.
+ A patch only carries the payloads of resources which changed, payloads which already exist
+ in the old database under another URL are referenced instead of being shipped again.
+ A patch only applies to the database it was made from, which it identifies by a hash of the URL, size
+ and payload hash of every resource.
+
+ File format, all integers little endian:
+   "WKCPATCH" u32 version u64 base
+   records: u8 op, then
+     Put:       str url, str mimeType, u64 size, <size bytes>
+     Copy:      str url, str mimeType, str sourceUrl
+     Redirect:  str url, str targetUrl
+     Remove:    str url
+   u8 End
+ where str is u32 length followed by the bytes.
+ */
+class CachePatch {
+public:
+    enum Op : uint8_t {
+        End = 0,
+        Put,
+        Copy,
+        Redirect,
+        Remove
+    };
+    
+    struct Summary {
+        uint64_t puts;
+        uint64_t copies;
+        uint64_t redirects;
+        uint64_t removes;
+        uint64_t payloadBytes;
+    };
+    
+    /*
+     Writes a patch which turns oldDatabase into newDatabase.
+     */
+    static Summary diff(const std::string &oldDatabase, const std::string &newDatabase, const std::string &patchPath);
+    
+    /*
+     Identity of a database as recorded by diff, hashes every payload once.
+     */
+    static uint64_t baseIdentity(const std::string &database);
+    
+    /*
+     Applies patch to wk, which must have been opened on database, in a single transaction.
+     Fails unless database is the old database the patch was made from.
+     Copies are applied first and all at once, so they still see the old payloads.
+     */
+    static Summary apply(WebkitCacher &wk, const std::string &database, const std::string &patchPath);
+};
+
+#endif /* CachePatch_hpp */
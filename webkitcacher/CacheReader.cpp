@@ -0,0 +1,307 @@
+//
+//  CacheReader.cpp
+//  webkitCacher
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#include "CacheReader.hpp"
+#include "ContentHash.hpp"
+#include "DirectoryWalker.hpp"
+#include <libgeneral/macros.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#define READER_CHUNK_SIZE (1024*1024)
+#define RESOURCE_CACHEFILE "cache.cache"
+
+namespace {
+    /*
+     FileResourceSource which owns its file descriptor.
+     */
+    class FlatFileSource : public FileResourceSource {
+        int _fd;
+    public:
+        FlatFileSource(int fd, uint64_t size, const char *path) : FileResourceSource(fd, size, path), _fd(fd) {}
+        ~FlatFileSource(){ safeClose(_fd); }
+    };
+
+    uint64_t contentLengthFromHeaders(const char *headers){
+        const char *contentLength = NULL;
+        if (headers && (contentLength = strstr(headers, "Content-Length:"))) {
+            return strtoull(contentLength+sizeof("Content-Length:")-1, NULL, 10);
+        }
+        return 0;
+    }
+
+    void makeDirectories(const std::string &path){
+        for (size_t pos = path.find('/', 1); pos != std::string::npos; pos = path.find('/', pos+1)) {
+            std::string dir = path.substr(0,pos);
+            retassure(!mkdir(dir.c_str(), 0755) || errno == EEXIST, "Failed to create directory '%s' with err=%d (%s)",dir.c_str(),errno,strerror(errno));
+        }
+    }
+
+    //relative path for url, empty if the url can't be stored as a file
+    std::string relativePathForUrl(const std::string &resourceUrl, const std::string &url){
+        std::string rel;
+        if (url.size()) {
+            if (resourceUrl.compare(0, url.size(), url) != 0) return "";
+            rel = resourceUrl.substr(url.size());
+        }else{
+            size_t scheme = resourceUrl.find("://");
+            rel = (scheme == std::string::npos) ? resourceUrl : resourceUrl.substr(scheme+3);
+        }
+        if (rel.empty() || rel.back() == '/' || rel.front() == '/') return "";
+        for (size_t pos = 0; pos <= rel.size();) {
+            size_t end = rel.find('/', pos);
+            if (end == std::string::npos) end = rel.size();
+            std::string component = rel.substr(pos, end-pos);
+            if (component.empty() || component == "." || component == "..") return "";
+            pos = end+1;
+        }
+        return rel;
+    }
+
+    void listFiles(const std::string &dir, bool followSymlinks, std::vector<std::string> &files){
+        DirectoryWalker walker("/", dir); //same entries as a walk which caches dir
+        walker.setFollowSymlinks(followSymlinks);
+        walker.setPrefetchMetadata(false);
+        while (walker.next()) {
+            if (walker.type() == DirectoryWalker::Directory) continue;
+            if (walker.isDirectory()) walker.throwError();
+            files.push_back(walker.relativePath()); //files which can't be read are reported as missing or mismatched
+        }
+    }
+}
+
+#pragma mark BlobResourceSource
+
+BlobResourceSource::BlobResourceSource(sqlite3 *db, int dataID)
+: _blob(NULL), _size(0)
+{
+    int sqlite_err = 0;
+    retassure(!(sqlite_err = sqlite3_blob_open(db, "main", "CacheResourceData", "data", dataID, 0, &_blob)), "Failed to open blob of CacheResourceData %d with error=%d",dataID,sqlite_err);
+    _size = sqlite3_blob_bytes(_blob);
+}
+
+BlobResourceSource::~BlobResourceSource(){
+    safeFreeCustom(_blob, sqlite3_blob_close);
+}
+
+uint64_t BlobResourceSource::size(){
+    return _size;
+}
+
+size_t BlobResourceSource::readAt(uint64_t offset, void *buf, size_t len){
+    int sqlite_err = 0;
+    if (offset >= _size) return 0;
+    if (len > _size - offset) len = (size_t)(_size - offset);
+    retassure(!(sqlite_err = sqlite3_blob_read(_blob, buf, (int)len, (int)offset)), "Failed to read blob with error=%d",sqlite_err);
+    return len;
+}
+
+#pragma mark CacheReader::Resource
+
+bool CacheReader::Resource::isRedirect() const{
+    return contentLength == 0 && size != 0;
+}
+
+#pragma mark CacheReader
+
+CacheReader::CacheReader(std::string applicationCachePath)
+: _applicationCachePath(applicationCachePath), _db(NULL), _flatFiles(applicationCachePath)
+{
+    int sqlite_err = 0;
+    retassure(!(sqlite_err = sqlite3_open_v2(_applicationCachePath.c_str(), &_db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL)),
+              "Failed to open '%s' with error=%d",_applicationCachePath.c_str(),sqlite_err);
+}
+
+CacheReader::~CacheReader(){
+    safeFreeCustom(_db, sqlite3_close);
+}
+
+std::vector<CacheReader::Resource> CacheReader::resources(){
+    sqlite3_stmt *stmt = NULL;
+    cleanup([&]{
+        safeFreeCustom(stmt, sqlite3_finalize);
+    });
+    int sqlite_err = 0;
+    std::vector<Resource> ret;
+    
+    //length() doesn't load the blob
+    retassure(!(sqlite_err = sqlite3_prepare_v2(_db, "SELECT r.id, r.url, r.mimeType, r.headers, r.data, length(d.data), d.path "
+                                                     "FROM CacheResources r LEFT JOIN CacheResourceData d ON d.id = r.data "
+                                                     "ORDER BY r.id ASC;", -1, &stmt, NULL)), "Failed to prepare SQL statement with error=%d",sqlite_err);
+    while ((sqlite_err = sqlite3_step(stmt)) == SQLITE_ROW) {
+        Resource r = {};
+        const char *url = (const char *)sqlite3_column_text(stmt, 1);
+        const char *mimeType = (const char *)sqlite3_column_text(stmt, 2);
+        const char *path = (const char *)sqlite3_column_text(stmt, 6);
+        r.id = sqlite3_column_int(stmt, 0);
+        if (url) r.url = url;
+        if (mimeType) r.mimeType = mimeType;
+        r.contentLength = contentLengthFromHeaders((const char *)sqlite3_column_text(stmt, 3));
+        r.dataID = sqlite3_column_int(stmt, 4);
+        r.size = sqlite3_column_int64(stmt, 5);
+        if (path) {
+            struct stat st = {};
+            r.flatFile = path;
+            if (!stat(_flatFiles.pathForName(r.flatFile).c_str(), &st)) r.size = st.st_size;
+        }
+        ret.push_back(r);
+    }
+    retassure(sqlite_err == SQLITE_DONE, "Failed to read CacheResources with error=%d",sqlite_err);
+    return ret;
+}
+
+std::unique_ptr<ResourceSource> CacheReader::open(const Resource &resource){
+    if (resource.flatFile.size()) {
+        std::string path = _flatFiles.pathForName(resource.flatFile);
+        struct stat st = {};
+        int fd = -1;
+        retassure((fd = ::open(path.c_str(), O_RDONLY)) != -1, "Failed to open flat file '%s' with err=%d (%s)",path.c_str(),errno,strerror(errno));
+        if (fstat(fd, &st)) {
+            close(fd);
+            reterror("Failed to stat flat file '%s'",path.c_str());
+        }
+        return std::unique_ptr<ResourceSource>(new FlatFileSource(fd, st.st_size, NULL));
+    }
+    return std::unique_ptr<ResourceSource>(new BlobResourceSource(_db, resource.dataID));
+}
+
+CacheReader::ExtractReport CacheReader::extract(std::string url, std::string outdir){
+    ExtractReport ret = {};
+    std::vector<uint8_t> chunk(READER_CHUNK_SIZE);
+    
+    if (url.size() && url.back() != '/') url += '/';
+    if (outdir.back() != '/') outdir += '/';
+    
+    for (auto &r : resources()) {
+        std::string rel = relativePathForUrl(r.url, url);
+        if (url.size() && r.url.compare(0, url.size(), url) != 0) continue; //not below url
+        if (rel.empty() || r.isRedirect() || (url.size() && rel == RESOURCE_CACHEFILE)) {
+            ret.skipped.push_back(r.url);
+            continue;
+        }
+        
+        int fd = -1;
+        cleanup([&]{
+            safeClose(fd);
+        });
+        std::string path = outdir + rel;
+        auto data = open(r);
+        uint64_t size = data->size();
+        
+        makeDirectories(path);
+        retassure((fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)) != -1, "Failed to create '%s' with err=%d (%s)",path.c_str(),errno,strerror(errno));
+        for (uint64_t offset = 0; offset < size;) {
+            size_t len = data->readAt(offset, chunk.data(), chunk.size());
+            retassure(len, "Failed to read resource '%s'",r.url.c_str());
+            for (size_t didWrite = 0; didWrite < len;) {
+                ssize_t w = write(fd, chunk.data() + didWrite, len - didWrite);
+                if (w < 0 && errno == EINTR) continue;
+                retassure(w > 0, "Failed to write '%s' with err=%d (%s)",path.c_str(),errno,strerror(errno));
+                didWrite += w;
+            }
+            offset += len;
+        }
+        ret.files++;
+        ret.bytes += size;
+    }
+    return ret;
+}
+
+CacheReader::VerifyReport CacheReader::verify(std::string url, std::string dir, size_t jobs, bool followSymlinks){
+    struct Task {
+        std::string rel;
+        const Resource *resource;
+        bool matches;
+    };
+    VerifyReport ret = {};
+    std::vector<Resource> all = resources();
+    std::unordered_map<std::string, const Resource *> resourceForUrl;
+    std::vector<std::string> files;
+    std::vector<Task> tasks;
+    std::atomic<size_t> nextTask{0};
+    std::exception_ptr workerError;
+    std::mutex workerErrorLock;
+    std::vector<std::thread> workers;
+    
+    if (url.back() != '/') url += '/';
+    if (dir.back() != '/') dir += '/';
+    if (jobs < 1) jobs = 1;
+    
+    for (auto &r : all) {
+        resourceForUrl.insert({r.url,&r}); //first resource with this URL wins, same as WebkitCacher
+    }
+    
+    listFiles(dir, followSymlinks, files);
+    std::sort(files.begin(), files.end());
+    for (auto &f : files) {
+        auto r = resourceForUrl.find(url + f);
+        if (r == resourceForUrl.end()) {
+            ret.missing.push_back(f);
+        }else{
+            tasks.push_back({f, r->second, false});
+            resourceForUrl.erase(r);
+        }
+    }
+    for (auto &r : resourceForUrl) {
+        if (r.first.compare(0, url.size(), url) != 0) continue;
+        if (r.second->isRedirect() || r.first == url + RESOURCE_CACHEFILE) continue;
+        ret.extra.push_back(r.first);
+    }
+    std::sort(ret.extra.begin(), ret.extra.end());
+    
+    auto worker = [&](){
+        try {
+            CacheReader reader(_applicationCachePath); //sqlite connections are not shared between threads
+            std::vector<uint8_t> chunk(READER_CHUNK_SIZE);
+            size_t i = 0;
+            while ((i = nextTask++) < tasks.size()) {
+                Task &t = tasks[i];
+                std::string path = dir + t.rel;
+                struct stat st = {};
+                int fd = -1;
+                cleanup([&]{
+                    safeClose(fd);
+                });
+                if ((fd = ::open(path.c_str(), O_RDONLY)) == -1 || fstat(fd, &st)) continue;
+                if ((uint64_t)st.st_size != t.resource->size) continue;
+                FileResourceSource file(fd, st.st_size, path.c_str());
+                auto stored = reader.open(*t.resource);
+                t.matches = ContentHash::hash(file, chunk.data(), chunk.size()) == ContentHash::hash(*stored, chunk.data(), chunk.size());
+            }
+        } catch (...) {
+            std::unique_lock<std::mutex> ul(workerErrorLock);
+            if (!workerError) workerError = std::current_exception();
+            nextTask = tasks.size();
+        }
+    };
+    for (size_t i = 0; i < jobs; i++) {
+        workers.emplace_back(worker);
+    }
+    for (auto &w : workers) {
+        w.join();
+    }
+    if (workerError) std::rethrow_exception(workerError);
+    
+    for (auto &t : tasks) {
+        if (t.matches) {
+            ret.verified++;
+        }else{
+            ret.mismatched.push_back(t.rel);
+        }
+    }
+    return ret;
+}
@@ -0,0 +1,94 @@
+//
+//  CacheReader.hpp
+//  webkitCacher
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#ifndef CacheReader_hpp
+#define CacheReader_hpp
+
+#include <sqlite3.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include "ResourceSource.hpp"
+#include "FlatFileStore.hpp"
+
+/*
+ Streams a CacheResourceData blob in chunks, it never needs to fit into memory as a whole.
+ */
+class BlobResourceSource : public ResourceSource {
+    sqlite3_blob *_blob;
+    uint64_t _size;
+public:
+    BlobResourceSource(sqlite3 *db, int dataID);
+    ~BlobResourceSource();
+    
+    virtual uint64_t size() override;
+    virtual size_t readAt(uint64_t offset, void *buf, size_t len) override;
+};
+
+/*
+ Read-only access to an existing ApplicationCache.db.
+ */
+class CacheReader {
+public:
+    struct Resource {
+        int id;
+        std::string url;
+        std::string mimeType;
+        int dataID;
+        uint64_t size;          //size of the stored payload
+        uint64_t contentLength; //as announced in the headers
+        std::string flatFile;   //name of the flat file, empty if the payload is stored in the database
+        
+        bool isRedirect() const; //redirects reuse the payload of their target with a Content-Length of 0
+    };
+    
+    struct ExtractReport {
+        uint64_t files;
+        uint64_t bytes;
+        std::vector<std::string> skipped;
+    };
+    
+    struct VerifyReport {
+        uint64_t verified;
+        std::vector<std::string> missing;       //files without resource
+        std::vector<std::string> mismatched;    //files whose content differs from the resource
+        std::vector<std::string> extra;         //resources without file, redirects and the manifest are not listed
+    };
+    
+private:
+    std::string _applicationCachePath;
+    sqlite3 *_db;
+    FlatFileStore _flatFiles;
+    
+public:
+    CacheReader(std::string applicationCachePath);
+    ~CacheReader();
+    
+    std::vector<Resource> resources();
+    
+    /*
+     Payload of resource, either from the database or from its flat file.
+     */
+    std::unique_ptr<ResourceSource> open(const Resource &resource);
+    
+    /*
+     Writes the payload of every resource below url to outdir, using the path of the url below it.
+     Without url, resources are written to <outdir>/<host>/<path>.
+     Redirects, the manifest and urls which can't be a file are skipped.
+     */
+    ExtractReport extract(std::string url, std::string outdir);
+    
+    /*
+     Compares every file below dir to the resource of url with the same relative path.
+     Files are hashed on jobs threads in parallel, each with its own database connection.
+     followSymlinks: walk symlinks to directories, like a build with WebkitCacher::setFollowSymlinks
+     */
+    VerifyReport verify(std::string url, std::string dir, size_t jobs, bool followSymlinks = false);
+};
+
+#endif /* CacheReader_hpp */
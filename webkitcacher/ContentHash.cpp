@@ -0,0 +1,199 @@
+//
+//  ContentHash.cpp
+//  webkitCacher
+//
+//  Created by tihmstar on 16.10.26.
+//
+
+#include "ContentHash.hpp"
+#include "ResourceSource.hpp"
+#include <libgeneral/macros.h>
+#include <string.h>
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+#pragma mark static helpers
+
+static inline uint64_t rotl64(uint64_t x, int r){
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const uint8_t *p){
+    uint64_t v = 0;
+    memcpy(&v, p, sizeof(v));
+    return v; //little endian hosts only
+}
+
+static inline uint32_t read32(const uint8_t *p){
+    uint32_t v = 0;
+    memcpy(&v, p, sizeof(v));
+    return v; //little endian hosts only
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input){
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    acc *= PRIME64_1;
+    return acc;
+}
+
+static inline uint64_t mergeRound64(uint64_t acc, uint64_t val){
+    val = round64(0, val);
+    acc ^= val;
+    acc = acc * PRIME64_1 + PRIME64_4;
+    return acc;
+}
+
+#pragma mark ContentHash
+
+ContentHash::ContentHash(uint64_t seed)
+: _totalLen(0), _memSize(0)
+{
+    _v[0] = seed + PRIME64_1 + PRIME64_2;
+    _v[1] = seed + PRIME64_2;
+    _v[2] = seed + 0;
+    _v[3] = seed - PRIME64_1;
+}
+
+void ContentHash::update(const void *buf, size_t len){
+    const uint8_t *p = (const uint8_t *)buf;
+    const uint8_t *end = p + len;
+    
+    _totalLen += len;
+    
+    if (_memSize + len < 32) {
+        memcpy(_mem + _memSize, p, len);
+        _memSize += len;
+        return;
+    }
+    
+    if (_memSize) {
+        size_t fill = 32 - _memSize;
+        memcpy(_mem + _memSize, p, fill);
+        _v[0] = round64(_v[0], read64(_mem + 0));
+        _v[1] = round64(_v[1], read64(_mem + 8));
+        _v[2] = round64(_v[2], read64(_mem + 16));
+        _v[3] = round64(_v[3], read64(_mem + 24));
+        p += fill;
+        _memSize = 0;
+    }
+    
+    while (p + 32 <= end) {
+        _v[0] = round64(_v[0], read64(p + 0));
+        _v[1] = round64(_v[1], read64(p + 8));
+        _v[2] = round64(_v[2], read64(p + 16));
+        _v[3] = round64(_v[3], read64(p + 24));
+        p += 32;
+    }
+    
+    if (p < end) {
+        memcpy(_mem, p, end - p);
+        _memSize = end - p;
+    }
+}
+
+uint64_t ContentHash::digest() const{
+    uint64_t h = 0;
+    const uint8_t *p = _mem;
+    const uint8_t *end = _mem + _memSize;
+    
+    if (_totalLen >= 32) {
+        h = rotl64(_v[0], 1) + rotl64(_v[1], 7) + rotl64(_v[2], 12) + rotl64(_v[3], 18);
+        h = mergeRound64(h, _v[0]);
+        h = mergeRound64(h, _v[1]);
+        h = mergeRound64(h, _v[2]);
+        h = mergeRound64(h, _v[3]);
+    }else{
+        h = _v[2] /* seed */ + PRIME64_5;
+    }
+    
+    h += _totalLen;
+    
+    while (p + 8 <= end) {
+        h ^= round64(0, read64(p));
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+        p += 8;
+    }
+    
+    if (p + 4 <= end) {
+        h ^= (uint64_t)read32(p) * PRIME64_1;
+        h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    
+    while (p < end) {
+        h ^= (*p) * PRIME64_5;
+        h = rotl64(h, 11) * PRIME64_1;
+        p++;
+    }
+    
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t ContentHash::hash(const void *buf, size_t len){
+    ContentHash h;
+    h.update(buf, len);
+    return h.digest();
+}
+
+uint64_t ContentHash::hash(ResourceSource &src, void *chunkBuf, size_t chunkBufSize){
+    ContentHash h;
+    const void *buf = NULL;
+    uint64_t size = src.size();
+    
+    if ((buf = src.buffer())) {
+        h.update(buf, (size_t)size);
+        return h.digest();
+    }
+    
+    for (uint64_t offset = 0; offset < size;) {
+        size_t didRead = src.readAt(offset, chunkBuf, chunkBufSize);
+        retassure(didRead, "Failed to read resource");
+        h.update(chunkBuf, didRead);
+        offset += didRead;
+    }
+    return h.digest();
+}
+
+#pragma mark HashingResourceSource
+
+HashingResourceSource::HashingResourceSource(ResourceSource &src)
+: _src(src), _hashed(0)
+{
+    //
+}
+
+bool HashingResourceSource::complete(){
+    return _hashed == _src.size();
+}
+
+uint64_t HashingResourceSource::digest() const{
+    return _hash.digest();
+}
+
+uint64_t HashingResourceSource::size(){
+    return _src.size();
+}
+
+size_t HashingResourceSource::readAt(uint64_t offset, void *buf, size_t len){
+    size_t didRead = _src.readAt(offset, buf, len);
+    if (offset <= _hashed && offset + didRead > _hashed) {
+        //only what wasn't hashed yet, ranges may be read again
+        _hash.update((const uint8_t *)buf + (_hashed - offset), (size_t)(offset + didRead - _hashed));
+        _hashed = offset + didRead;
+    }
+    return didRead;
+}
+
+bool HashingResourceSource::readsOnce(){
+    return _src.readsOnce();
+}
@@ -0,0 +1,58 @@
+//
+//  ContentHash.hpp
+//  webkitCacher
+//
+//  Created by tihmstar on 16.10.26.
+//
+
+#ifndef ContentHash_hpp
+#define ContentHash_hpp
+
+#include <stdint.h>
+#include <stddef.h>
+#include "ResourceSource.hpp"
+
+/*
+ Fast non-cryptographic 64bit hash of resource payloads (XXH64).
+ Only used to find candidates for identical payloads, matches still need to be confirmed by comparing bytes.
+ */
+class ContentHash {
+    uint64_t _v[4];
+    uint64_t _totalLen;
+    uint8_t _mem[32];
+    size_t _memSize;
+    
+public:
+    ContentHash(uint64_t seed = 0);
+    
+    void update(const void *buf, size_t len);
+    uint64_t digest() const;
+    
+    static uint64_t hash(const void *buf, size_t len);
+    static uint64_t hash(ResourceSource &src, void *chunkBuf, size_t chunkBufSize);
+};
+
+/*
+ Forwards to another ResourceSource and hashes everything read from it front to back,
+ so payloads which can only be read once are hashed while they are stored.
+ Hides buffer and file descriptor of the source, every byte has to go through readAt.
+ */
+class HashingResourceSource : public ResourceSource {
+    ResourceSource &_src;
+    ContentHash _hash;
+    uint64_t _hashed;   //bytes from the start which went into _hash
+public:
+    HashingResourceSource(ResourceSource &src);
+    
+    /*
+     Hash of the payload, only valid once all of it was read.
+     */
+    bool complete();
+    uint64_t digest() const;
+    
+    virtual uint64_t size() override;
+    virtual size_t readAt(uint64_t offset, void *buf, size_t len) override;
+    virtual bool readsOnce() override;
+};
+
+#endif /* ContentHash_hpp */
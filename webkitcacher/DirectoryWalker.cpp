@@ -0,0 +1,367 @@
+//
+//  DirectoryWalker.cpp
+//  webkitCacher
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#include "DirectoryWalker.hpp"
+#include <libgeneral/macros.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+#define NO_NAME ((size_t)-1)
+
+int64_t fileModificationTime(const struct stat &st){
+#ifdef __APPLE__
+    return (int64_t)st.st_mtimespec.tv_sec*1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    return (int64_t)st.st_mtim.tv_sec*1000000000 + st.st_mtim.tv_nsec;
+#endif
+}
+
+std::vector<DirectoryEntry> listDirectory(const std::string &dir, bool sorted){
+    DIR *d = NULL;
+    cleanup([&]{
+        safeFreeCustom(d, closedir);
+    });
+    struct dirent *dfile = NULL;
+    std::vector<DirectoryEntry> ret;
+
+    retassure(d = opendir(dir.c_str()), "Failed to open dir with err=%d (%s)",errno,strerror(errno));
+    while ((dfile = readdir(d))) {
+        if (strcmp(dfile->d_name, ".") == 0 || strcmp(dfile->d_name, "..") == 0) {
+            continue;
+        }
+        bool isDirectory = dfile->d_type == DT_DIR;
+        if (dfile->d_type == DT_UNKNOWN) {
+            struct stat st = {};
+            isDirectory = !fstatat(dirfd(d), dfile->d_name, &st, AT_SYMLINK_NOFOLLOW) && S_ISDIR(st.st_mode);
+        }
+        ret.push_back({dfile->d_name, isDirectory});
+    }
+    if (sorted) {
+        std::sort(ret.begin(), ret.end(), [](const DirectoryEntry &a, const DirectoryEntry &b){
+            return a.name < b.name;
+        });
+    }
+    return ret;
+}
+
+bool walkOrderLess(const std::string &a, const std::string &b){
+    size_t len = std::min(a.size(), b.size());
+    for (size_t i=0; i<len; i++) {
+        //a separator ends a component, so it sorts before every byte a name can contain
+        uint8_t ca = a[i] == '/' ? 0 : (uint8_t)a[i];
+        uint8_t cb = b[i] == '/' ? 0 : (uint8_t)b[i];
+        if (ca != cb) return ca < cb;
+    }
+    return a.size() < b.size();
+}
+
+bool walkVisits(const std::string &path, bool isDirectory, const std::string &resumeAfter){
+    if (resumeAfter.empty()) return true;
+    if (isDirectory && resumeAfter.size() > path.size() && resumeAfter[path.size()] == '/'
+        && !resumeAfter.compare(0, path.size(), path)) {
+        return true; //resumeAfter is inside this directory
+    }
+    return walkOrderLess(resumeAfter, path);
+}
+
+#pragma mark OpenDirectory
+
+DirectoryWalker::OpenDirectory::OpenDirectory(DIR *d)
+: _d(d)
+{
+    //
+}
+
+DirectoryWalker::OpenDirectory::~OpenDirectory(){
+    safeFreeCustom(_d, closedir);
+}
+
+DIR *DirectoryWalker::OpenDirectory::stream() const{
+    return _d;
+}
+
+int DirectoryWalker::OpenDirectory::fd() const{
+    return dirfd(_d);
+}
+
+#pragma mark DirectoryWalker
+
+DirectoryWalker::DirectoryWalker(std::string url, std::string dir, bool sorted)
+: _path(dir), _url(url), _rootUrlLen(0), _sorted(sorted), _followSymlinks(false), _prefetchMetadata(true), _hasRootNames(false),
+    _current{}, _enterCurrent(false), _started(false), _directories(0)
+{
+    if (_url.back() != '/') _url += '/';
+    if (_path.back() != '/') _path += '/';
+    _rootUrlLen = _url.size();
+    _current.name = NO_NAME;
+}
+
+#pragma mark private
+
+int DirectoryWalker::enter(int parentfd, const char *name){
+    int fd = -1;
+    cleanup([&]{
+        safeClose(fd);
+    });
+    DIR *d = NULL;
+    struct stat st = {};
+
+    //without following, a directory which was replaced by a symlink since it was stat'ed fails with ELOOP
+    if ((fd = openat(parentfd, name, O_RDONLY | O_DIRECTORY | (_followSymlinks ? 0 : O_NOFOLLOW))) == -1) return errno;
+    if (fstat(fd, &st)) return errno;
+    for (auto &f : _stack) {
+        if (f.dev == st.st_dev && f.ino == st.st_ino) return ELOOP; //symlink to a directory we are in
+    }
+    if (!(d = fdopendir(fd))) return errno;
+    fd = -1; //owned by d now
+
+    Frame frame = {};
+    frame.dir = std::make_shared<OpenDirectory>(d);
+    frame.entries = frame.next = _entries.size();
+    frame.names = _names.size();
+    frame.pathLen = _path.size();
+    frame.urlLen = _url.size();
+    frame.dev = st.st_dev;
+    frame.ino = st.st_ino;
+    _stack.push_back(frame);
+    _directories++;
+    readEntries();
+    return 0;
+}
+
+void DirectoryWalker::addEntry(const char *name, unsigned char dtype){
+    Entry e = {};
+    e.name = _names.size();
+    e.nameLen = strlen(name);
+    e.dtype = dtype;
+    _names.insert(_names.end(), name, name + e.nameLen + 1);
+    _entries.push_back(e);
+}
+
+bool DirectoryWalker::classify(int fd, Entry &e){
+    const char *name = &_names[e.name];
+    struct stat st = {};
+
+    if (e.dtype == DT_DIR) {
+        e.type = Directory;
+        e.isDirectory = true;
+        return true;
+    }
+    if (e.dtype == DT_UNKNOWN) {
+        //not every filesystem reports types in readdir
+        if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW)) {
+            e.type = Error;
+            e.err = errno;
+            return true;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            e.type = Directory;
+            e.isDirectory = true;
+            return true;
+        }
+        if (S_ISLNK(st.st_mode)) {
+            e.dtype = DT_LNK;
+        }else if (S_ISREG(st.st_mode)) {
+            e.dtype = DT_REG;
+        }else{
+            return false;
+        }
+    }
+    if (e.dtype != DT_REG && e.dtype != DT_LNK) return false; //fifos, sockets and devices can't be cached
+    if (e.dtype == DT_REG && !st.st_mode && !_prefetchMetadata) {
+        e.type = File; //whoever opens it stats it
+        return true;
+    }
+
+    //symlinks are resolved, a dangling symlink is an error just like a file which can't be read
+    if (!S_ISREG(st.st_mode) && fstatat(fd, name, &st, 0)) {
+        e.type = Error;
+        e.err = errno;
+        return true;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        if (!_followSymlinks) return false;
+        e.type = Directory;
+        e.isDirectory = true;
+        return true;
+    }
+    if (!S_ISREG(st.st_mode)) return false;
+    e.type = File;
+    e.size = st.st_size;
+    e.mtime = fileModificationTime(st);
+    return true;
+}
+
+void DirectoryWalker::readEntries(){
+    Frame &frame = _stack.back();
+    int fd = frame.dir->fd();
+    std::string relDir;
+    size_t kept = frame.entries;
+
+    if (_stack.size() == 1 && _hasRootNames) {
+        for (auto &name : _rootNames) {
+            addEntry(name.c_str(), DT_UNKNOWN);
+        }
+    }else{
+        struct dirent *dfile = NULL;
+        while ((dfile = readdir(frame.dir->stream()))) {
+            if (strcmp(dfile->d_name, ".") == 0 || strcmp(dfile->d_name, "..") == 0) {
+                continue;
+            }
+            addEntry(dfile->d_name, dfile->d_type);
+        }
+    }
+    if (_sorted) {
+        const char *names = _names.data();
+        std::sort(_entries.begin() + frame.entries, _entries.end(), [names](const Entry &a, const Entry &b){
+            return strcmp(names + a.name, names + b.name) < 0;
+        });
+    }
+
+    //the metadata of the whole directory is fetched before the first entry is handed out
+    if (_resumeAfter.size()) relDir = _url.substr(_rootUrlLen);
+    for (size_t i=frame.entries; i<_entries.size(); i++) {
+        Entry e = _entries[i];
+        if (!classify(fd, e)) continue;
+        if (_resumeAfter.size() && !walkVisits(relDir + &_names[e.name], e.isDirectory, _resumeAfter)) continue;
+        _entries[kept++] = e;
+    }
+    _entries.resize(kept);
+}
+
+#pragma mark public
+
+void DirectoryWalker::setFollowSymlinks(bool followSymlinks){
+    _followSymlinks = followSymlinks;
+}
+
+void DirectoryWalker::setPrefetchMetadata(bool prefetchMetadata){
+    _prefetchMetadata = prefetchMetadata;
+}
+
+void DirectoryWalker::setResumeAfter(const std::string &resumeAfter){
+    _resumeAfter = resumeAfter;
+}
+
+void DirectoryWalker::setRootEntries(const std::vector<std::string> &names){
+    _rootNames = names;
+    _hasRootNames = true;
+}
+
+bool DirectoryWalker::next(){
+    int err = 0;
+
+    if (!_started) {
+        _started = true;
+        if ((err = enter(AT_FDCWD, _path.c_str()))) {
+            _current.type = Error;
+            _current.isDirectory = true;
+            _current.err = err;
+            return true;
+        }
+    }else if (_enterCurrent) {
+        _enterCurrent = false;
+        _path += '/';
+        _url.append(&_names[_current.name], _current.nameLen);
+        _url += '/';
+        if ((err = enter(_stack.back().dir->fd(), &_names[_current.name]))) {
+            _path.pop_back();
+            _url.resize(_stack.back().urlLen);
+            if (err != ELOOP) {
+                _current.type = Error;
+                _current.err = err;
+                return true;
+            }
+            //loops are skipped, everything in them is walked already
+        }
+    }
+
+    while (_stack.size()) {
+        Frame &frame = _stack.back();
+        _path.resize(frame.pathLen);
+        _url.resize(frame.urlLen);
+        if (frame.next < _entries.size()) {
+            _current = _entries[frame.next++];
+            _path.append(&_names[_current.name], _current.nameLen);
+            _enterCurrent = _current.type == Directory;
+            return true;
+        }
+        _entries.resize(frame.entries);
+        _names.resize(frame.names);
+        _stack.pop_back();
+    }
+    return false;
+}
+
+void DirectoryWalker::throwError() const{
+    if (_current.isDirectory) {
+        reterror("Failed to open dir with err=%d (%s)",_current.err,strerror(_current.err));
+    }
+    reterror("Failed to stat file '%s' with err=%d (%s)",_path.c_str(),_current.err,strerror(_current.err));
+}
+
+void DirectoryWalker::skipDirectory(){
+    _enterCurrent = false;
+}
+
+DirectoryWalker::EntryType DirectoryWalker::type() const{
+    return _current.type;
+}
+
+bool DirectoryWalker::isDirectory() const{
+    return _current.isDirectory;
+}
+
+const char *DirectoryWalker::name() const{
+    return _current.name == NO_NAME ? "" : &_names[_current.name];
+}
+
+size_t DirectoryWalker::nameLength() const{
+    return _current.name == NO_NAME ? 0 : _current.nameLen;
+}
+
+const std::string &DirectoryWalker::url() const{
+    return _url;
+}
+
+const std::string &DirectoryWalker::path() const{
+    return _path;
+}
+
+std::string DirectoryWalker::relativePath() const{
+    return _url.substr(_rootUrlLen) + name();
+}
+
+std::string DirectoryWalker::entryUrl() const{
+    std::string ret = _url + name();
+    if (_current.isDirectory && nameLength()) ret += '/';
+    return ret;
+}
+
+uint64_t DirectoryWalker::size() const{
+    return _current.size;
+}
+
+int64_t DirectoryWalker::modificationTime() const{
+    return _current.mtime;
+}
+
+int DirectoryWalker::errorNumber() const{
+    return _current.err;
+}
+
+const std::shared_ptr<DirectoryWalker::OpenDirectory> &DirectoryWalker::directory() const{
+    return _stack.size() ? _stack.back().dir : _noDirectory;
+}
+
+size_t DirectoryWalker::directoriesWalked() const{
+    return _directories;
+}
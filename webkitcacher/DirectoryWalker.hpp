@@ -0,0 +1,179 @@
+//
+//  DirectoryWalker.hpp
+//  webkitCacher
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#ifndef DirectoryWalker_hpp
+#define DirectoryWalker_hpp
+
+#include <stdint.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <memory>
+
+int64_t fileModificationTime(const struct stat &st);
+
+struct DirectoryEntry {
+    std::string name;
+    bool isDirectory;
+};
+
+/*
+ Entries of dir without "." and "..", in readdir order or sorted bytewise by name.
+ */
+std::vector<DirectoryEntry> listDirectory(const std::string &dir, bool sorted);
+
+/*
+ Order in which a sorted walk visits paths relative to its root:
+ bytewise per path component, so everything below a directory comes before its next sibling.
+ */
+bool walkOrderLess(const std::string &a, const std::string &b);
+
+/*
+ Whether a sorted walk which resumes after the relative path resumeAfter still has to visit path.
+ Directories are visited if anything below them may come after resumeAfter.
+ */
+bool walkVisits(const std::string &path, bool isDirectory, const std::string &resumeAfter);
+
+/*
+ Walks a directory tree without recursion.
+ Every directory on the current path is kept open, entries are opened and stat'ed relative to it with openat/fstatat,
+ and the names of all directories on the path live in one buffer, so walking does not allocate per entry.
+ When a directory is entered, all its entries are read and stat'ed in one go before the first one is returned,
+ so consumers which only need the metadata, like an incremental build skipping unchanged files, never open them.
+ Entries are classified with stat where readdir doesn't know the type (DT_UNKNOWN) or reports a symlink.
+ Symlinks to files are returned as files, symlinks to directories are only walked if symlinks are followed,
+ fifos, sockets and devices are skipped.
+ */
+class DirectoryWalker {
+public:
+    enum EntryType {
+        File = 0,
+        Directory,      //entered by the next call to next unless skipDirectory is called
+        Error           //the entry can't be stat'ed or the directory can't be opened, see errorNumber()
+    };
+
+    /*
+     An open directory, held by whoever still needs to open entries relative to it.
+     */
+    class OpenDirectory {
+        DIR *_d;
+    public:
+        OpenDirectory(DIR *d);
+        ~OpenDirectory();
+        DIR *stream() const;
+        int fd() const;
+    };
+
+private:
+    struct Entry {
+        size_t name;        //offset in _names
+        size_t nameLen;
+        unsigned char dtype;
+        EntryType type;
+        bool isDirectory;   //also set for directories which failed to open
+        uint64_t size;
+        int64_t mtime;
+        int err;
+    };
+
+    struct Frame {
+        std::shared_ptr<OpenDirectory> dir;
+        size_t entries;     //first entry of this directory in _entries
+        size_t next;        //entry returned by the next call to next
+        size_t names;       //first byte of this directory in _names
+        size_t pathLen;     //length of the path of this directory in _path
+        size_t urlLen;
+        dev_t dev;
+        ino_t ino;
+    };
+
+    std::string _path;      //path of the current directory, followed by the name of the current entry
+    std::string _url;       //url of the current directory
+    size_t _rootUrlLen;
+    bool _sorted;
+    bool _followSymlinks;
+    bool _prefetchMetadata;
+    std::string _resumeAfter;
+    std::vector<std::string> _rootNames;
+    bool _hasRootNames;
+
+    //entries and names of all directories on the current path, the innermost directory is at the end
+    std::vector<Frame> _stack;
+    std::vector<Entry> _entries;
+    std::vector<char> _names;
+    Entry _current;
+    bool _enterCurrent;
+    bool _started;
+    size_t _directories;
+    std::shared_ptr<OpenDirectory> _noDirectory;
+
+    int enter(int parentfd, const char *name);
+    void addEntry(const char *name, unsigned char dtype);
+    bool classify(int fd, Entry &e);
+    void readEntries();
+
+public:
+    /*
+     url and dir are extended with the names of the directories walked, both get a trailing '/' if they don't have one.
+     sorted: entries of every directory are returned sorted bytewise by name instead of in readdir order
+     */
+    DirectoryWalker(std::string url, std::string dir, bool sorted = false);
+
+    /*
+     Symlinks to directories are walked as well, a directory which is already on the current path is skipped.
+     */
+    void setFollowSymlinks(bool followSymlinks);
+
+    /*
+     Whether size and modification time of regular files are taken while the directory is read (default).
+     Walks which open every file anyway can turn it off and save one stat per file.
+     */
+    void setPrefetchMetadata(bool prefetchMetadata);
+
+    /*
+     Only returns entries a sorted walk visits after resumeAfter, a path relative to dir (see walkVisits).
+     */
+    void setResumeAfter(const std::string &resumeAfter);
+
+    /*
+     Only walks these entries of dir itself, everything below them is walked as usual.
+     */
+    void setRootEntries(const std::vector<std::string> &names);
+
+    /*
+     Advances to the next entry, returns false once the walk is done.
+     */
+    bool next();
+
+    /*
+     Throws the error of an Error entry.
+     */
+    void throwError() const;
+
+    /*
+     Don't enter the directory next returned.
+     */
+    void skipDirectory();
+
+    EntryType type() const;
+    bool isDirectory() const;
+    const char *name() const;
+    size_t nameLength() const;
+    const std::string &url() const;             //url of the directory containing the entry
+    const std::string &path() const;            //path of the entry
+    std::string relativePath() const;           //path of the entry relative to dir
+    std::string entryUrl() const;               //url of the entry, directories end with '/'
+    uint64_t size() const;                      //size of files, taken when the directory was read if metadata is prefetched
+    int64_t modificationTime() const;
+    int errorNumber() const;                    //errno of Error entries
+    const std::shared_ptr<OpenDirectory> &directory() const;    //directory containing the entry, name is relative to it
+
+    size_t directoriesWalked() const;
+};
+
+#endif /* DirectoryWalker_hpp */
@@ -0,0 +1,174 @@
+//
+//  DirectoryWatcher.cpp
+//  webkitCacher
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#include "DirectoryWatcher.hpp"
+#include "DirectoryWalker.hpp"
+#include <libgeneral/macros.h>
+#include <algorithm>
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#   include <sys/inotify.h>
+#   define WATCH_EVENTS (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_ONLYDIR)
+#endif
+
+DirectoryWatcher::DirectoryWatcher(std::string root, bool followSymlinks)
+: _root(root), _followSymlinks(followSymlinks), _fd(-1)
+{
+    if (_root.back() != '/') _root += '/';
+#ifdef __linux__
+    retassure((_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) != -1, "Failed to init inotify with err=%d (%s)",errno,strerror(errno));
+    addWatchRecursive("", NULL);
+#else
+    reterror("Watching directories is only supported on Linux");
+#endif
+}
+
+DirectoryWatcher::~DirectoryWatcher(){
+    safeClose(_fd);
+}
+
+#pragma mark private
+
+bool DirectoryWatcher::addWatch(const std::string &path, const std::string &relPath){
+#ifdef __linux__
+    int wd = -1;
+    
+    //the root ends with a slash and is always followed, same as in DirectoryWalker
+    if ((wd = inotify_add_watch(_fd, path.c_str(), WATCH_EVENTS | (_followSymlinks ? 0 : IN_DONT_FOLLOW))) == -1) {
+        retassure(errno == ENOENT || errno == ENOTDIR, "Failed to watch '%s' with err=%d (%s)",path.c_str(),errno,strerror(errno));
+        return false; //already gone again, the delete event reports it
+    }
+    _pathForWatch[wd] = relPath;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void DirectoryWatcher::addWatchRecursive(const std::string &relPath, std::vector<std::string> *files){
+    std::string path = _root + relPath;
+    DirectoryWalker walker("/", path);
+    
+    if (!addWatch(path, relPath)) return;
+    
+    //files may have been created before the watch was in place
+    walker.setFollowSymlinks(_followSymlinks);
+    walker.setPrefetchMetadata(false);
+    while (walker.next()) {
+        std::string childPath = relPath + walker.relativePath();
+        if (walker.isDirectory()) {
+            if (walker.type() == DirectoryWalker::Error) continue; //gone again or unreadable
+            //watched before it is read, the walker enters it on the next call
+            if (!addWatch(walker.path(), childPath + "/")) walker.skipDirectory();
+        }else if (files) {
+            files->push_back(childPath); //also dangling symlinks, updating them drops what they cached
+        }
+    }
+}
+
+void DirectoryWatcher::removeWatchRecursive(const std::string &relPath){
+#ifdef __linux__
+    for (auto it = _pathForWatch.begin(); it != _pathForWatch.end();) {
+        if (it->second.compare(0, relPath.size(), relPath) == 0) {
+            inotify_rm_watch(_fd, it->first);
+            it = _pathForWatch.erase(it);
+        }else{
+            ++it;
+        }
+    }
+#endif
+}
+
+bool DirectoryWatcher::readEvents(Changes &changes){
+    bool hadEvents = false;
+#ifdef __linux__
+    alignas(struct inotify_event) char buf[0x10000];
+    ssize_t len = 0;
+    
+    while ((len = read(_fd, buf, sizeof(buf))) > 0) {
+        for (char *ptr = buf; ptr < buf + len; ) {
+            const struct inotify_event *event = (const struct inotify_event *)ptr;
+            ptr += sizeof(struct inotify_event) + event->len;
+            hadEvents = true;
+            
+            if (event->mask & IN_Q_OVERFLOW) {
+                changes.overflow = true;
+                continue;
+            }
+            if (event->mask & IN_IGNORED) {
+                _pathForWatch.erase(event->wd);
+                continue;
+            }
+            auto dir = _pathForWatch.find(event->wd);
+            if (dir == _pathForWatch.end() || !event->len) continue; //events about the watched directory itself
+            std::string relPath = dir->second + event->name;
+            
+            if (event->mask & IN_ISDIR) {
+                if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                    addWatchRecursive(relPath + "/", &changes.paths);
+                }else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                    removeWatchRecursive(relPath + "/");
+                    changes.paths.push_back(relPath);
+                }
+            }else{
+                struct stat st = {};
+                //a symlink to a directory is walked like a directory when following symlinks
+                if (_followSymlinks && (event->mask & (IN_CREATE | IN_MOVED_TO))
+                    && !stat((_root + relPath).c_str(), &st) && S_ISDIR(st.st_mode)) {
+                    addWatchRecursive(relPath + "/", &changes.paths);
+                    continue;
+                }
+                changes.paths.push_back(relPath);
+            }
+        }
+    }
+    retassure(len != -1 || errno == EAGAIN || errno == EINTR, "Failed to read inotify events with err=%d (%s)",errno,strerror(errno));
+#endif
+    return hadEvents;
+}
+
+#pragma mark public
+
+void DirectoryWatcher::rewatch(){
+#ifdef __linux__
+    std::unordered_map<int, std::string> oldWatches;
+    
+    //watching a directory again returns the same watch, only its path is updated
+    oldWatches.swap(_pathForWatch);
+    addWatchRecursive("", NULL);
+    for (auto &w : oldWatches) {
+        if (_pathForWatch.find(w.first) == _pathForWatch.end()) inotify_rm_watch(_fd, w.first); //no longer in the tree
+    }
+#endif
+}
+
+DirectoryWatcher::Changes DirectoryWatcher::waitForChanges(int debounceMs){
+    Changes ret = {};
+    struct pollfd pfd = {};
+    int timeout = -1; //block until the first event
+    
+    pfd.fd = _fd;
+    pfd.events = POLLIN;
+    while (true) {
+        int err = poll(&pfd, 1, timeout);
+        if (err == -1 && errno == EINTR) {
+            ret.interrupted = true;
+            break;
+        }
+        retassure(err != -1, "Failed to poll inotify with err=%d (%s)",errno,strerror(errno));
+        if (!err) break; //quiet for debounceMs
+        if (readEvents(ret)) timeout = debounceMs;
+    }
+    
+    std::sort(ret.paths.begin(), ret.paths.end());
+    ret.paths.erase(std::unique(ret.paths.begin(), ret.paths.end()), ret.paths.end());
+    return ret;
+}
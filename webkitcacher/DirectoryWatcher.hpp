@@ -0,0 +1,59 @@
+//
+//  DirectoryWatcher.hpp
+//  webkitCacher
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#ifndef DirectoryWatcher_hpp
+#define DirectoryWatcher_hpp
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+/*
+ Watches a directory tree for changes using inotify. Only available on Linux.
+ */
+class DirectoryWatcher {
+public:
+    struct Changes {
+        std::vector<std::string> paths;  //sorted and unique, relative to the watched directory
+        bool overflow;                  //events were lost, the whole tree needs to be rescanned
+        bool interrupted;               //waiting was interrupted by a signal
+    };
+    
+private:
+    std::string _root;
+    bool _followSymlinks;
+    int _fd;
+    std::unordered_map<int, std::string> _pathForWatch; //relative directory, with trailing slash unless it is the root
+    
+    bool addWatch(const std::string &path, const std::string &relPath);
+    void addWatchRecursive(const std::string &relPath, std::vector<std::string> *files);
+    void removeWatchRecursive(const std::string &relPath);
+    bool readEvents(Changes &changes);
+    
+public:
+    /*
+     followSymlinks: symlinks to directories are watched like directories, same as DirectoryWalker::setFollowSymlinks
+     */
+    DirectoryWatcher(std::string root, bool followSymlinks = false);
+    ~DirectoryWatcher();
+    
+    /*
+     Watches the whole tree again, directories which were created while events were lost are not watched yet.
+     Call after an overflow, before rescanning the tree.
+     */
+    void rewatch();
+    
+    /*
+     Blocks until something changed below the directory, then keeps collecting events
+     until none arrived for debounceMs milliseconds.
+     Files of directories which were created or moved into the tree are reported individually,
+     deleted or moved away directories are reported as a single path.
+     */
+    Changes waitForChanges(int debounceMs);
+};
+
+#endif /* DirectoryWatcher_hpp */
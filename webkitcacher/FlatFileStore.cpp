@@ -0,0 +1,229 @@
+//
+//  FlatFileStore.cpp
+//  webkitCacher
+//
+//  Created by tihmstar on 16.10.26.
+//
+
+#include "FlatFileStore.hpp"
+#include "ResourceSource.hpp"
+#include <libgeneral/macros.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+
+#ifdef __APPLE__
+#   include <sys/clonefile.h>
+#   include <copyfile.h>
+#endif
+
+#ifdef __linux__
+#   include <linux/fs.h>
+#   if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#       define HAVE_COPY_FILE_RANGE 1
+#   endif
+#endif
+
+#define FLATFILE_SUBDIRECTORY "ApplicationCache"
+#define FLATFILE_MAX_EXTENSION_LENGTH 16
+
+FlatFileStore::FlatFileStore(std::string databasePath)
+: _dirfd(-1), _allowHardlink(false), _methodCount{}, _rng(std::random_device{}())
+{
+    size_t lastSlash = databasePath.rfind('/');
+    if (lastSlash == std::string::npos) {
+        _directory = FLATFILE_SUBDIRECTORY;
+    }else{
+        _directory = databasePath.substr(0,lastSlash+1) + FLATFILE_SUBDIRECTORY;
+    }
+}
+
+FlatFileStore::~FlatFileStore(){
+    safeClose(_dirfd);
+}
+
+void FlatFileStore::openDirectory(){
+    if (_dirfd != -1) return;
+    retassure(!mkdir(_directory.c_str(), 0755) || errno == EEXIST, "Failed to create directory '%s' with err=%d (%s)",_directory.c_str(),errno,strerror(errno));
+    retassure((_dirfd = open(_directory.c_str(), O_RDONLY | O_DIRECTORY)) != -1, "Failed to open directory '%s' with err=%d (%s)",_directory.c_str(),errno,strerror(errno));
+}
+
+std::string FlatFileStore::uniqueName(const std::string &extension){
+    static const char hex[] = "0123456789ABCDEF";
+    std::string name;
+    do {
+        name.clear();
+        for (int i=0; i<2; i++) {
+            uint64_t r = _rng();
+            for (int j=0; j<16; j++, r >>= 4) name += hex[r & 0xf];
+        }
+        name += extension;
+    } while (!faccessat(_dirfd, name.c_str(), F_OK, 0));
+    return name;
+}
+
+bool FlatFileStore::tryHardlink(const char *srcPath, const std::string &name){
+    if (!srcPath) return false;
+    //fails across filesystems, the caller falls back to copying
+    return !linkat(AT_FDCWD, srcPath, _dirfd, name.c_str(), 0);
+}
+
+bool FlatFileStore::tryReflink(int srcfd, const std::string &name){
+#if defined(__APPLE__)
+    return !fclonefileat(srcfd, _dirfd, name.c_str(), 0);
+#elif defined(FICLONE)
+    int dstfd = -1;
+    cleanup([&]{
+        safeClose(dstfd);
+    });
+    retassure((dstfd = openat(_dirfd, name.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644)) != -1, "Failed to create file '%s' with err=%d (%s)",name.c_str(),errno,strerror(errno));
+    if (!ioctl(dstfd, FICLONE, srcfd)) return true;
+    unlinkat(_dirfd, name.c_str(), 0);
+    return false;
+#else
+    return false;
+#endif
+}
+
+bool FlatFileStore::tryKernelCopy(int srcfd, uint64_t size, const std::string &name){
+#if defined(__APPLE__) || defined(HAVE_COPY_FILE_RANGE)
+    int dstfd = -1;
+    cleanup([&]{
+        safeClose(dstfd);
+    });
+    retassure((dstfd = openat(_dirfd, name.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644)) != -1, "Failed to create file '%s' with err=%d (%s)",name.c_str(),errno,strerror(errno));
+#   ifdef __APPLE__
+    if (!fcopyfile(srcfd, dstfd, NULL, COPYFILE_DATA)) return true;
+#   else
+    {
+        loff_t offIn = 0;
+        loff_t offOut = 0;
+        while ((uint64_t)offIn < size) {
+            ssize_t didCopy = copy_file_range(srcfd, &offIn, dstfd, &offOut, (size_t)(size - offIn), 0);
+            if (didCopy < 0 && errno == EINTR) continue;
+            if (didCopy <= 0) break;
+        }
+        if ((uint64_t)offIn == size) return true;
+    }
+#   endif
+    unlinkat(_dirfd, name.c_str(), 0);
+    return false;
+#else
+    return false;
+#endif
+}
+
+void FlatFileStore::copy(ResourceSource &data, const std::string &name, void *chunkBuf, size_t chunkBufSize){
+    int dstfd = -1;
+    cleanup([&]{
+        safeClose(dstfd);
+    });
+    uint64_t size = data.size();
+    const uint8_t *buf = (const uint8_t *)data.buffer();
+
+    retassure((dstfd = openat(_dirfd, name.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644)) != -1, "Failed to create file '%s' with err=%d (%s)",name.c_str(),errno,strerror(errno));
+    try {
+        for (uint64_t offset = 0; offset < size;) {
+            const uint8_t *cur = NULL;
+            size_t len = 0;
+            if (buf) {
+                cur = buf + offset;
+                len = (size_t)(size - offset);
+            }else{
+                retassure(len = data.readAt(offset, chunkBuf, chunkBufSize), "Failed to read resource");
+                cur = (const uint8_t *)chunkBuf;
+            }
+            for (size_t didWrite = 0; didWrite < len;) {
+                ssize_t w = write(dstfd, cur + didWrite, len - didWrite);
+                if (w < 0 && errno == EINTR) continue;
+                retassure(w > 0, "Failed to write file '%s' with err=%d (%s)",name.c_str(),errno,strerror(errno));
+                didWrite += w;
+            }
+            offset += len;
+        }
+    } catch (...) {
+        unlinkat(_dirfd, name.c_str(), 0);
+        throw;
+    }
+}
+
+#pragma mark public
+
+void FlatFileStore::setAllowHardlink(bool allowHardlink){
+    _allowHardlink = allowHardlink;
+}
+
+void FlatFileStore::setSeed(uint64_t seed){
+    _rng.seed(seed);
+}
+
+std::string FlatFileStore::store(ResourceSource &data, const std::string &extension, void *chunkBuf, size_t chunkBufSize){
+    std::string ext;
+    std::string name;
+    int srcfd = data.fileDescriptor();
+
+    if (extension.size() <= FLATFILE_MAX_EXTENSION_LENGTH) {
+        ext = extension;
+        for (size_t i=1; i<ext.size(); i++) {
+            if (!isalnum((unsigned char)ext[i])) {
+                ext.clear();
+                break;
+            }
+        }
+    }
+
+    openDirectory();
+    name = uniqueName(ext);
+
+    if (_allowHardlink && tryHardlink(data.filePath(), name)) {
+        _methodCount[Hardlink]++;
+    }else if (srcfd != -1 && tryReflink(srcfd, name)) {
+        _methodCount[Reflink]++;
+    }else if (srcfd != -1 && tryKernelCopy(srcfd, data.size(), name)) {
+        _methodCount[KernelCopy]++;
+    }else{
+        copy(data, name, chunkBuf, chunkBufSize);
+        _methodCount[Copy]++;
+    }
+    return name;
+}
+
+std::string FlatFileStore::pathForName(const std::string &name) const{
+    return _directory + "/" + name;
+}
+
+void FlatFileStore::remove(const std::string &name) noexcept{
+    if (name.empty() || name.find('/') != std::string::npos) return;
+    unlink(pathForName(name).c_str());
+}
+
+std::vector<std::string> FlatFileStore::names() const{
+    DIR *d = NULL;
+    cleanup([&]{
+        safeFreeCustom(d, closedir);
+    });
+    struct dirent *dfile = NULL;
+    std::vector<std::string> ret;
+    
+    if (!(d = opendir(_directory.c_str()))) {
+        retassure(errno == ENOENT, "Failed to open directory '%s' with err=%d (%s)",_directory.c_str(),errno,strerror(errno));
+        return ret;
+    }
+    while ((dfile = readdir(d))) {
+        if (dfile->d_type == DT_DIR) continue;
+        ret.push_back(dfile->d_name);
+    }
+    return ret;
+}
+
+uint64_t FlatFileStore::filesStored(Method method) const{
+    return _methodCount[method];
+}
+
+void FlatFileStore::addFilesStored(Method method, uint64_t count){
+    _methodCount[method] += count;
+}
@@ -0,0 +1,86 @@
+//
+//  FlatFileStore.hpp
+//  webkitCacher
+//
+//  Created by tihmstar on 16.10.26.
+//
+
+#ifndef FlatFileStore_hpp
+#define FlatFileStore_hpp
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <random>
+
+class ResourceSource;
+
+/*
+ Manages resource bodies which are stored as flat files next to the database, instead of inside CacheResourceData.
+ WebKit looks them up by name in the "ApplicationCache" subdirectory of the directory containing the database.
+ */
+class FlatFileStore {
+public:
+    enum Method {
+        Hardlink = 0,   //linked to the source file, no data is copied
+        Reflink,        //copy-on-write clone of the source file
+        KernelCopy,     //copied inside the kernel
+        Copy,           //copied through a userspace buffer
+        MethodCount
+    };
+
+private:
+    std::string _directory;
+    int _dirfd;
+    bool _allowHardlink;
+    uint64_t _methodCount[MethodCount];
+    std::mt19937_64 _rng;
+
+    void openDirectory();
+    std::string uniqueName(const std::string &extension);
+    bool tryHardlink(const char *srcPath, const std::string &name);
+    bool tryReflink(int srcfd, const std::string &name);
+    bool tryKernelCopy(int srcfd, uint64_t size, const std::string &name);
+    void copy(ResourceSource &data, const std::string &name, void *chunkBuf, size_t chunkBufSize);
+
+public:
+    /*
+     databasePath: path of the ApplicationCache.db the files belong to
+     */
+    FlatFileStore(std::string databasePath);
+    ~FlatFileStore();
+
+    /*
+     Hardlinks alias the source file, modifying the source afterwards also modifies the cache.
+     */
+    void setAllowHardlink(bool allowHardlink);
+    
+    /*
+     Names are random by default, a fixed seed makes them reproducible across runs.
+     */
+    void setSeed(uint64_t seed);
+
+    /*
+     Stores the payload in a new uniquely named file using the cheapest available method.
+     Returns the name of the file relative to the flat file directory, as stored in CacheResourceData.path.
+     */
+    std::string store(ResourceSource &data, const std::string &extension, void *chunkBuf, size_t chunkBufSize);
+
+    std::string pathForName(const std::string &name) const;
+    void remove(const std::string &name) noexcept;
+    
+    /*
+     Names of all files in the flat file directory, empty if it doesn't exist.
+     */
+    std::vector<std::string> names() const;
+
+    uint64_t filesStored(Method method) const;
+
+    /*
+     Counts files another store created, e.g. the one of a database merged into this one.
+     */
+    void addFilesStored(Method method, uint64_t count);
+};
+
+#endif /* FlatFileStore_hpp */
@@ -0,0 +1,222 @@
+//
+//  IngestPipeline.cpp
+//  webkitCacher
+//
+//  Created by tihmstar on 16.10.26.
+//
+
+#include "IngestPipeline.hpp"
+#include "ResourceSource.hpp"
+#include "ContentHash.hpp"
+#include <libgeneral/macros.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+#define HASH_CHUNK_SIZE (1024*1024)
+
+#pragma mark Item
+
+IngestPipeline::Item::Item()
+: fd(-1), size(0), mtime(0), hash(0), preloaded(false), unchanged(false), ready(false)
+{
+    //
+}
+
+IngestPipeline::Item::~Item(){
+    if (fd > 0) {
+        close(fd);fd=-1;
+    }
+}
+
+#pragma mark IngestPipeline
+
+IngestPipeline::IngestPipeline(size_t jobs, size_t preloadLimit, bool sorted)
+: _jobs(jobs), _window(jobs*4), _preloadLimit(preloadLimit), _directories(0), _sorted(sorted), _followSymlinks(false),
+    _hashContent(true), _hasRootEntries(false), _nextUnclaimed(0), _walkDone(false), _abort(false)
+{
+    if (!_jobs) _jobs = 1;
+    if (_window < 8) _window = 8;
+}
+
+IngestPipeline::~IngestPipeline(){
+    //
+}
+
+void IngestPipeline::setResumeAfter(const std::string &resumeAfter){
+    _resumeAfter = resumeAfter;
+}
+
+void IngestPipeline::setFollowSymlinks(bool followSymlinks){
+    _followSymlinks = followSymlinks;
+}
+
+void IngestPipeline::setRootEntries(const std::vector<std::string> &names){
+    _rootEntries = names;
+    _hasRootEntries = true;
+}
+
+void IngestPipeline::setHashContent(bool hashContent){
+    _hashContent = hashContent;
+}
+
+void IngestPipeline::push(std::unique_ptr<Item> item){
+    std::unique_lock<std::mutex> ul(_lock);
+    _itemsChanged.wait(ul, [&]{return _abort || _items.size() < _window;});
+    if (_abort) reterror("pipeline aborted");
+    _items.push_back(std::move(item));
+    _itemsChanged.notify_all();
+}
+
+void IngestPipeline::walk(const std::string &url, const std::string &dir){
+    DirectoryWalker walker(url, dir, _sorted);
+    walker.setFollowSymlinks(_followSymlinks);
+    walker.setPrefetchMetadata(_unchanged != nullptr);
+    walker.setResumeAfter(_resumeAfter);
+    if (_hasRootEntries) walker.setRootEntries(_rootEntries);
+    
+    while (walker.next()) {
+        if (walker.type() == DirectoryWalker::Directory) {
+            continue;
+        }
+        std::unique_ptr<Item> item(new Item);
+        item->filepath = walker.path();
+        if (walker.type() == DirectoryWalker::Error) {
+            if (walker.isDirectory()) {
+                item->url = walker.entryUrl();
+            }else{
+                item->url = walker.url();
+                item->name.assign(walker.name(), walker.nameLength());
+            }
+            try {
+                walker.throwError();
+            } catch (...) {
+                item->err = std::current_exception();
+            }
+        }else{
+            item->url = walker.url();
+            item->name.assign(walker.name(), walker.nameLength());
+            item->directory = walker.directory();
+            item->size = walker.size();
+            item->mtime = walker.modificationTime();
+        }
+        push(std::move(item));
+    }
+    _directories = walker.directoriesWalked();
+}
+
+void IngestPipeline::walker(std::string url, std::string dir){
+    try {
+        walk(url, dir);
+    } catch (...) {
+        //hand the error to the consumer at the position where it happened
+        std::unique_ptr<Item> item(new Item); //without filepath, the walk itself failed
+        item->err = std::current_exception();
+        try {
+            push(std::move(item));
+        } catch (...) {
+            //pipeline was aborted
+        }
+    }
+    std::unique_lock<std::mutex> ul(_lock);
+    _walkDone = true;
+    _itemsChanged.notify_all();
+}
+
+void IngestPipeline::process(Item &item, std::vector<uint8_t> &chunkBuf){
+    struct stat st = {};
+    
+    if (_unchanged && _unchanged(item)) {
+        item.unchanged = true;
+        item.directory.reset();
+        return;
+    }
+    
+    retassure((item.fd = openat(item.directory->fd(), item.name.c_str(), O_RDONLY)) > 0, "Failed to open file '%s'",item.filepath.c_str());
+    item.directory.reset(); //lets the directory close as soon as the walk left it
+    retassure(!fstat(item.fd, &st), "Failed to stat file '%s'",item.filepath.c_str());
+    item.size = st.st_size;
+    item.mtime = fileModificationTime(st);
+    
+    if (item.size <= _preloadLimit) {
+        item.data.resize((size_t)item.size);
+        retassure(FileResourceSource(item.fd, item.size).readAt(0, item.data.data(), item.data.size()) == item.size, "Failed to read file '%s'",item.filepath.c_str());
+        item.preloaded = true;
+        close(item.fd);item.fd = -1;
+        if (_hashContent) item.hash = ContentHash::hash(item.data.data(), item.data.size());
+    }else if (_hashContent) {
+        FileResourceSource src(item.fd, item.size);
+        item.hash = ContentHash::hash(src, chunkBuf.data(), chunkBuf.size());
+    }
+}
+
+void IngestPipeline::worker(){
+    std::vector<uint8_t> chunkBuf(_hashContent ? HASH_CHUNK_SIZE : 0);
+    while (true) {
+        Item *item = NULL;
+        {
+            std::unique_lock<std::mutex> ul(_lock);
+            _itemsChanged.wait(ul, [&]{return _abort || _nextUnclaimed < _items.size() || _walkDone;});
+            if (_abort) return;
+            if (_nextUnclaimed >= _items.size()) {
+                if (_walkDone) return;
+                continue;
+            }
+            item = _items[_nextUnclaimed++].get();
+        }
+        if (!item->err) {
+            try {
+                process(*item, chunkBuf);
+            } catch (...) {
+                item->err = std::current_exception();
+            }
+        }
+        {
+            std::unique_lock<std::mutex> ul(_lock);
+            item->ready = true;
+            _itemsChanged.notify_all();
+        }
+    }
+}
+
+void IngestPipeline::run(std::string url, std::string dir, std::function<void(Item &item)> consume, std::function<bool(const Item &item)> unchanged){
+    std::vector<std::thread> threads;
+    cleanup([&]{
+        {
+            std::unique_lock<std::mutex> ul(_lock);
+            _abort = true;
+            _itemsChanged.notify_all();
+        }
+        for (auto &t : threads) {
+            t.join();
+        }
+    });
+    
+    _unchanged = unchanged;
+    threads.emplace_back([this,url,dir]{walker(url, dir);});
+    for (size_t i=0; i<_jobs; i++) {
+        threads.emplace_back([this]{worker();});
+    }
+    
+    while (true) {
+        std::unique_ptr<Item> item;
+        {
+            std::unique_lock<std::mutex> ul(_lock);
+            _itemsChanged.wait(ul, [&]{return (_items.size() && _items.front()->ready) || (_walkDone && !_items.size());});
+            if (!_items.size()) break;
+            item = std::move(_items.front());
+            _items.pop_front();
+            if (_nextUnclaimed) _nextUnclaimed--;
+            _itemsChanged.notify_all();
+        }
+        if (item->err && item->filepath.empty()) std::rethrow_exception(item->err);
+        consume(*item);
+    }
+}
+
+size_t IngestPipeline::directoriesWalked() const{
+    return _directories;
+}
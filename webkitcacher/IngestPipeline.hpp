@@ -0,0 +1,112 @@
+//
+//  IngestPipeline.hpp
+//  webkitCacher
+//
+//  Created by tihmstar on 16.10.26.
+//
+
+#ifndef IngestPipeline_hpp
+#define IngestPipeline_hpp
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include "DirectoryWalker.hpp"
+
+/*
+ Walks a directory on one thread and opens, reads and optionally hashes files on a pool of worker threads.
+ Files are handed to the consumer on the calling thread in the exact order a sequential walk would produce,
+ so the result does not depend on the number of workers.
+ */
+class IngestPipeline {
+public:
+    struct Item {
+        std::string url;        //url of the directory
+        std::string name;       //filename inside the directory
+        std::string filepath;
+        std::shared_ptr<DirectoryWalker::OpenDirectory> directory; //the file is opened relative to it
+        int fd;
+        uint64_t size;          //taken by the walk, the size of the opened file once it was read
+        int64_t mtime;
+        uint64_t hash;          //0 unless content is hashed
+        std::vector<uint8_t> data; //payload if it was small enough to be preloaded
+        bool preloaded;
+        bool unchanged;         //skipped by the unchanged filter, neither read nor hashed
+        std::exception_ptr err; //filepath is set if only this file or directory failed
+        bool ready;
+        
+        Item();
+        ~Item();
+    };
+    
+private:
+    size_t _jobs;
+    size_t _window;
+    size_t _preloadLimit;
+    size_t _directories;
+    bool _sorted;
+    bool _followSymlinks;
+    bool _hashContent;
+    std::string _resumeAfter;
+    std::vector<std::string> _rootEntries;
+    bool _hasRootEntries;
+    
+    std::mutex _lock;
+    std::condition_variable _itemsChanged;
+    std::deque<std::unique_ptr<Item>> _items;
+    size_t _nextUnclaimed;
+    bool _walkDone;
+    bool _abort;
+    std::function<bool(const Item &item)> _unchanged;
+    
+    void walk(const std::string &url, const std::string &dir);
+    void walker(std::string url, std::string dir);
+    void worker();
+    void process(Item &item, std::vector<uint8_t> &chunkBuf);
+    void push(std::unique_ptr<Item> item);
+    
+public:
+    /*
+     jobs: number of worker threads
+     preloadLimit: files up to this size are read into memory by the workers, larger files are handed over as open fd
+     sorted: walk directory entries sorted by name instead of in readdir order
+     */
+    IngestPipeline(size_t jobs, size_t preloadLimit, bool sorted = false);
+    ~IngestPipeline();
+    
+    /*
+     Only walks paths which a sorted walk visits after resumeAfter, a path relative to dir.
+     */
+    void setResumeAfter(const std::string &resumeAfter);
+    
+    /*
+     See DirectoryWalker::setFollowSymlinks and DirectoryWalker::setRootEntries.
+     */
+    void setFollowSymlinks(bool followSymlinks);
+    void setRootEntries(const std::vector<std::string> &names);
+    
+    /*
+     Whether workers compute Item::hash (default). Without it, files which aren't preloaded are only opened,
+     the consumer reads them once.
+     */
+    void setHashContent(bool hashContent);
+    
+    /*
+     unchanged: optional filter called on worker threads with the metadata the walk took, before the file is opened.
+     Returning true skips reading the file, the item is passed to consume with unchanged set.
+     Items which failed are passed to consume with err set, consume rethrows or skips them.
+     A directory which can't be listed is such an item as well, the walk continues with its siblings.
+     */
+    void run(std::string url, std::string dir, std::function<void(Item &item)> consume, std::function<bool(const Item &item)> unchanged = nullptr);
+    
+    size_t directoriesWalked() const;
+};
+
+#endif /* IngestPipeline_hpp */
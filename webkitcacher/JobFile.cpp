@@ -0,0 +1,92 @@
+//
+//  JobFile.cpp
+//  webkitCacher
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#include "JobFile.hpp"
+#include <libgeneral/macros.h>
+#include <stdio.h>
+
+static const char *gWhitespace = " \t\r";
+
+static std::string nextToken(const std::string &line, size_t &pos){
+    size_t start = line.find_first_not_of(gWhitespace, pos);
+    size_t end = 0;
+    if (start == std::string::npos) {
+        pos = line.size();
+        return "";
+    }
+    end = line.find_first_of(gWhitespace, start);
+    if (end == std::string::npos) end = line.size();
+    pos = end;
+    return line.substr(start, end-start);
+}
+
+static std::string restOfLine(const std::string &line, size_t pos){
+    size_t start = line.find_first_not_of(gWhitespace, pos);
+    size_t end = line.find_last_not_of(gWhitespace);
+    if (start == std::string::npos) return "";
+    return line.substr(start, end+1-start);
+}
+
+JobFile JobFile::load(const std::string &path){
+    FILE *f = NULL;
+    cleanup([&]{
+        safeFreeCustom(f, fclose);
+    });
+    std::string text;
+    std::string baseDir;
+    char buf[0x4000];
+    size_t didRead = 0;
+
+    retassure(f = fopen(path.c_str(), "r"), "Failed to open job file '%s'",path.c_str());
+    while ((didRead = fread(buf, 1, sizeof(buf), f)) > 0) {
+        text.append(buf, didRead);
+    }
+    retassure(!ferror(f), "Failed to read job file '%s'",path.c_str());
+
+    {
+        size_t slash = path.rfind('/');
+        if (slash != std::string::npos) baseDir = path.substr(0,slash+1);
+    }
+    return parse(text, baseDir, path);
+}
+
+JobFile JobFile::parse(const std::string &text, const std::string &baseDir, const std::string &name){
+    JobFile ret;
+    size_t lineStart = 0;
+    size_t lineNumber = 0;
+
+    while (lineStart < text.size()) {
+        size_t lineEnd = text.find('\n', lineStart);
+        std::string line;
+        std::string cmd;
+        size_t pos = 0;
+        if (lineEnd == std::string::npos) lineEnd = text.size();
+        line = text.substr(lineStart, lineEnd-lineStart);
+        lineStart = lineEnd+1;
+        lineNumber++;
+
+        cmd = nextToken(line, pos);
+        if (cmd.empty() || cmd.front() == '#') continue;
+
+        if (cmd == "cache" || cmd == "tar") {
+            Directory d;
+            d.url = nextToken(line, pos);
+            d.dir = restOfLine(line, pos);
+            retassure(d.url.size() && d.dir.size(), "%s:%zu: expected '%s <url> <%s>'",name.c_str(),lineNumber,cmd.c_str(),cmd == "tar" ? "archive" : "directory");
+            if (d.dir.front() != '/' && d.dir != "-") d.dir = baseDir + d.dir;
+            (cmd == "tar" ? ret.archives : ret.directories).push_back(d);
+        }else if (cmd == "redirect") {
+            std::string src = nextToken(line, pos);
+            std::string dst = nextToken(line, pos);
+            retassure(src.size() && dst.size() && restOfLine(line, pos).empty(), "%s:%zu: expected 'redirect <srcurl> <dsturl>'",name.c_str(),lineNumber);
+            ret.redirects.push_back({src,dst});
+        }else{
+            reterror("%s:%zu: unknown command '%s'",name.c_str(),lineNumber,cmd.c_str());
+        }
+    }
+    return ret;
+}
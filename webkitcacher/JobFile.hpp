@@ -0,0 +1,40 @@
+//
+//  JobFile.hpp
+//  webkitCacher
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#ifndef JobFile_hpp
+#define JobFile_hpp
+
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+ Describes a whole cache build, so many origins and redirects can be built in one run.
+ Line based, empty lines and lines starting with # are ignored:
+
+   cache <url> <directory>
+   tar <url> <archive>
+   redirect <srcurl> <dsturl>
+
+ The directory or archive is the rest of the line and may contain spaces,
+ relative paths are relative to the directory containing the job file.
+ */
+struct JobFile {
+    struct Directory {
+        std::string url;
+        std::string dir;
+    };
+
+    std::vector<Directory> directories;
+    std::vector<Directory> archives;     //dir is the path of a tar archive
+    std::vector<std::pair<std::string,std::string>> redirects;
+
+    static JobFile load(const std::string &path);
+    static JobFile parse(const std::string &text, const std::string &baseDir = "", const std::string &name = "<jobfile>");
+};
+
+#endif /* JobFile_hpp */
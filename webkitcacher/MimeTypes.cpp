@@ -0,0 +1,207 @@
+//
+//  MimeTypes.cpp
+//  webkitCacher
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#include "MimeTypes.hpp"
+#include <libgeneral/macros.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#define MIME_MAX_EXTENSION_LENGTH 16
+#define MIME_TABLE_SIZE 512 //power of two, sparse enough for a quick seed search
+
+namespace {
+    struct MimeEntry {
+        const char *ext;
+        const char *type;
+    };
+
+    constexpr MimeEntry gBuiltinTypes[] = {
+        {"html",        "text/html"},
+        {"htm",         "text/html"},
+        {"xhtml",       "application/xhtml+xml"},
+        {"shtml",       "text/html"},
+        {"js",          "application/javascript"},
+        {"mjs",         "application/javascript"},
+        {"css",         "text/css"},
+        {"json",        "application/json"},
+        {"map",         "application/json"},
+        {"xml",         "application/xml"},
+        {"xsl",         "application/xml"},
+        {"txt",         "text/plain"},
+        {"text",        "text/plain"},
+        {"md",          "text/markdown"},
+        {"csv",         "text/csv"},
+        {"appcache",    "text/cache-manifest"},
+        {"manifest",    "text/cache-manifest"},
+        {"webmanifest", "application/manifest+json"},
+        {"svg",         "image/svg+xml"},
+        {"svgz",        "image/svg+xml"},
+        {"png",         "image/png"},
+        {"apng",        "image/apng"},
+        {"jpg",         "image/jpeg"},
+        {"jpeg",        "image/jpeg"},
+        {"gif",         "image/gif"},
+        {"webp",        "image/webp"},
+        {"avif",        "image/avif"},
+        {"bmp",         "image/bmp"},
+        {"ico",         "image/x-icon"},
+        {"cur",         "image/x-icon"},
+        {"tif",         "image/tiff"},
+        {"tiff",        "image/tiff"},
+        {"mp4",         "video/mp4"},
+        {"m4v",         "video/mp4"},
+        {"webm",        "video/webm"},
+        {"ogv",         "video/ogg"},
+        {"mov",         "video/quicktime"},
+        {"mp3",         "audio/mpeg"},
+        {"m4a",         "audio/mp4"},
+        {"aac",         "audio/aac"},
+        {"ogg",         "audio/ogg"},
+        {"oga",         "audio/ogg"},
+        {"opus",        "audio/ogg"},
+        {"wav",         "audio/wav"},
+        {"flac",        "audio/flac"},
+        {"woff",        "font/woff"},
+        {"woff2",       "font/woff2"},
+        {"ttf",         "font/ttf"},
+        {"otf",         "font/otf"},
+        {"eot",         "application/vnd.ms-fontobject"},
+        {"wasm",        "application/wasm"},
+        {"pdf",         "application/pdf"},
+        {"zip",         "application/zip"},
+        {"gz",          "application/gzip"},
+        {"tar",         "application/x-tar"},
+        {"swf",         "application/x-shockwave-flash"},
+        {"bin",         "application/octet-stream"},
+        {"elf",         "application/octet-stream"},
+        {"self",        "application/octet-stream"},
+        {"pkg",         "application/octet-stream"},
+        {"dat",         "application/octet-stream"},
+        {"img",         "application/octet-stream"},
+    };
+    constexpr size_t gBuiltinTypesCount = sizeof(gBuiltinTypes)/sizeof(*gBuiltinTypes);
+
+    constexpr char lower(char c){
+        return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+    }
+
+    //FNV-1a over the lowercased extension, seed selects the function of the family
+    constexpr uint32_t extensionHash(const char *ext, size_t len, uint32_t seed){
+        uint32_t h = 2166136261u ^ seed;
+        for (size_t i = 0; i < len; i++) {
+            h ^= (uint8_t)lower(ext[i]);
+            h *= 16777619u;
+        }
+        h ^= h >> 15;
+        return h & (MIME_TABLE_SIZE-1);
+    }
+
+    constexpr size_t constLength(const char *str){
+        size_t len = 0;
+        while (str[len]) len++;
+        return len;
+    }
+
+    constexpr bool seedIsPerfect(uint32_t seed){
+        bool used[MIME_TABLE_SIZE] = {};
+        for (size_t i = 0; i < gBuiltinTypesCount; i++) {
+            uint32_t slot = extensionHash(gBuiltinTypes[i].ext, constLength(gBuiltinTypes[i].ext), seed);
+            if (used[slot]) return false;
+            used[slot] = true;
+        }
+        return true;
+    }
+
+    constexpr uint32_t findPerfectSeed(){
+        uint32_t seed = 0;
+        while (!seedIsPerfect(seed)) seed++;
+        return seed;
+    }
+
+    struct SlotTable {
+        int16_t entry[MIME_TABLE_SIZE];
+    };
+
+    constexpr SlotTable buildSlotTable(uint32_t seed){
+        SlotTable ret = {};
+        for (size_t i = 0; i < MIME_TABLE_SIZE; i++) ret.entry[i] = -1;
+        for (size_t i = 0; i < gBuiltinTypesCount; i++) {
+            ret.entry[extensionHash(gBuiltinTypes[i].ext, constLength(gBuiltinTypes[i].ext), seed)] = (int16_t)i;
+        }
+        return ret;
+    }
+
+    constexpr uint32_t gPerfectSeed = findPerfectSeed();
+    constexpr SlotTable gSlots = buildSlotTable(gPerfectSeed);
+    static_assert(seedIsPerfect(gPerfectSeed), "MIME table hash is not perfect");
+
+    std::string lowercase(std::string str){
+        for (auto &c : str) c = lower(c);
+        return str;
+    }
+}
+
+MimeTypes::MimeTypes()
+: _defaultType("text/html")
+{
+    //
+}
+
+const char *MimeTypes::builtinTypeForExtension(const char *ext, size_t len){
+    if (!len || len > MIME_MAX_EXTENSION_LENGTH) return NULL;
+    int16_t idx = gSlots.entry[extensionHash(ext, len, gPerfectSeed)];
+    if (idx < 0) return NULL;
+    const char *candidate = gBuiltinTypes[idx].ext;
+    for (size_t i = 0; i < len; i++) {
+        if (candidate[i] != lower(ext[i])) return NULL; //also catches candidate being shorter
+    }
+    if (candidate[len]) return NULL;
+    return gBuiltinTypes[idx].type;
+}
+
+void MimeTypes::loadOverrides(const std::string &path){
+    FILE *f = NULL;
+    char *line = NULL;
+    cleanup([&]{
+        safeFree(line);
+        safeFreeCustom(f, fclose);
+    });
+    size_t lineCap = 0;
+    ssize_t lineLen = 0;
+
+    retassure(f = fopen(path.c_str(), "r"), "Failed to open MIME types file '%s'",path.c_str());
+    while ((lineLen = getline(&line, &lineCap, f)) >= 0) {
+        char *save = NULL;
+        char *type = NULL;
+        char *ext = NULL;
+        if (char *comment = strchr(line, '#')) *comment = '\0';
+        if (!(type = strtok_r(line, " \t\r\n", &save))) continue;
+        while ((ext = strtok_r(NULL, " \t\r\n", &save))) {
+            if (*ext == '.') ext++;
+            _overrides[lowercase(ext)] = type;
+        }
+    }
+}
+
+const char *MimeTypes::typeForFilename(const std::string &filename) const{
+    size_t dot = filename.rfind('.');
+    const char *ret = NULL;
+    if (dot == std::string::npos || dot+1 == filename.size()) return _defaultType.c_str();
+
+    if (_overrides.size()) {
+        auto it = _overrides.find(lowercase(filename.substr(dot+1)));
+        if (it != _overrides.end()) return it->second.c_str();
+    }
+    if ((ret = builtinTypeForExtension(filename.c_str()+dot+1, filename.size()-dot-1))) return ret;
+    return _defaultType.c_str();
+}
+
+const char *MimeTypes::intern(const std::string &type){
+    return _interned.insert(type).first->c_str();
+}
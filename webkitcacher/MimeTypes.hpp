@@ -0,0 +1,50 @@
+//
+//  MimeTypes.hpp
+//  webkitCacher
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#ifndef MimeTypes_hpp
+#define MimeTypes_hpp
+
+#include <stddef.h>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+/*
+ Maps file extensions to MIME types.
+ The built-in table is resolved with a perfect hash computed at compile time,
+ user overrides are only consulted if some were loaded.
+ */
+class MimeTypes {
+    std::unordered_map<std::string, std::string> _overrides;
+    std::string _defaultType;
+    std::unordered_set<std::string> _interned;
+
+public:
+    MimeTypes();
+
+    /*
+     Returns built-in MIME type for extension (without dot, case insensitive) or NULL if unknown.
+     */
+    static const char *builtinTypeForExtension(const char *ext, size_t len);
+
+    /*
+     Loads overrides in the format of mime.types: "<mime/type> <ext> [<ext> ...]", lines starting with # are ignored.
+     */
+    void loadOverrides(const std::string &path);
+
+    /*
+     Files without known extension are text/html.
+     */
+    const char *typeForFilename(const std::string &filename) const;
+    
+    /*
+     Returns a pointer to type which stays valid for the lifetime of this object.
+     */
+    const char *intern(const std::string &type);
+};
+
+#endif /* MimeTypes_hpp */
@@ -0,0 +1,147 @@
+//
+//  ResourceSource.cpp
+//  webkitCacher
+//
+//  Created by tihmstar on 16.10.26.
+//
+
+#include "ResourceSource.hpp"
+#include <libgeneral/macros.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#pragma mark ResourceSource
+
+ResourceSource::~ResourceSource(){
+    //
+}
+
+const void *ResourceSource::buffer(){
+    return NULL;
+}
+
+int ResourceSource::fileDescriptor(){
+    return -1;
+}
+
+const char *ResourceSource::filePath(){
+    return NULL;
+}
+
+bool ResourceSource::readsOnce(){
+    return false;
+}
+
+#pragma mark BufferResourceSource
+
+BufferResourceSource::BufferResourceSource(const void *buf, uint64_t size)
+: _buf(buf), _size(size)
+{
+    //
+}
+
+uint64_t BufferResourceSource::size(){
+    return _size;
+}
+
+size_t BufferResourceSource::readAt(uint64_t offset, void *buf, size_t len){
+    if (offset >= _size) return 0;
+    if (len > _size - offset) len = (size_t)(_size - offset);
+    memcpy(buf, (const uint8_t*)_buf + offset, len);
+    return len;
+}
+
+const void *BufferResourceSource::buffer(){
+    return _buf;
+}
+
+#pragma mark FileResourceSource
+
+FileResourceSource::FileResourceSource(int fd, uint64_t size, const char *path)
+: _fd(fd), _size(size), _path(path)
+{
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+}
+
+uint64_t FileResourceSource::size(){
+    return _size;
+}
+
+size_t FileResourceSource::readAt(uint64_t offset, void *buf, size_t len){
+    size_t didRead = 0;
+    if (offset >= _size) return 0;
+    if (len > _size - offset) len = (size_t)(_size - offset);
+    
+    while (didRead < len) {
+        ssize_t cur = pread(_fd, (uint8_t*)buf + didRead, len - didRead, (off_t)(offset + didRead));
+        if (cur < 0 && errno == EINTR) continue;
+        retassure(cur >= 0, "Failed to read file with err=%d (%s)",errno,strerror(errno));
+        retassure(cur > 0, "File shrunk while reading");
+        didRead += cur;
+    }
+    return didRead;
+}
+
+int FileResourceSource::fileDescriptor(){
+    return _fd;
+}
+
+const char *FileResourceSource::filePath(){
+    return _path;
+}
+
+#pragma mark FileRangeResourceSource
+
+FileRangeResourceSource::FileRangeResourceSource(int fd, uint64_t offset, uint64_t size)
+: _fd(fd), _offset(offset), _size(size)
+{
+    //
+}
+
+uint64_t FileRangeResourceSource::size(){
+    return _size;
+}
+
+size_t FileRangeResourceSource::readAt(uint64_t offset, void *buf, size_t len){
+    size_t didRead = 0;
+    if (offset >= _size) return 0;
+    if (len > _size - offset) len = (size_t)(_size - offset);
+    
+    while (didRead < len) {
+        ssize_t cur = pread(_fd, (uint8_t*)buf + didRead, len - didRead, (off_t)(_offset + offset + didRead));
+        if (cur < 0 && errno == EINTR) continue;
+        retassure(cur >= 0, "Failed to read file with err=%d (%s)",errno,strerror(errno));
+        retassure(cur > 0, "File shrunk while reading");
+        didRead += cur;
+    }
+    return didRead;
+}
+
+#pragma mark CallbackResourceSource
+
+CallbackResourceSource::CallbackResourceSource(uint64_t size, ReadCallback read)
+: _size(size), _read(read)
+{
+    //
+}
+
+uint64_t CallbackResourceSource::size(){
+    return _size;
+}
+
+size_t CallbackResourceSource::readAt(uint64_t offset, void *buf, size_t len){
+    size_t didRead = 0;
+    if (offset >= _size) return 0;
+    if (len > _size - offset) len = (size_t)(_size - offset);
+    
+    while (didRead < len) {
+        size_t cur = _read(offset + didRead, (uint8_t*)buf + didRead, len - didRead);
+        retassure(cur > 0 && cur <= len - didRead, "Resource callback returned %zu bytes at offset %llu",cur,(unsigned long long)(offset + didRead));
+        didRead += cur;
+    }
+    return didRead;
+}
@@ -0,0 +1,117 @@
+//
+//  ResourceSource.hpp
+//  webkitCacher
+//
+//  Created by tihmstar on 16.10.26.
+//
+
+#ifndef ResourceSource_hpp
+#define ResourceSource_hpp
+
+#include <stdint.h>
+#include <stddef.h>
+#include <functional>
+
+/*
+ Provides the payload of a single resource.
+ Data is pulled in chunks, so a resource never needs to be held in memory as a whole.
+ */
+class ResourceSource {
+public:
+    virtual ~ResourceSource();
+    
+    virtual uint64_t size() = 0;
+    
+    /*
+     Reads up to len bytes starting at offset into buf.
+     Returns number of bytes read, which is only less than len at the end of the resource.
+     */
+    virtual size_t readAt(uint64_t offset, void *buf, size_t len) = 0;
+    
+    /*
+     Returns pointer to the whole payload if it is already available in memory, NULL otherwise.
+     */
+    virtual const void *buffer();
+    
+    /*
+     Returns file descriptor backing the payload, or -1 if there is none.
+     Allows copying the payload inside the kernel.
+     */
+    virtual int fileDescriptor();
+    
+    /*
+     Returns path of the file backing the payload, or NULL if unknown.
+     */
+    virtual const char *filePath();
+    
+    /*
+     Whether the payload can only be read once, front to back, e.g. a large member of a piped archive.
+     Consumers which need it twice, like deduplication, have to work with what they saw while storing it.
+     */
+    virtual bool readsOnce();
+};
+
+class BufferResourceSource : public ResourceSource {
+    const void *_buf;
+    uint64_t _size;
+public:
+    BufferResourceSource(const void *buf, uint64_t size);
+    
+    virtual uint64_t size() override;
+    virtual size_t readAt(uint64_t offset, void *buf, size_t len) override;
+    virtual const void *buffer() override;
+};
+
+class FileResourceSource : public ResourceSource {
+    int _fd;
+    uint64_t _size;
+    const char *_path;
+public:
+    /*
+     Does not take ownership of fd.
+     path is optional and must outlive this object.
+     */
+    FileResourceSource(int fd, uint64_t size, const char *path = NULL);
+    
+    virtual uint64_t size() override;
+    virtual size_t readAt(uint64_t offset, void *buf, size_t len) override;
+    virtual int fileDescriptor() override;
+    virtual const char *filePath() override;
+};
+
+/*
+ Payload stored at offset inside a larger file, e.g. a member of an archive.
+ */
+class FileRangeResourceSource : public ResourceSource {
+    int _fd;
+    uint64_t _offset;
+    uint64_t _size;
+public:
+    /*
+     Does not take ownership of fd.
+     */
+    FileRangeResourceSource(int fd, uint64_t offset, uint64_t size);
+    
+    virtual uint64_t size() override;
+    virtual size_t readAt(uint64_t offset, void *buf, size_t len) override;
+};
+
+/*
+ Payload generated on demand by a callback, e.g. by an application which builds resources in memory.
+ read fills buf with up to len bytes starting at offset and returns how many it wrote.
+ Ranges may be requested more than once, e.g. once for hashing and once for writing.
+ */
+class CallbackResourceSource : public ResourceSource {
+public:
+    typedef std::function<size_t(uint64_t offset, void *buf, size_t len)> ReadCallback;
+private:
+    uint64_t _size;
+    ReadCallback _read;
+public:
+    CallbackResourceSource(uint64_t size, ReadCallback read);
+    
+    virtual uint64_t size() override;
+    virtual size_t readAt(uint64_t offset, void *buf, size_t len) override;
+};
+
+#endif /* ResourceSource_hpp */
@@ -0,0 +1,192 @@
+//
+//  ShardedBuild.cpp
+//  webkitCacher
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#include "ShardedBuild.hpp"
+#include "DirectoryWalker.hpp"
+#include <libgeneral/macros.h>
+#include <unistd.h>
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#define SHARD_FILE_COST 4096 //every file costs rows and statements besides its bytes, so trees of small files are not underestimated
+
+namespace {
+    struct Shard {
+        std::vector<std::string> names;
+        std::string path;
+        std::vector<WebkitCacher::FailedFile> failedFiles;
+        WebkitCacher::BuildCounters counters;
+        std::exception_ptr err;
+        bool done;
+    };
+
+    void removeDatabase(const std::string &path){
+        unlink(path.c_str());
+        unlink((path + "-journal").c_str());
+        unlink((path + "-wal").c_str());
+        unlink((path + "-shm").c_str());
+    }
+}
+
+#pragma mark private
+
+std::vector<std::vector<std::string>> ShardedBuild::partition(const std::string &dir){
+    std::vector<DirectoryEntry> entries = listDirectory(dir, true);
+    std::vector<std::vector<std::string>> ret;
+
+    if (_partition == Partition::TopLevel) {
+        std::vector<std::string> files;
+        for (auto &e : entries) {
+            if (e.isDirectory) {
+                ret.push_back({e.name});
+            }else{
+                files.push_back(e.name);
+            }
+        }
+        if (files.size()) ret.insert(ret.begin(), files);
+    }else{
+        std::vector<std::pair<uint64_t, std::string>> costs;
+        std::vector<uint64_t> shardCost(std::min(_threads, entries.size()));
+        std::unordered_map<std::string, size_t> indexForName;
+        uint64_t *cost = NULL;
+        for (auto &e : entries) {
+            indexForName[e.name] = costs.size();
+            costs.push_back({0, e.name});
+        }
+        {
+            //one walk over the whole tree, everything below a top-level entry comes right after it
+            DirectoryWalker walker("/", dir);
+            while (walker.next()) {
+                if (walker.url().size() == 1) {
+                    auto i = indexForName.find(walker.name());
+                    cost = (i != indexForName.end()) ? &costs[i->second].first : NULL;
+                }
+                if (walker.type() == DirectoryWalker::File && cost) *cost += walker.size() + SHARD_FILE_COST;
+            }
+        }
+        //largest first into the cheapest shard, entries of equal cost stay in name order so the partition is reproducible
+        std::stable_sort(costs.begin(), costs.end(), [](const std::pair<uint64_t, std::string> &a, const std::pair<uint64_t, std::string> &b){
+            return a.first > b.first;
+        });
+        ret.resize(shardCost.size());
+        for (auto &c : costs) {
+            size_t cheapest = std::min_element(shardCost.begin(), shardCost.end()) - shardCost.begin();
+            ret[cheapest].push_back(c.second);
+            shardCost[cheapest] += c.first;
+        }
+        for (auto &names : ret) {
+            std::sort(names.begin(), names.end());
+        }
+    }
+    return ret;
+}
+
+#pragma mark public
+
+ShardedBuild::ShardedBuild(WebkitCacher &target, std::string databasePath, size_t threads, Partition partition)
+: _target(target), _databasePath(databasePath), _threads(threads), _partition(partition), _shardsBuilt(0)
+{
+    if (!_threads) _threads = 1;
+}
+
+void ShardedBuild::setConfigure(Configure configure){
+    _configure = configure;
+}
+
+void ShardedBuild::cacheDirectory(std::string url, std::string dir){
+    std::vector<Shard> shards;
+    std::vector<std::thread> threads;
+    std::mutex lock;
+    std::condition_variable shardDone;
+    size_t nextShard = 0;
+    bool abort = false;
+    cleanup([&]{
+        {
+            std::unique_lock<std::mutex> ul(lock);
+            abort = true;
+        }
+        for (auto &t : threads) {
+            t.join();
+        }
+        for (auto &s : shards) {
+            removeDatabase(s.path);
+        }
+    });
+
+    if (url.back() != '/') url += '/';
+    if (dir.back() != '/') dir += '/';
+
+    for (auto &names : partition(dir)) {
+        Shard shard = {};
+        shard.names = std::move(names);
+        shard.path = _databasePath + ".shard" + std::to_string(shards.size());
+        shards.push_back(std::move(shard));
+    }
+    if (!shards.size()) {
+        _target.cacheDirectoryEntries(url, dir, {}); //still needs the manifest
+        return;
+    }
+
+    auto worker = [&]{
+        while (true) {
+            Shard *shard = NULL;
+            size_t index = 0;
+            {
+                std::unique_lock<std::mutex> ul(lock);
+                if (abort || nextShard >= shards.size()) return;
+                index = nextShard++;
+                shard = &shards[index];
+            }
+            try {
+                removeDatabase(shard->path); //left behind by an interrupted run
+                WebkitCacher wk(shard->path, WebkitCacher::StagingMode::Direct, StorageProfile::named("fast"));
+                if (_configure) _configure(wk, index);
+                wk.beginTransaction();
+                wk.cacheDirectoryEntries(url, dir, shard->names);
+                wk.commitTransaction();
+                shard->failedFiles = wk.failedFiles();
+                shard->counters = wk.buildCounters();
+            } catch (...) {
+                shard->err = std::current_exception();
+            }
+            {
+                std::unique_lock<std::mutex> ul(lock);
+                shard->done = true;
+                shardDone.notify_all();
+            }
+        }
+    };
+    for (size_t i=0; i<_threads && i<shards.size(); i++) {
+        threads.emplace_back(worker);
+    }
+
+    //merge in shard order while later shards are still being built
+    for (auto &shard : shards) {
+        {
+            std::unique_lock<std::mutex> ul(lock);
+            shardDone.wait(ul, [&]{return shard.done;});
+        }
+        if (shard.err) std::rethrow_exception(shard.err);
+        _target.mergeDatabase(shard.path);
+        _target.addBuildCounters(shard.counters);
+        removeDatabase(shard.path);
+        _failedFiles.insert(_failedFiles.end(), shard.failedFiles.begin(), shard.failedFiles.end());
+        _shardsBuilt++;
+    }
+}
+
+size_t ShardedBuild::shardsBuilt() const{
+    return _shardsBuilt;
+}
+
+const std::vector<WebkitCacher::FailedFile> &ShardedBuild::failedFiles() const{
+    return _failedFiles;
+}
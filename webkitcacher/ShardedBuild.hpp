@@ -0,0 +1,61 @@
+//
+//  ShardedBuild.hpp
+//  webkitCacher
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#ifndef ShardedBuild_hpp
+#define ShardedBuild_hpp
+
+#include <stdint.h>
+#include <functional>
+#include <string>
+#include <vector>
+#include "WebkitCacher.hpp"
+
+/*
+ Builds one directory with several database connections at once.
+ The top-level entries of the directory are split into shards, every shard is built by its own WebkitCacher
+ into a temporary database next to the target on one of the threads, and the shards are merged into the target
+ with WebkitCacher::mergeDatabase in shard order, so the result only depends on the partition.
+ The build counters of every shard are added to the target's, phase times stay those of the target's thread.
+ */
+class ShardedBuild {
+public:
+    enum Partition {
+        TopLevel = 0,   //one shard per top-level directory, files directly inside the directory form one more shard
+        Size            //one shard per thread, top-level entries are spread so every shard gets about the same number of bytes
+    };
+
+    /*
+     Called on the thread building the shard, before anything is cached. index is unique per shard.
+     */
+    typedef std::function<void(WebkitCacher &shard, size_t index)> Configure;
+
+private:
+    WebkitCacher &_target;
+    std::string _databasePath;
+    size_t _threads;
+    Partition _partition;
+    Configure _configure;
+    std::vector<WebkitCacher::FailedFile> _failedFiles;
+    size_t _shardsBuilt;
+
+    std::vector<std::vector<std::string>> partition(const std::string &dir);
+
+public:
+    /*
+     databasePath: path of the database target writes to, the shards are created next to it
+     */
+    ShardedBuild(WebkitCacher &target, std::string databasePath, size_t threads, Partition partition = Partition::Size);
+
+    void setConfigure(Configure configure);
+
+    void cacheDirectory(std::string url, std::string dir);
+
+    size_t shardsBuilt() const;
+    const std::vector<WebkitCacher::FailedFile> &failedFiles() const;
+};
+
+#endif /* ShardedBuild_hpp */
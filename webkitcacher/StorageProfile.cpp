@@ -0,0 +1,98 @@
+//
+//  StorageProfile.cpp
+//  webkitCacher
+//
+//  Created by tihmstar on 16.10.26.
+//
+
+#include "StorageProfile.hpp"
+#include <libgeneral/macros.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <initializer_list>
+
+static std::string upper(std::string str){
+    for (auto &c : str) c = toupper((unsigned char)c);
+    return str;
+}
+
+static bool isOneOf(const std::string &value, std::initializer_list<const char *> allowed){
+    for (auto a : allowed) {
+        if (value == a) return true;
+    }
+    return false;
+}
+
+StorageProfile::StorageProfile()
+: pageSize(0), cacheSize(0), compact(false), indexes(false)
+{
+    //
+}
+
+StorageProfile StorageProfile::named(const std::string &name){
+    StorageProfile ret;
+    if (name == "default") {
+        //sqlite defaults, nothing else
+    }else if (name == "fast") {
+        //no crash safety while building, use together with staging or on a throwaway file
+        ret.pageSize = 8192; //fewer overflow pages per resource blob
+        ret.journalMode = "OFF";
+        ret.synchronous = "OFF";
+        ret.cacheSize = -64*1024;
+        ret.tempStore = "MEMORY";
+        ret.compact = true;
+    }else if (name == "wal") {
+        ret.journalMode = "WAL";
+        ret.synchronous = "NORMAL";
+        ret.cacheSize = -64*1024;
+        ret.tempStore = "MEMORY";
+        ret.compact = true;
+    }else{
+        reterror("unknown storage profile '%s'",name.c_str());
+    }
+    return ret;
+}
+
+StorageProfile StorageProfile::parse(const std::string &spec){
+    StorageProfile ret;
+    size_t pos = 0;
+
+    while (pos <= spec.size()) {
+        size_t end = spec.find(',', pos);
+        if (end == std::string::npos) end = spec.size();
+        std::string entry = spec.substr(pos, end-pos);
+        size_t eq = entry.find('=');
+        pos = end+1;
+        if (entry.empty()) continue;
+
+        if (eq == std::string::npos) {
+            ret = named(entry);
+            continue;
+        }
+
+        std::string key = entry.substr(0,eq);
+        std::string value = upper(entry.substr(eq+1));
+        if (key == "page_size") {
+            ret.pageSize = (uint32_t)strtoul(value.c_str(), NULL, 0);
+            retassure(ret.pageSize >= 512 && ret.pageSize <= 65536 && !(ret.pageSize & (ret.pageSize-1)), "invalid page_size '%s'",value.c_str());
+        }else if (key == "journal_mode") {
+            retassure(isOneOf(value, {"OFF","MEMORY","WAL","DELETE","TRUNCATE","PERSIST"}), "invalid journal_mode '%s'",value.c_str());
+            ret.journalMode = value;
+        }else if (key == "synchronous") {
+            retassure(isOneOf(value, {"OFF","NORMAL","FULL","EXTRA"}), "invalid synchronous '%s'",value.c_str());
+            ret.synchronous = value;
+        }else if (key == "cache_size") {
+            ret.cacheSize = strtoll(value.c_str(), NULL, 0);
+        }else if (key == "temp_store") {
+            retassure(isOneOf(value, {"DEFAULT","FILE","MEMORY"}), "invalid temp_store '%s'",value.c_str());
+            ret.tempStore = value;
+        }else if (key == "compact") {
+            ret.compact = isOneOf(value, {"1","YES","TRUE","ON"});
+        }else if (key == "indexes") {
+            ret.indexes = isOneOf(value, {"1","YES","TRUE","ON"});
+        }else{
+            reterror("unknown storage profile key '%s'",key.c_str());
+        }
+    }
+    return ret;
+}
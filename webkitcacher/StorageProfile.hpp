@@ -0,0 +1,42 @@
+//
+//  StorageProfile.hpp
+//  webkitCacher
+//
+//  Created by tihmstar on 16.10.26.
+//
+
+#ifndef StorageProfile_hpp
+#define StorageProfile_hpp
+
+#include <stdint.h>
+#include <string>
+
+/*
+ SQLite settings used while building the cache, and whether the result is compacted afterwards.
+ Empty or zero fields keep the sqlite defaults.
+ */
+struct StorageProfile {
+    uint32_t pageSize;          //power of two between 512 and 65536
+    std::string journalMode;    //OFF, MEMORY, WAL, DELETE, TRUNCATE, PERSIST
+    std::string synchronous;    //OFF, NORMAL, FULL, EXTRA
+    int64_t cacheSize;          //same semantics as PRAGMA cache_size, negative values are KiB
+    std::string tempStore;      //DEFAULT, FILE, MEMORY
+    bool compact;               //VACUUM, ANALYZE and optimize after the build
+    bool indexes;               //secondary indexes for the queries WebKit runs when loading a cache
+
+    StorageProfile();
+
+    /*
+     Known profiles: "default", "fast", "wal"
+     */
+    static StorageProfile named(const std::string &name);
+
+    /*
+     Comma separated list of a profile name and/or key=value pairs, later entries override earlier ones.
+     Keys: page_size, journal_mode, synchronous, cache_size, temp_store, compact, indexes
+     Example: "fast,page_size=16384"
+     */
+    static StorageProfile parse(const std::string &spec);
+};
+
+#endif /* StorageProfile_hpp */
@@ -0,0 +1,381 @@
+//
+//  TarReader.cpp
+//  webkitCacher
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#include "TarReader.hpp"
+#include <libgeneral/macros.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TAR_BLOCK_SIZE 512
+#define TAR_MAX_HEADER_DATA (1024*1024) //longest pax or GNU long name header we accept
+
+namespace {
+    struct UstarHeader {
+        char name[100];
+        char mode[8];
+        char uid[8];
+        char gid[8];
+        char size[12];
+        char mtime[12];
+        char chksum[8];
+        char typeflag;
+        char linkname[100];
+        char magic[6];
+        char version[2];
+        char uname[32];
+        char gname[32];
+        char devmajor[8];
+        char devminor[8];
+        char prefix[155];
+        char pad[12];
+    };
+    static_assert(sizeof(UstarHeader) == TAR_BLOCK_SIZE, "bad tar header size");
+
+    std::string fieldString(const char *field, size_t len){
+        return std::string(field, strnlen(field, len));
+    }
+
+    uint64_t fieldNumber(const char *field, size_t len){
+        uint64_t ret = 0;
+        if ((uint8_t)field[0] & 0x80) {
+            //GNU base-256 for values which don't fit into octal
+            ret = (uint8_t)field[0] & 0x3f;
+            for (size_t i = 1; i < len; i++) {
+                retassure(ret >> 56 == 0, "tar header number overflow");
+                ret = (ret << 8) | (uint8_t)field[i];
+            }
+            return ret;
+        }
+        size_t i = 0;
+        while (i < len && field[i] == ' ') i++;
+        for (; i < len && field[i] >= '0' && field[i] <= '7'; i++) {
+            ret = (ret << 3) | (field[i] - '0');
+        }
+        return ret;
+    }
+
+    bool checksumValid(const UstarHeader &hdr){
+        const uint8_t *p = (const uint8_t *)&hdr;
+        uint64_t expected = fieldNumber(hdr.chksum, sizeof(hdr.chksum));
+        uint64_t sumUnsigned = 0;
+        int64_t sumSigned = 0;
+        for (size_t i = 0; i < TAR_BLOCK_SIZE; i++) {
+            bool inChksum = i >= offsetof(UstarHeader, chksum) && i < offsetof(UstarHeader, chksum) + sizeof(hdr.chksum);
+            uint8_t c = inChksum ? ' ' : p[i];
+            sumUnsigned += c;
+            sumSigned += (int8_t)c;
+        }
+        return expected == sumUnsigned || (int64_t)expected == sumSigned; //some old tars used signed sums
+    }
+
+    bool isZeroBlock(const UstarHeader &hdr){
+        const uint8_t *p = (const uint8_t *)&hdr;
+        for (size_t i = 0; i < TAR_BLOCK_SIZE; i++) {
+            if (p[i]) return false;
+        }
+        return true;
+    }
+
+    uint64_t paddedSize(uint64_t size){
+        return (size + TAR_BLOCK_SIZE - 1) & ~(uint64_t)(TAR_BLOCK_SIZE - 1);
+    }
+
+    int64_t parsePaxTime(const std::string &value){
+        //seconds with optional fraction, e.g. "1697500000.123456789"
+        int64_t seconds = strtoll(value.c_str(), NULL, 10);
+        int64_t nanoseconds = 0;
+        size_t dot = value.find('.');
+        if (dot != std::string::npos) {
+            int64_t scale = 100000000;
+            for (size_t i = dot+1; i < value.size() && scale && value[i] >= '0' && value[i] <= '9'; i++, scale /= 10) {
+                nanoseconds += (value[i] - '0') * scale;
+            }
+            if (value.front() == '-') nanoseconds = -nanoseconds;
+        }
+        return seconds*1000000000 + nanoseconds;
+    }
+
+    std::string normalizePath(std::string path){
+        while (path.size()) {
+            if (path.compare(0, 2, "./") == 0) {
+                path = path.substr(2);
+            }else if (path.front() == '/') {
+                path = path.substr(1);
+            }else{
+                break;
+            }
+        }
+        return path;
+    }
+
+    std::string resolveSymlink(const std::string &linkPath, const std::string &target){
+        std::vector<std::string> components;
+        std::string path;
+        size_t pos = 0;
+        
+        if (target.empty() || target.front() == '/') return ""; //absolute targets are outside of the archive
+        path = linkPath.substr(0, linkPath.rfind('/')+1) + target; //npos+1 is 0
+        while (pos <= path.size()) {
+            size_t slash = path.find('/', pos);
+            if (slash == std::string::npos) slash = path.size();
+            std::string component = path.substr(pos, slash-pos);
+            if (component == "..") {
+                if (components.empty()) return "";
+                components.pop_back();
+            }else if (component.size() && component != ".") {
+                components.push_back(component);
+            }
+            pos = slash+1;
+        }
+        path.clear();
+        for (auto &c : components) {
+            if (path.size()) path += '/';
+            path += c;
+        }
+        return path;
+    }
+}
+
+#pragma mark TarReader::StreamResourceSource
+
+TarReader::StreamResourceSource::StreamResourceSource(TarReader &tar, uint64_t size)
+: _tar(tar), _size(size), _next(0)
+{
+    //
+}
+
+uint64_t TarReader::StreamResourceSource::size(){
+    return _size;
+}
+
+size_t TarReader::StreamResourceSource::readAt(uint64_t offset, void *buf, size_t len){
+    retassure(offset == _next, "Member of a non-seekable archive can only be read once, front to back");
+    if (len > _size - offset) len = (size_t)(_size - offset);
+    _tar.readFully(buf, len);
+    _next += len;
+    return len;
+}
+
+bool TarReader::StreamResourceSource::readsOnce(){
+    return true;
+}
+
+#pragma mark TarReader
+
+TarReader::TarReader(int fd, size_t memoryLimit)
+: _fd(fd), _seekable(false), _memoryLimit(memoryLimit),
+    _pos(0), _dataOffset(0), _dataSize(0), _eof(false),
+    _directories(0)
+{
+    off_t cur = lseek(_fd, 0, SEEK_CUR);
+    if (cur != -1) {
+        _seekable = true;
+        _pos = cur;
+        _dataOffset = cur;
+    }
+}
+
+TarReader::~TarReader(){
+    _data.reset();
+}
+
+#pragma mark private
+
+size_t TarReader::readUpTo(void *buf, size_t len){
+    size_t didRead = 0;
+    while (didRead < len) {
+        ssize_t cur = _seekable ? pread(_fd, (uint8_t*)buf + didRead, len - didRead, (off_t)(_pos + didRead))
+                                : read(_fd, (uint8_t*)buf + didRead, len - didRead);
+        if (cur < 0 && errno == EINTR) continue;
+        retassure(cur >= 0, "Failed to read tar stream with err=%d (%s)",errno,strerror(errno));
+        if (!cur) break;
+        didRead += cur;
+    }
+    _pos += didRead;
+    return didRead;
+}
+
+void TarReader::readFully(void *buf, size_t len){
+    retassure(readUpTo(buf, len) == len, "Unexpected end of tar stream");
+}
+
+void TarReader::skip(uint64_t len){
+    if (_seekable) {
+        _pos += len;
+        return;
+    }
+    if (_skipBuffer.size() < 0x10000) _skipBuffer.resize(0x10000);
+    while (len) {
+        size_t cur = len < _skipBuffer.size() ? (size_t)len : _skipBuffer.size();
+        readFully(_skipBuffer.data(), cur);
+        len -= cur;
+    }
+}
+
+void TarReader::skipToNextHeader(){
+    _data.reset();
+    skip(_dataOffset + paddedSize(_dataSize) - _pos); //whatever of the payload and padding wasn't read yet
+    _dataOffset = _pos;
+    _dataSize = 0;
+}
+
+std::string TarReader::readMemberString(uint64_t size){
+    std::string ret;
+    retassure(size <= TAR_MAX_HEADER_DATA, "tar extended header too large (%llu bytes)",(unsigned long long)size);
+    ret.resize((size_t)size);
+    readFully(&ret[0], (size_t)size);
+    return ret;
+}
+
+#pragma mark public
+
+bool TarReader::next(Entry &entry){
+    std::string longName;
+    std::string longLink;
+    std::string paxPath;
+    std::string paxLink;
+    uint64_t paxSize = 0;
+    bool hasPaxSize = false;
+    int64_t paxMtime = 0;
+    bool hasPaxMtime = false;
+    
+    if (_eof) return false;
+    
+    while (true) {
+        UstarHeader hdr = {};
+        std::string path;
+        size_t didRead = 0;
+        
+        skipToNextHeader();
+        //a stream ending without the two zero blocks is tolerated, as long as it ends on a header boundary
+        if (!(didRead = readUpTo(&hdr, sizeof(hdr))) || isZeroBlock(hdr)) {
+            _eof = true;
+            return false;
+        }
+        retassure(didRead == sizeof(hdr), "Unexpected end of tar stream");
+        retassure(checksumValid(hdr), "Bad tar header checksum at offset %llu",(unsigned long long)(_pos - TAR_BLOCK_SIZE));
+        
+        _dataOffset = _pos;
+        _dataSize = fieldNumber(hdr.size, sizeof(hdr.size));
+        
+        switch (hdr.typeflag) {
+            case 'x': //pax extended header for the next entry
+            {
+                std::string records = readMemberString(_dataSize);
+                size_t pos = 0;
+                while (pos < records.size()) {
+                    size_t space = records.find(' ', pos);
+                    retassure(space != std::string::npos, "Malformed pax header");
+                    uint64_t recordLen = strtoull(records.c_str()+pos, NULL, 10);
+                    retassure(recordLen > space-pos && pos+recordLen <= records.size(), "Malformed pax header");
+                    std::string record = records.substr(space+1, pos+recordLen-space-2); //without trailing newline
+                    size_t eq = record.find('=');
+                    if (eq != std::string::npos) {
+                        std::string key = record.substr(0,eq);
+                        std::string value = record.substr(eq+1);
+                        if (key == "path") {
+                            paxPath = value;
+                        }else if (key == "linkpath") {
+                            paxLink = value;
+                        }else if (key == "size") {
+                            paxSize = strtoull(value.c_str(), NULL, 10);
+                            hasPaxSize = true;
+                        }else if (key == "mtime") {
+                            paxMtime = parsePaxTime(value);
+                            hasPaxMtime = true;
+                        }
+                    }
+                    pos += recordLen;
+                }
+                continue;
+            }
+            case 'L': //GNU long name for the next entry
+                longName = readMemberString(_dataSize);
+                longName = fieldString(longName.c_str(), longName.size());
+                continue;
+            case 'K': //GNU long link name for the next entry
+                longLink = readMemberString(_dataSize);
+                longLink = fieldString(longLink.c_str(), longLink.size());
+                continue;
+            case 'S':
+                reterror("GNU sparse tar members are not supported");
+            case '0':
+            case '7':
+            case '\0':
+                entry.type = File;
+                break;
+            case '1':
+                entry.type = Hardlink;
+                break;
+            case '2':
+                entry.type = Symlink;
+                break;
+            default: //directories, devices, fifos, global pax headers
+                if (hdr.typeflag == '5') _directories++;
+                paxPath.clear();
+                paxLink.clear();
+                longName.clear();
+                longLink.clear();
+                hasPaxSize = hasPaxMtime = false;
+                continue;
+        }
+        
+        if (paxPath.size()) {
+            path = paxPath;
+        }else if (longName.size()) {
+            path = longName;
+        }else{
+            path = fieldString(hdr.name, sizeof(hdr.name));
+            if (!memcmp(hdr.magic, "ustar", 5) && hdr.prefix[0]) {
+                path = fieldString(hdr.prefix, sizeof(hdr.prefix)) + "/" + path;
+            }
+        }
+        path = normalizePath(path);
+        if (path.empty() || path.back() == '/') { //old tars mark directories with a trailing slash only
+            if (entry.type == File) _directories++;
+            paxPath.clear();
+            paxLink.clear();
+            longName.clear();
+            longLink.clear();
+            hasPaxSize = hasPaxMtime = false;
+            continue;
+        }
+        
+        if (hasPaxSize) _dataSize = paxSize;
+        entry.path = path;
+        entry.size = _dataSize;
+        entry.mtime = hasPaxMtime ? paxMtime : (int64_t)fieldNumber(hdr.mtime, sizeof(hdr.mtime))*1000000000;
+        entry.linkTarget.clear();
+        if (entry.type != File) {
+            std::string link = paxLink.size() ? paxLink : longLink.size() ? longLink : fieldString(hdr.linkname, sizeof(hdr.linkname));
+            //hardlinks name another member of the archive, symlinks a path relative to themselves
+            entry.linkTarget = entry.type == Hardlink ? normalizePath(link) : resolveSymlink(path, link);
+        }
+        return true;
+    }
+}
+
+ResourceSource &TarReader::data(){
+    if (_data) return *_data;
+    
+    if (_seekable) {
+        _data.reset(new FileRangeResourceSource(_fd, _dataOffset, _dataSize));
+    }else if (_dataSize <= _memoryLimit) {
+        if (_memberBuffer.size() < _dataSize) _memberBuffer.resize((size_t)_dataSize);
+        readFully(_memberBuffer.data(), (size_t)_dataSize);
+        _data.reset(new BufferResourceSource(_memberBuffer.data(), _dataSize));
+    }else{
+        _data.reset(new StreamResourceSource(*this, _dataSize));
+    }
+    return *_data;
+}
+
+uint64_t TarReader::directories() const{
+    return _directories;
+}
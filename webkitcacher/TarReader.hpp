@@ -0,0 +1,97 @@
+//
+//  TarReader.hpp
+//  webkitCacher
+//
+//  Created by tihmstar on 17.10.26.
+//
+
+#ifndef TarReader_hpp
+#define TarReader_hpp
+
+#include <stdint.h>
+#include <stddef.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include "ResourceSource.hpp"
+
+/*
+ Reads regular files and links from an uncompressed ustar, pax or GNU tar stream.
+ Seekable inputs are read in place, members of non-seekable inputs (pipes, stdin) are buffered
+ in memory up to memoryLimit bytes. Larger members are read straight from the stream while they are stored,
+ they can only be read once, front to back (see ResourceSource::readsOnce), nothing is written to disk.
+ */
+class TarReader {
+public:
+    enum EntryType {
+        File = 0,
+        Hardlink,
+        Symlink
+    };
+    
+    struct Entry {
+        EntryType type;
+        std::string path;   //relative path, without leading "./" or "/"
+        uint64_t size;
+        int64_t mtime;      //nanoseconds since epoch
+        std::string linkTarget; //links only: path of the member linked to, empty if it is outside of the archive
+    };
+    
+private:
+    /*
+     Member of a non-seekable input which is too large to buffer, read directly from the stream.
+     */
+    class StreamResourceSource : public ResourceSource {
+        TarReader &_tar;
+        uint64_t _size;
+        uint64_t _next;     //offset of the next byte the stream delivers
+    public:
+        StreamResourceSource(TarReader &tar, uint64_t size);
+        
+        virtual uint64_t size() override;
+        virtual size_t readAt(uint64_t offset, void *buf, size_t len) override;
+        virtual bool readsOnce() override;
+    };
+    
+    int _fd;
+    bool _seekable;
+    size_t _memoryLimit;
+    uint64_t _pos;              //offset of the next byte in the stream
+    uint64_t _dataOffset;       //stream offset of the current member's payload
+    uint64_t _dataSize;
+    bool _eof;
+    uint64_t _directories;
+    std::vector<uint8_t> _memberBuffer;
+    std::vector<uint8_t> _skipBuffer;
+    std::unique_ptr<ResourceSource> _data;
+    
+    size_t readUpTo(void *buf, size_t len);
+    void readFully(void *buf, size_t len);
+    void skip(uint64_t len);
+    void skipToNextHeader();
+    std::string readMemberString(uint64_t size);
+    
+public:
+    /*
+     Does not take ownership of fd.
+     */
+    TarReader(int fd, size_t memoryLimit = 16*1024*1024);
+    ~TarReader();
+    
+    /*
+     Advances to the next regular file or link, returns false at the end of the archive.
+     Links have no payload, symlink targets are resolved relative to the directory of the link.
+     Directories and device files are skipped.
+     */
+    bool next(Entry &entry);
+    
+    /*
+     Payload of the file last returned by next, only valid until next is called again.
+     Members of non-seekable inputs larger than memoryLimit can only be read once, front to back.
+     */
+    ResourceSource &data();
+    
+    uint64_t directories() const;
+};
+
+#endif /* TarReader_hpp */
@@ -6,6 +6,10 @@
 //
 
 #include "WebkitCacher.hpp"
+#include "IngestPipeline.hpp"
+#include "ContentHash.hpp"
+#include "TarReader.hpp"
+#include "CacheReader.hpp"
 #include <libgeneral/macros.h>
 #include <dirent.h>
 #include <errno.h>
@@ -13,8 +17,13 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <algorithm>
+#include <functional>
 
 #define RESOURCE_CACHEFILE "cache.cache"
+#define RESOURCE_CHUNK_SIZE (1024*1024)
+//resources in the newest caches of an attached shard, the only ones mergeDatabase takes over
+#define SHARD_RESOURCES "SELECT e.resource FROM WebkitCacherShard.CacheEntries e JOIN WebkitCacherShard.CacheGroups g ON g.newestCache = e.cache"
 
 #define sql_exec(sql) \
     { \
@@ -22,7 +31,10 @@
         cleanup([&]{ \
             safeFreeCustom(errmsg, sqlite3_free); \
         }); \
-        retassure(!(sqlite_err = sqlite3_exec(_db, sql, NULL, NULL, &errmsg)), "sql_exec failed on '%s' with error %d (%s)",sql,sqlite_err,errmsg); \
+        beginRowCount(); \
+        sqlite_err = sqlite3_exec(_db, sql, NULL, NULL, &errmsg); \
+        endRowCount(!sqlite_err); \
+        retassure(!sqlite_err, "sql_exec failed on '%s' with error %d (%s)",sql,sqlite_err,errmsg); \
     }
 
 #pragma mark static helpers
@@ -42,6 +54,19 @@ static std::string hostForUrl(std::string url){
     return host;
 }
 
+static std::string resourceURL(std::string url, std::string resource){
+    if (url.back() != '/') url += '/';
+    if (resource.front() == '/') resource = resource.substr(1);
+    return url + resource;
+}
+
+static std::string fileExtensionForUrl(const std::string &url){
+    size_t dot = url.rfind('.');
+    size_t slash = url.rfind('/');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) return "";
+    return url.substr(dot);
+}
+
 static std::string originForUrl(std::string url){
     std::string origin = url;
     ssize_t protocolDelimiter = 0;
@@ -94,14 +119,33 @@ int webkitHashString(std::string s){
 
 #pragma mark WebkitCacher
 
-WebkitCacher::WebkitCacher(std::string applicationCachePath)
+WebkitCacher::WebkitCacher(std::string applicationCachePath, StagingMode staging, const StorageProfile &profile)
 : _applicationCachePath(applicationCachePath),
-    _db(NULL)
+    _db(NULL), _staging(staging), _profile(profile),
+    _inTransaction(false), _commitInterval(0), _filesSinceCommit(0),
+    _pendingRows{}, _pendingChangesBase(0),
+    _nextFreeResourceID(1), _nextFreeCacheGroupID(1), _nextFreeResourceDataID(1),
+    _jobs(1),
+    _deduplicate(false), _deduplicatedBytes(0),
+    _incremental(false), _unchangedFiles(0), _removedResources(0),
+    _flatFiles(applicationCachePath), _flatFileThreshold(0),
+    _deterministic(false),
+    _followSymlinks(false),
+    _sweepFlatFiles(false), _purgedFlatFiles(0),
+    _resume(false),
+    _skipErrors(false), _fileUndo{}
 {
     int sqlite_err = 0;
 
     //open or create DB
-    assure(!(sqlite_err = sqlite3_open(_applicationCachePath.c_str(), &_db)));
+    if (_staging == StagingMode::Direct) {
+        assure(!(sqlite_err = sqlite3_open(_applicationCachePath.c_str(), &_db)));
+    }else{
+        assure(!(sqlite_err = sqlite3_open(_staging == StagingMode::Memory ? ":memory:" : "", &_db)));
+        loadStagedDatabase();
+    }
+    sqlite3_update_hook(_db, rowChanged, this);
+    applyStorageProfile();
 
     //create database structure
     
@@ -122,401 +166,2108 @@ WebkitCacher::WebkitCacher(std::string applicationCachePath)
     sql_exec("CREATE TRIGGER IF NOT EXISTS CacheEntryDeleted AFTER DELETE ON CacheEntries FOR EACH ROW BEGIN DELETE FROM CacheResources WHERE id = OLD.resource; END");
     sql_exec("CREATE TRIGGER IF NOT EXISTS CacheResourceDataDeleted AFTER DELETE ON CacheResourceData FOR EACH ROW WHEN OLD.path NOT NULL BEGIN INSERT INTO DeletedCacheResources (path) values (OLD.path); END");
     sql_exec("CREATE TRIGGER IF NOT EXISTS CacheResourceDeleted AFTER DELETE ON CacheResources FOR EACH ROW BEGIN DELETE FROM CacheResourceData WHERE id = OLD.data; END");
+    
+    if (_profile.indexes) {
+        createReadIndexes();
+    }
+    
+    loadIndex();
 }
 
 WebkitCacher::~WebkitCacher(){
+    if (_inTransaction && !sqlite3_get_autocommit(_db)) {
+        sqlite3_exec(_db, "ROLLBACK;", NULL, NULL, NULL);
+    }
+    for (auto &s : _statementCache) {
+        safeFreeCustom(s.second, sqlite3_finalize);
+    }
+    for (auto &s : _runtimeStatementCache) {
+        safeFreeCustom(s.second, sqlite3_finalize);
+    }
     safeFreeCustom(_db, sqlite3_close);
 }
 
 #pragma mark private
 
-void WebkitCacher::setCacheAllowsAllNetworkRequests0(int cacheID){
-    sqlite3_stmt *stmt = NULL;
+void WebkitCacher::loadStagedDatabase(){
+    sqlite3 *src = NULL;
+    sqlite3_backup *backup = NULL;
     cleanup([&]{
-        safeFreeCustom(stmt, sqlite3_finalize);
+        safeFreeCustom(backup, sqlite3_backup_finish);
+        safeFreeCustom(src, sqlite3_close);
     });
     int sqlite_err = 0;
-    int wildcard = -1; //needs to be non 0 so we can detect 0 case from SQL query later
     
-    retassure(!(sqlite_err = sqlite3_prepare_v2(_db,"SELECT * FROM CacheAllowsAllNetworkRequests WHERE cache = ?;",-1,&stmt,NULL)), "Failed to prepare SQL statement with error=%d",sqlite_err);
-    retassure(!(sqlite_err = sqlite3_bind_int(stmt, 1, cacheID)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
-    if (sqlite3_step(stmt) == SQLITE_ROW){
-        wildcard = sqlite3_column_int(stmt, 0);
-    }
-    safeFreeCustom(stmt, sqlite3_finalize);
+    if (access(_applicationCachePath.c_str(), F_OK)) return; //nothing to load, start with an empty cache
     
-    if (wildcard) { // make sure wildcard entry 0 exists
-        retassure(!(sqlite_err = sqlite3_prepare_v2(_db,"INSERT OR REPLACE INTO CacheAllowsAllNetworkRequests(wildcard, cache)"
-                                                        "VALUES(0, ?);",-1,&stmt,NULL)), "Failed to prepare SQL statement with error=%d",sqlite_err);
-        retassure(!(sqlite_err = sqlite3_bind_int(stmt, 1, cacheID)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
-        retassure((sqlite_err = sqlite3_step(stmt)) == SQLITE_DONE, "Failed to execute satement");
-        safeFreeCustom(stmt, sqlite3_finalize);
-    }
+    retassure(!(sqlite_err = sqlite3_open_v2(_applicationCachePath.c_str(), &src, SQLITE_OPEN_READONLY, NULL)), "Failed to open '%s' with error=%d",_applicationCachePath.c_str(),sqlite_err);
+    retassure(backup = sqlite3_backup_init(_db, "main", src, "main"), "Failed to init backup with error=%d (%s)",sqlite3_errcode(_db),sqlite3_errmsg(_db));
+    retassure((sqlite_err = sqlite3_backup_step(backup, -1)) == SQLITE_DONE, "Failed to load '%s' into staging database with error=%d",_applicationCachePath.c_str(),sqlite_err);
 }
 
-void WebkitCacher::addOrigin(std::string url){
+bool WebkitCacher::hasTable(const char *name){
     sqlite3_stmt *stmt = NULL;
     cleanup([&]{
-        safeFreeCustom(stmt, sqlite3_finalize);
+        safeFreeCustom(stmt, sqlite3_reset);
     });
     int sqlite_err = 0;
-    std::string origin;
     
-    origin = originForUrl(url);
-
-    retassure(!(sqlite_err = sqlite3_prepare_v2(_db,
-                                                "INSERT INTO Origins (origin, quota) "
-                                                "SELECT ?,0 "
-                                                "WHERE NOT EXISTS (SELECT * FROM 'Origins' WHERE origin = ?);"
-                                                ,-1,&stmt,NULL)), "Failed to prepare SQL statement with error=%d",sqlite_err);
-    retassure(!(sqlite_err = sqlite3_bind_text(stmt, 1, origin.c_str(),(int)origin.size(),SQLITE_TRANSIENT)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
-    retassure(!(sqlite_err = sqlite3_bind_text(stmt, 2, origin.c_str(),(int)origin.size(),SQLITE_TRANSIENT)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
-    retassure((sqlite_err = sqlite3_step(stmt)) == SQLITE_DONE, "Failed to execute satement");
-    safeFreeCustom(stmt, sqlite3_finalize);
-
-    retassure(!(sqlite_err = sqlite3_prepare_v2(_db,
-                                                "UPDATE Origins "
-                                                "SET origin = ?, quota = 0 "
-                                                "WHERE origin = ?;"
-                                                ,-1,&stmt,NULL)), "Failed to prepare SQL statement with error=%d",sqlite_err);
-    retassure(!(sqlite_err = sqlite3_bind_text(stmt, 1, origin.c_str(),(int)origin.size(),SQLITE_TRANSIENT)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
-    retassure(!(sqlite_err = sqlite3_bind_text(stmt, 2, origin.c_str(),(int)origin.size(),SQLITE_TRANSIENT)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
-    retassure((sqlite_err = sqlite3_step(stmt)) == SQLITE_DONE, "Failed to execute satement");
-    safeFreeCustom(stmt, sqlite3_finalize);
+    stmt = cachedStatement("SELECT name FROM sqlite_master WHERE type = 'table' AND name = ?;");
+    retassure(!(sqlite_err = sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+    return step(stmt) == SQLITE_ROW;
 }
 
+uint64_t WebkitCacher::rowCount(const char *table){
+    return strtoull(pragmaValue(std::string("SELECT COUNT(*) FROM ") + table + ";").c_str(), NULL, 10);
+}
 
-int WebkitCacher::cacheIDForUrl(std::string url){
-    sqlite3_stmt *stmt = NULL;
+std::string WebkitCacher::pragmaValue(sqlite3_stmt *stmt){
     cleanup([&]{
-        safeFreeCustom(stmt, sqlite3_finalize);
+        safeFreeCustom(stmt, sqlite3_reset);
     });
-    std::string host;
-    unsigned int manifestHostHash = 0;
-    int sqlite_err = 0;
-    int latestId = 0;
+    std::string ret;
     
-    if (url.back() != '/') url += '/';
+    if (step(stmt) == SQLITE_ROW) {
+        const char *value = (const char *)sqlite3_column_text(stmt, 0);
+        if (value) ret = value;
+    }
+    return ret;
+}
 
-    host = hostForUrl(url);
-    manifestHostHash = webkitHashString(host);
+void WebkitCacher::applyStorageProfile(){
+    int sqlite_err = 0;
+    std::string sql;
     
-    retassure(!(sqlite_err = sqlite3_prepare_v2(_db,"SELECT * FROM 'CacheGroups' WHERE manifestHostHash = ?;",-1,&stmt,NULL)), "Failed to prepare SQL statement with error=%d",sqlite_err);
-    retassure(!(sqlite_err = sqlite3_bind_int(stmt, 1, manifestHostHash)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
-    if (sqlite3_step(stmt) == SQLITE_ROW){
-        return sqlite3_column_int(stmt, 0);
+    if (_profile.pageSize) {
+        //takes effect immediately on an empty database, an existing file database needs to be rebuilt
+        sql = "PRAGMA page_size = " + std::to_string(_profile.pageSize) + ";";
+        sql_exec(sql.c_str());
+        if (_staging == StagingMode::Direct && strtoul(pragmaValue("PRAGMA page_size;").c_str(), NULL, 10) != _profile.pageSize) {
+            if (pragmaValue("PRAGMA journal_mode;") == "wal") {
+                sql_exec("PRAGMA journal_mode = DELETE;");
+            }
+            sql_exec("VACUUM;");
+        }
+    }
+    if (_profile.journalMode.size()) {
+        sql = "PRAGMA journal_mode = " + _profile.journalMode + ";";
+        sql_exec(sql.c_str());
+    }
+    if (_profile.synchronous.size()) {
+        sql = "PRAGMA synchronous = " + _profile.synchronous + ";";
+        sql_exec(sql.c_str());
+    }
+    if (_profile.cacheSize) {
+        sql = "PRAGMA cache_size = " + std::to_string(_profile.cacheSize) + ";";
+        sql_exec(sql.c_str());
+    }
+    if (_profile.tempStore.size()) {
+        sql = "PRAGMA temp_store = " + _profile.tempStore + ";";
+        sql_exec(sql.c_str());
     }
-    safeFreeCustom(stmt, sqlite3_finalize);
+}
+
+void WebkitCacher::createReadIndexes(){
+    int sqlite_err = 0;
     
-    //When we got here, that means this host doesn't exist yet
+    //WebKit loads a cache with a join over all entries of it, covered by (cache, resource, type)
+    sql_exec("CREATE INDEX IF NOT EXISTS WebkitCacherEntriesByCache ON CacheEntries (cache, resource, type)");
+    //entries are deleted by resource, by us and by the CacheEntryDeleted trigger chain
+    sql_exec("CREATE INDEX IF NOT EXISTS WebkitCacherEntriesByResource ON CacheEntries (resource)");
+    sql_exec("CREATE INDEX IF NOT EXISTS WebkitCacherResourcesByUrl ON CacheResources (url)");
+    sql_exec("CREATE INDEX IF NOT EXISTS WebkitCacherGroupsByHostHash ON CacheGroups (manifestHostHash)");
+    //quota usage per origin
+    sql_exec("CREATE INDEX IF NOT EXISTS WebkitCacherGroupsByOrigin ON CacheGroups (origin)");
+    sql_exec("CREATE INDEX IF NOT EXISTS WebkitCacherCachesByGroup ON Caches (cacheGroup)");
+    //flat file cleanup compares DeletedCacheResources against the paths still in use
+    sql_exec("CREATE INDEX IF NOT EXISTS WebkitCacherDataByPath ON CacheResourceData (path) WHERE path NOT NULL");
+}
+
+void WebkitCacher::loadIndex(){
+    BuildStats::Scope statsScope(_stats, BuildStats::Index);
+    sqlite3_stmt *stmt = NULL;
+    cleanup([&]{
+        safeFreeCustom(stmt, sqlite3_reset);
+    });
     
-    //get latest ID
-    retassure(!(sqlite_err = sqlite3_prepare_v2(_db,"SELECT * FROM 'CacheGroups' ORDER BY id DESC LIMIT 0, 1;",-1,&stmt,NULL)), "Failed to prepare SQL statement with error=%d",sqlite_err);
-    if (sqlite3_step(stmt) == SQLITE_ROW){
-        latestId = sqlite3_column_int(stmt, 0);
+    _resourceIDForUrl.clear();
+    _cacheIDForHostHash.clear();
+    _cachesSize.clear();
+    _resourceIDs.clear();
+    _resourceDataIDs.clear();
+    _cacheEntryResources.clear();
+    _dataIDForResource.clear();
+    _dataRefCount.clear();
+    _resourceSize.clear();
+    _fingerprints.clear();
+    _flatFileForDataID.clear();
+    _dataIDsForHash.clear();
+    _hashForDataID.clear();
+    _cacheIDForOrigin.clear();
+    _nextFreeResourceID = 1;
+    _nextFreeCacheGroupID = 1;
+    _nextFreeResourceDataID = 1;
+
+    stmt = cachedStatement("SELECT id, url, data, headers FROM CacheResources ORDER BY id ASC;");
+    while (step(stmt) == SQLITE_ROW) {
+        int resourceID = sqlite3_column_int(stmt, 0);
+        const char *url = (const char *)sqlite3_column_text(stmt, 1);
+        int dataID = sqlite3_column_int(stmt, 2);
+        const char *headers = (const char *)sqlite3_column_text(stmt, 3);
+        const char *contentLength = NULL;
+        _resourceIDs.insert(resourceID);
+        if (url) _resourceIDForUrl.insert({url,resourceID}); //first resource with this URL wins
+        _dataIDForResource[resourceID] = dataID;
+        _dataRefCount[dataID]++;
+        if (headers && (contentLength = strstr(headers, "Content-Length:"))) {
+            //this is the size which was added to Caches.size for this resource
+            _resourceSize[resourceID] = strtoull(contentLength+sizeof("Content-Length:")-1, NULL, 10);
+        }
+        _nextFreeResourceID = resourceID+1;
     }
-    safeFreeCustom(stmt, sqlite3_finalize);
+    safeFreeCustom(stmt, sqlite3_reset);
 
-    //now latestId points to the highest used ID
-    latestId++; //increment to use next free ID
-    std::string origin = originForUrl(url);
-    
-    retassure(!(sqlite_err = sqlite3_prepare_v2(_db,"INSERT INTO CacheGroups(id, manifestHostHash, manifestURL, newestCache, origin)"
-                                                    "VALUES(?,?,?,?,?);",-1,&stmt,NULL)), "Failed to prepare SQL statement with error=%d",sqlite_err);
-    retassure(!(sqlite_err = sqlite3_bind_int(stmt, 1, latestId)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
-    retassure(!(sqlite_err = sqlite3_bind_int(stmt, 2, manifestHostHash)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
-    {
-        std::string arg = url+RESOURCE_CACHEFILE;
-        retassure(!(sqlite_err = sqlite3_bind_text(stmt, 3, arg.c_str(),(int)arg.size(),SQLITE_TRANSIENT)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+    stmt = cachedStatement("SELECT id, path FROM CacheResourceData ORDER BY id ASC;");
+    while (step(stmt) == SQLITE_ROW) {
+        int dataID = sqlite3_column_int(stmt, 0);
+        const char *path = (const char *)sqlite3_column_text(stmt, 1);
+        _resourceDataIDs.insert(dataID);
+        if (path && *path) _flatFileForDataID[dataID] = path;
+        _nextFreeResourceDataID = dataID+1;
     }
-    retassure(!(sqlite_err = sqlite3_bind_int(stmt, 4, latestId)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
-    retassure(!(sqlite_err = sqlite3_bind_text(stmt, 5, origin.c_str(),(int)origin.size(),SQLITE_TRANSIENT)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
-    retassure((sqlite_err = sqlite3_step(stmt)) == SQLITE_DONE, "Failed to execute satement");
-    safeFreeCustom(stmt, sqlite3_finalize);
+    safeFreeCustom(stmt, sqlite3_reset);
 
-    return latestId;
+    stmt = cachedStatement("SELECT resource FROM CacheEntries;");
+    while (step(stmt) == SQLITE_ROW) {
+        _cacheEntryResources.insert(sqlite3_column_int(stmt, 0));
+    }
+    safeFreeCustom(stmt, sqlite3_reset);
+
+    stmt = cachedStatement("SELECT id, manifestHostHash FROM CacheGroups ORDER BY id ASC;");
+    while (step(stmt) == SQLITE_ROW) {
+        int cacheID = sqlite3_column_int(stmt, 0);
+        _cacheIDForHostHash.insert({(unsigned int)sqlite3_column_int(stmt, 1),cacheID});
+        _nextFreeCacheGroupID = cacheID+1;
+    }
+    safeFreeCustom(stmt, sqlite3_reset);
+
+    stmt = cachedStatement("SELECT cacheGroup, size FROM Caches ORDER BY id ASC;");
+    while (step(stmt) == SQLITE_ROW) {
+        _cachesSize.insert({sqlite3_column_int(stmt, 0),(uint64_t)sqlite3_column_int64(stmt, 1)});
+    }
+    safeFreeCustom(stmt, sqlite3_reset);
+    
+    loadFingerprints();
 }
 
-int WebkitCacher::resourceIDForUrl(std::string url){
+void WebkitCacher::loadFingerprints(){
     sqlite3_stmt *stmt = NULL;
     cleanup([&]{
-        safeFreeCustom(stmt, sqlite3_finalize);
+        safeFreeCustom(stmt, sqlite3_reset);
     });
-    int sqlite_err = 0;
-    int resourceID = 0; //real resourceIDs can't be zero
+
+    if (!hasTable("WebkitCacherFingerprints")) return;
+    
+    _fingerprints.clear();
+    stmt = cachedStatement("SELECT resource, size, mtime, hash FROM WebkitCacherFingerprints;");
+    while (step(stmt) == SQLITE_ROW) {
+        int resourceID = sqlite3_column_int(stmt, 0);
+        Fingerprint fp = {};
+        fp.size = (uint64_t)sqlite3_column_int64(stmt, 1);
+        fp.mtime = sqlite3_column_int64(stmt, 2);
+        fp.hash = (uint64_t)sqlite3_column_int64(stmt, 3);
+        _fingerprints[resourceID] = fp;
         
-    //check if resource is already there
-    retassure(!(sqlite_err = sqlite3_prepare_v2(_db,"SELECT * FROM 'CacheResources' WHERE url = ?;",-1,&stmt,NULL)), "Failed to prepare SQL statement with error=%d",sqlite_err);
-    retassure(!(sqlite_err = sqlite3_bind_text(stmt, 1, url.c_str(),(int)url.size(),SQLITE_TRANSIENT)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
-    retassure(sqlite3_step(stmt) == SQLITE_ROW, "No resourceID found for URL '%s'",url.c_str());
-    resourceID = sqlite3_column_int(stmt, 0);
-    safeFreeCustom(stmt, sqlite3_finalize);
-    return resourceID;
+        //known hashes also allow deduplication against data from earlier runs
+        auto d = _dataIDForResource.find(resourceID);
+        if (d != _dataIDForResource.end() && _hashForDataID.find(d->second) == _hashForDataID.end()) {
+            registerDataHash(d->second, fp.hash);
+        }
+    }
+    safeFreeCustom(stmt, sqlite3_reset);
 }
 
-int WebkitCacher::getNextFreeCacheResourcesID(){
+void WebkitCacher::setFingerprint(int resourceID, const Fingerprint &fp){
     sqlite3_stmt *stmt = NULL;
     cleanup([&]{
-        safeFreeCustom(stmt, sqlite3_finalize);
+        safeFreeCustom(stmt, sqlite3_reset);
     });
     int sqlite_err = 0;
-    int resourceID = 0; //real resourceIDs can't be zero
 
-    //get highest used ID and increment to get next free resourceID
-    retassure(!(sqlite_err = sqlite3_prepare_v2(_db,"SELECT * FROM 'CacheResources' ORDER BY id DESC LIMIT 0, 1;",-1,&stmt,NULL)), "Failed to prepare SQL statement with error=%d",sqlite_err);
-    if (sqlite3_step(stmt) == SQLITE_ROW){
-        resourceID = sqlite3_column_int(stmt, 0);
-    }
-    safeFreeCustom(stmt, sqlite3_finalize);
-    resourceID++; //now points to free usable resourceID
-    return resourceID;;
+    stmt = cachedStatement("INSERT OR REPLACE INTO WebkitCacherFingerprints (resource, size, mtime, hash) "
+                           "VALUES(?,?,?,?);");
+    retassure(!(sqlite_err = sqlite3_bind_int(stmt, 1, resourceID)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+    retassure(!(sqlite_err = sqlite3_bind_int64(stmt, 2, (sqlite3_int64)fp.size)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+    retassure(!(sqlite_err = sqlite3_bind_int64(stmt, 3, (sqlite3_int64)fp.mtime)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+    retassure(!(sqlite_err = sqlite3_bind_int64(stmt, 4, (sqlite3_int64)fp.hash)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+    retassure((sqlite_err = step(stmt)) == SQLITE_DONE, "Failed to execute satement");
+    safeFreeCustom(stmt, sqlite3_reset);
+    
+    _fingerprints[resourceID] = fp;
 }
 
-
-void WebkitCacher::createCacheResource(int resourceID, std::string resourceURL, std::string mimeType, uint64_t dataSize, int dataresourceID){
+void WebkitCacher::clearFingerprint(int resourceID){
     sqlite3_stmt *stmt = NULL;
     cleanup([&]{
-        safeFreeCustom(stmt, sqlite3_finalize);
+        safeFreeCustom(stmt, sqlite3_reset);
     });
     int sqlite_err = 0;
     
-    if (!dataresourceID) dataresourceID = resourceID;
-    
-    std::string headers;
-//    headers += "Last-Modified:Fri, 25 Dec 2020 10:51:00 GMT";
-//    headers += "Date:Sat, 26 Dec 2020 14:46:24 GMT";
-    headers += "Accept-Ranges:bytes\n";
-    headers += "Content-Type:"+mimeType+"\n";
-    headers += "Content-Length:"+std::to_string(dataSize)+"\n";
-    
-    //make sure at least a dummy entry exists
-    retassure(!(sqlite_err = sqlite3_prepare_v2(_db,
-                                                "INSERT INTO CacheResources (id, url, statusCode, responseURL, mimeType, textEncodingName, headers, data) "
-                                                "SELECT ?,\"\",200,\"\",\"\",\"\",\"\",? "
-                                                "WHERE NOT EXISTS (SELECT * FROM 'CacheResources' WHERE id = ?);"
-                                                ,-1,&stmt,NULL)), "Failed to prepare SQL statement with error=%d",sqlite_err);
+    if (_fingerprints.find(resourceID) == _fingerprints.end()) return;
+    stmt = cachedStatement("DELETE FROM WebkitCacherFingerprints WHERE resource = ?;");
     retassure(!(sqlite_err = sqlite3_bind_int(stmt, 1, resourceID)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
-    retassure(!(sqlite_err = sqlite3_bind_int(stmt, 2, dataresourceID)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
-    retassure(!(sqlite_err = sqlite3_bind_int(stmt, 3, resourceID)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
-    retassure((sqlite_err = sqlite3_step(stmt)) == SQLITE_DONE, "Failed to execute satement");
-    safeFreeCustom(stmt, sqlite3_finalize);
-    
-    retassure(!(sqlite_err = sqlite3_prepare_v2(_db,
-                                                "UPDATE CacheResources "
-                                                "SET url = ?, statusCode = 200, responseURL = ?, mimeType = ?, headers = ?, data = ? "
-                                                "WHERE id = ?;"
-                                                ,-1,&stmt,NULL)), "Failed to prepare SQL statement with error=%d",sqlite_err);
-    retassure(!(sqlite_err = sqlite3_bind_text(stmt, 1, resourceURL.c_str(),(int)resourceURL.size(),SQLITE_TRANSIENT)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
-    retassure(!(sqlite_err = sqlite3_bind_text(stmt, 2, resourceURL.c_str(),(int)resourceURL.size(),SQLITE_TRANSIENT)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
-    retassure(!(sqlite_err = sqlite3_bind_text(stmt, 3, mimeType.c_str(),(int)mimeType.size(),SQLITE_TRANSIENT)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
-    retassure(!(sqlite_err = sqlite3_bind_text(stmt, 4, headers.c_str(),(int)headers.size(),SQLITE_TRANSIENT)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
-    retassure(!(sqlite_err = sqlite3_bind_int(stmt, 5, dataresourceID)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
-    retassure(!(sqlite_err = sqlite3_bind_int(stmt, 6, resourceID)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
-    retassure((sqlite_err = sqlite3_step(stmt)) == SQLITE_DONE, "Failed to execute satement");
-    safeFreeCustom(stmt, sqlite3_finalize);
+    retassure((sqlite_err = step(stmt)) == SQLITE_DONE, "Failed to execute satement");
+    safeFreeCustom(stmt, sqlite3_reset);
+    _fingerprints.erase(resourceID);
+}
+
+bool WebkitCacher::fileUnchanged(const std::string &resourceUrl, uint64_t size, int64_t mtime){
+    auto r = _resourceIDForUrl.find(resourceUrl);
+    if (r == _resourceIDForUrl.end()) return false;
+    auto fp = _fingerprints.find(r->second);
+    if (fp == _fingerprints.end()) return false;
+    if (fp->second.size != size || fp->second.mtime != mtime) return false;
+    _seenResources.insert(r->second);
+    _unchangedFiles++;
+    return true;
 }
 
-void WebkitCacher::createCacheResourceData(int resourceID, std::string data){
+void WebkitCacher::removeResource(int resourceID, std::string url){
     sqlite3_stmt *stmt = NULL;
     cleanup([&]{
-        safeFreeCustom(stmt, sqlite3_finalize);
+        safeFreeCustom(stmt, sqlite3_reset);
     });
     int sqlite_err = 0;
+    int dataID = 0;
+    bool sharedData = false;
     
-    //make sure at least a dummy entry exists
-    retassure(!(sqlite_err = sqlite3_prepare_v2(_db,
-                                                "INSERT INTO CacheResourceData (id, data, path) "
-                                                "SELECT ?,\"\",NULL "
-                                                "WHERE NOT EXISTS (SELECT * FROM 'CacheResourceData' WHERE id = ?);"
-                                                ,-1,&stmt,NULL)), "Failed to prepare SQL statement with error=%d",sqlite_err);
+    {
+        auto d = _dataIDForResource.find(resourceID);
+        if (d != _dataIDForResource.end()) {
+            dataID = d->second;
+            sharedData = _dataRefCount[dataID] > 1;
+        }
+    }
+    
+    if (sharedData) {
+        //detach shared data, otherwise the CacheResourceDeleted trigger would delete it
+        stmt = cachedStatement("UPDATE CacheResources SET data = 0 WHERE id = ?;");
+        retassure(!(sqlite_err = sqlite3_bind_int(stmt, 1, resourceID)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+        retassure((sqlite_err = step(stmt)) == SQLITE_DONE, "Failed to execute satement");
+        safeFreeCustom(stmt, sqlite3_reset);
+    }
+    
+    //triggers take care of CacheResources and CacheResourceData
+    stmt = cachedStatement("DELETE FROM CacheEntries WHERE resource = ?;");
     retassure(!(sqlite_err = sqlite3_bind_int(stmt, 1, resourceID)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
-    retassure(!(sqlite_err = sqlite3_bind_int(stmt, 2, resourceID)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
-    retassure((sqlite_err = sqlite3_step(stmt)) == SQLITE_DONE, "Failed to execute satement");
-    safeFreeCustom(stmt, sqlite3_finalize);
-
-    retassure(!(sqlite_err = sqlite3_prepare_v2(_db,
-                                                "UPDATE CacheResourceData "
-                                                "SET data = ? "
-                                                "WHERE id = ?;"
-                                                ,-1,&stmt,NULL)), "Failed to prepare SQL statement with error=%d",sqlite_err);
-    retassure(!(sqlite_err = sqlite3_bind_blob(stmt, 1, data.data(), (int)data.size(), SQLITE_TRANSIENT)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
-    retassure(!(sqlite_err = sqlite3_bind_int(stmt, 2, resourceID)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
-    retassure((sqlite_err = sqlite3_step(stmt)) == SQLITE_DONE, "Failed to execute satement");
-    safeFreeCustom(stmt, sqlite3_finalize);
-}
-
-void WebkitCacher::addCachesSize(int chaceID, size_t size){
-    sqlite3_stmt *stmt = NULL;
-    cleanup([&]{
-        safeFreeCustom(stmt, sqlite3_finalize);
-    });
-    int sqlite_err = 0;
-    size_t currentCacheSize = 0;
+    retassure((sqlite_err = step(stmt)) == SQLITE_DONE, "Failed to execute satement");
+    safeFreeCustom(stmt, sqlite3_reset);
+
+    stmt = cachedStatement("DELETE FROM CacheResources WHERE id = ?;");
+    retassure(!(sqlite_err = sqlite3_bind_int(stmt, 1, resourceID)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+    retassure((sqlite_err = step(stmt)) == SQLITE_DONE, "Failed to execute satement");
+    safeFreeCustom(stmt, sqlite3_reset);
+
+    clearFingerprint(resourceID);
     
-    //make sure at least a dummy entry exists
-    retassure(!(sqlite_err = sqlite3_prepare_v2(_db,
-                                                "INSERT INTO Caches (id, cacheGroup, size) "
-                                                "SELECT ?,?,0 "
-                                                "WHERE NOT EXISTS (SELECT * FROM 'Caches' WHERE cacheGroup = ?);"
-                                                ,-1,&stmt,NULL)), "Failed to prepare SQL statement with error=%d",sqlite_err);
-    retassure(!(sqlite_err = sqlite3_bind_int(stmt, 1, chaceID)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
-    retassure(!(sqlite_err = sqlite3_bind_int(stmt, 2, chaceID)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
-    retassure(!(sqlite_err = sqlite3_bind_int(stmt, 3, chaceID)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
-    retassure((sqlite_err = sqlite3_step(stmt)) == SQLITE_DONE, "Failed to execute satement");
-    safeFreeCustom(stmt, sqlite3_finalize);
-    
-    //get current size
-    retassure(!(sqlite_err = sqlite3_prepare_v2(_db,"SELECT * FROM 'Caches' WHERE cacheGroup = ?;",-1,&stmt,NULL)), "Failed to prepare SQL statement with error=%d",sqlite_err);
-    retassure(!(sqlite_err = sqlite3_bind_int(stmt, 1, chaceID)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
-    retassure(sqlite3_step(stmt) == SQLITE_ROW, "Caches entry does not exist, but should have been created");
-    currentCacheSize = sqlite3_column_int(stmt, 2);
-    safeFreeCustom(stmt, sqlite3_finalize);
-
-    currentCacheSize += size;
-    
-    retassure(!(sqlite_err = sqlite3_prepare_v2(_db,
-                                                "UPDATE Caches "
-                                                "SET size = ? "
-                                                "WHERE id = ?;"
-                                                ,-1,&stmt,NULL)), "Failed to prepare SQL statement with error=%d",sqlite_err);
-    retassure(!(sqlite_err = sqlite3_bind_int(stmt, 1, (int)currentCacheSize)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
-    retassure(!(sqlite_err = sqlite3_bind_int(stmt, 2, chaceID)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
-    retassure((sqlite_err = sqlite3_step(stmt)) == SQLITE_DONE, "Failed to execute satement");
-    safeFreeCustom(stmt, sqlite3_finalize);
+    {
+        auto size = _resourceSize.find(resourceID);
+        if (size != _resourceSize.end()) {
+            addCachesSize(cacheIDForUrl(url), -(int64_t)size->second);
+            _resourceSize.erase(size);
+        }
+    }
+    
+    {
+        auto r = _resourceIDForUrl.find(url);
+        if (r != _resourceIDForUrl.end() && r->second == resourceID) _resourceIDForUrl.erase(r);
+    }
+    _resourceIDs.erase(resourceID);
+    _cacheEntryResources.erase(resourceID);
+    _dataIDForResource.erase(resourceID);
+    if (sharedData) {
+        _dataRefCount[dataID]--;
+    }else if (dataID){
+        _dataRefCount.erase(dataID);
+        _resourceDataIDs.erase(dataID);
+        _flatFileForDataID.erase(dataID);
+        unregisterDataHash(dataID);
+    }
+    _removedResources++;
 }
 
-
-void WebkitCacher::createCacheEntry(int cacheID, ResourceType resourceType, int resourceID){
+void WebkitCacher::purgeDeletedFlatFiles(){
     sqlite3_stmt *stmt = NULL;
     cleanup([&]{
-        safeFreeCustom(stmt, sqlite3_finalize);
+        safeFreeCustom(stmt, sqlite3_reset);
     });
     int sqlite_err = 0;
+    bool hadDeleted = false;
     
-    retassure(!(sqlite_err = sqlite3_prepare_v2(_db,
-                                                "INSERT INTO CacheEntries (cache, type, resource) "
-                                                "SELECT ?,?,? "
-                                                "WHERE NOT EXISTS (SELECT * FROM 'CacheEntries' WHERE resource = ?);"
-                                                ,-1,&stmt,NULL)), "Failed to prepare SQL statement with error=%d",sqlite_err);
-    retassure(!(sqlite_err = sqlite3_bind_int(stmt, 1, cacheID)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
-    retassure(!(sqlite_err = sqlite3_bind_int(stmt, 2, resourceType)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
-    retassure(!(sqlite_err = sqlite3_bind_int(stmt, 3, resourceID)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
-    retassure(!(sqlite_err = sqlite3_bind_int(stmt, 4, resourceID)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
-    retassure((sqlite_err = sqlite3_step(stmt)) == SQLITE_DONE, "Failed to execute satement");
-    safeFreeCustom(stmt, sqlite3_finalize);
-
-    retassure(!(sqlite_err = sqlite3_prepare_v2(_db,
-                                                "UPDATE CacheEntries "
-                                                "SET cache = ?, type = ?, resource = ? "
-                                                "WHERE resource = ?;"
-                                                ,-1,&stmt,NULL)), "Failed to prepare SQL statement with error=%d",sqlite_err);
-    retassure(!(sqlite_err = sqlite3_bind_int(stmt, 1, cacheID)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
-    retassure(!(sqlite_err = sqlite3_bind_int(stmt, 2, resourceType)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
-    retassure(!(sqlite_err = sqlite3_bind_int(stmt, 3, resourceID)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
-    retassure(!(sqlite_err = sqlite3_bind_int(stmt, 4, resourceID)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
-    retassure((sqlite_err = sqlite3_step(stmt)) == SQLITE_DONE, "Failed to execute satement");
-    safeFreeCustom(stmt, sqlite3_finalize);
+    //only delete files which are not referenced anymore, same as WebKit does on startup
+    stmt = cachedStatement("SELECT DISTINCT path, path IN (SELECT path FROM CacheResourceData WHERE path NOT NULL) FROM DeletedCacheResources;");
+    while (step(stmt) == SQLITE_ROW) {
+        const char *path = (const char *)sqlite3_column_text(stmt, 0);
+        if (path && !sqlite3_column_int(stmt, 1)) {
+            _flatFiles.remove(path);
+            _purgedFlatFiles++;
+        }
+        hadDeleted = true;
+    }
+    safeFreeCustom(stmt, sqlite3_reset);
+    
+    if (hadDeleted) {
+        //rows of files which are still referenced are recreated by the trigger once their data is deleted
+        sql_exec("DELETE FROM DeletedCacheResources;");
+    }
+    
+    if (_sweepFlatFiles) {
+        //files no row knows about, e.g. left behind by a crash or by other tools
+        std::unordered_set<std::string> referenced;
+        stmt = cachedStatement("SELECT path FROM CacheResourceData WHERE path NOT NULL;");
+        while (step(stmt) == SQLITE_ROW) {
+            const char *path = (const char *)sqlite3_column_text(stmt, 0);
+            if (path) referenced.insert(path);
+        }
+        safeFreeCustom(stmt, sqlite3_reset);
+        for (auto &name : _flatFiles.names()) {
+            if (referenced.find(name) != referenced.end()) continue;
+            _flatFiles.remove(name);
+            _purgedFlatFiles++;
+        }
+        _sweepFlatFiles = false;
+    }
 }
 
-
-void WebkitCacher::addResourceToURL(std::string url, std::string resource, std::string mimeType, std::string data){
-    int resourceID = 0; //real resourceIDs can't be zero
-    int cacheID = 0;
-    ResourceType resourceType = ResourceType::Master;
+void WebkitCacher::removeStaleResources(std::string url){
+    BuildStats::Scope statsScope(_stats, BuildStats::Remove);
+    std::vector<std::pair<int, std::string>> stale;
     
     if (url.back() != '/') url += '/';
-    if (resource.front() == '/') resource = resource.substr(1);
-    url += resource;
+
+    //only resources which were created from files can go stale, redirects and the manifest have no fingerprint
+    for (auto &r : _resourceIDForUrl) {
+        if (r.first.compare(0, url.size(), url) != 0) continue;
+        if (_fingerprints.find(r.second) == _fingerprints.end()) continue;
+        if (_seenResources.find(r.second) != _seenResources.end()) continue;
+        stale.push_back({r.second,r.first});
+    }
+    std::sort(stale.begin(), stale.end());
     
-    if (resource == RESOURCE_CACHEFILE) {
-        resourceType = ResourceType::Manifest;
+    for (auto &r : stale) {
+        removeResource(r.first, r.second);
     }
+}
+
+void WebkitCacher::removeFileResources(const std::string &resourceUrl){
+    BuildStats::Scope statsScope(_stats, BuildStats::Remove);
+    std::vector<std::pair<int, std::string>> removed;
+    std::string dirUrl = resourceUrl + "/";
     
-    try {
-        resourceID = resourceIDForUrl(url);
-    } catch (...) {
-        resourceID = getNextFreeCacheResourcesID();
+    //the resource of the file itself or everything below it if it was a directory
+    for (auto &r : _resourceIDForUrl) {
+        if (r.first != resourceUrl && r.first.compare(0, dirUrl.size(), dirUrl) != 0) continue;
+        if (_fingerprints.find(r.second) == _fingerprints.end()) continue;
+        removed.push_back({r.second,r.first});
     }
+    std::sort(removed.begin(), removed.end());
     
-    cacheID = cacheIDForUrl(url);
-    createCacheEntry(cacheID, resourceType, resourceID);
-
-    createCacheResource(resourceID, url, mimeType, data.size());
-    createCacheResourceData(resourceID, data);
-    addCachesSize(cacheID, data.size());
+    for (auto &r : removed) {
+        removeResource(r.first, r.second);
+    }
 }
 
-void WebkitCacher::addDirectoryResourcesRecursive(std::string url, std::string dir){
-    DIR *d = NULL;
+bool WebkitCacher::resumeCheckpoint(const std::string &url){
+    sqlite3_stmt *stmt = NULL;
     cleanup([&]{
-        safeFreeCustom(d, closedir);
+        safeFreeCustom(stmt, sqlite3_reset);
     });
-    struct dirent *dfile = NULL;
+    int sqlite_err = 0;
+    bool done = false;
     
-    if (url.back() != '/') url += '/';
-    if (dir.back() != '/') dir += '/';
+    _checkpointUrl = url;
+    _checkpointPath.clear();
+    _resumeAfter.clear();
     
-    retassure(d = opendir(dir.c_str()), "Failed to open dir with err=%d (%s)",errno,strerror(errno));
+    stmt = cachedStatement("SELECT path, done FROM WebkitCacherCheckpoints WHERE url = ?;");
+    retassure(!(sqlite_err = sqlite3_bind_text(stmt, 1, url.c_str(), -1, SQLITE_STATIC)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+    if (step(stmt) == SQLITE_ROW) {
+        const char *path = (const char *)sqlite3_column_text(stmt, 0);
+        if (path) _resumeAfter = path;
+        done = sqlite3_column_int(stmt, 1);
+    }
+    safeFreeCustom(stmt, sqlite3_reset);
     
-    while ((dfile = readdir(d))) { //remove all subdirs and files
-        if (strcmp(dfile->d_name, ".") == 0 || strcmp(dfile->d_name, "..") == 0) {
-            continue;
-        }
-        std::string filepath = dir + dfile->d_name;
-        
-        if (dfile->d_type == DT_DIR) {
-            addDirectoryResourcesRecursive(url + dfile->d_name, filepath);
-        }else{
-            int fd = -1;
-            cleanup([&]{
-                if (fd > 0) {
-                    close(fd);fd=-1;
-                }
-            });
-            struct stat st = {};
-            std::string filedata;
-            
-            retassure((fd = open(filepath.c_str(), O_RDONLY)) > 0, "Failed to open file '%s'",filepath.c_str());
-            retassure(!fstat(fd, &st), "Failed to stat file '%s'",filepath.c_str());
-            
-            filedata.resize(st.st_size);
-            retassure(read(fd, (void*)filedata.data(), filedata.size()) == filedata.size(), "failed to read file");
-            addResourceToURL(url, dfile->d_name, "text/html", filedata);
+    if (done) {
+        _checkpointUrl.clear();
+    }else if (_resumeAfter.size()) {
+        _checkpointPath = _resumeAfter;
+        _sweepFlatFiles = true; //flat files of the batch which was rolled back are still there
+    }
+    return done;
+}
+
+void WebkitCacher::writeCheckpoint(bool done){
+    sqlite3_stmt *stmt = NULL;
+    cleanup([&]{
+        safeFreeCustom(stmt, sqlite3_reset);
+    });
+    int sqlite_err = 0;
+    
+    stmt = cachedStatement("INSERT OR REPLACE INTO WebkitCacherCheckpoints (url, path, done) VALUES(?,?,?);");
+    retassure(!(sqlite_err = sqlite3_bind_text(stmt, 1, _checkpointUrl.c_str(), -1, SQLITE_STATIC)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+    retassure(!(sqlite_err = sqlite3_bind_text(stmt, 2, _checkpointPath.c_str(), -1, SQLITE_STATIC)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+    retassure(!(sqlite_err = sqlite3_bind_int(stmt, 3, done)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+    retassure((sqlite_err = step(stmt)) == SQLITE_DONE, "Failed to execute satement");
+    safeFreeCustom(stmt, sqlite3_reset);
+}
+
+void WebkitCacher::skipFailedFile(const std::string &path, const std::string &resourceUrl, const char *error){
+    _failedFiles.push_back({path, error ? error : ""});
+    if (!_incremental) return;
+    
+    //keep what an earlier run cached instead of removing it as stale
+    if (resourceUrl.back() == '/') {
+        for (auto &r : _resourceIDForUrl) {
+            if (!r.first.compare(0, resourceUrl.size(), resourceUrl)) _seenResources.insert(r.second);
         }
+    }else{
+        auto r = _resourceIDForUrl.find(resourceUrl);
+        if (r != _resourceIDForUrl.end()) _seenResources.insert(r->second);
     }
 }
 
+sqlite3_stmt *WebkitCacher::reuseOrPrepare(sqlite3_stmt *&stmt, const char *sql){
+    int sqlite_err = 0;
+    
+    if (stmt) {
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+    }else{
+        BuildStats::Scope statsScope(_stats, BuildStats::Prepare);
+        retassure(!(sqlite_err = sqlite3_prepare_v2(_db,sql,-1,&stmt,NULL)), "Failed to prepare SQL statement with error=%d",sqlite_err);
+        _stats.add(BuildStats::StatementsPrepared);
+    }
+    return stmt;
+}
 
-#pragma mark public
+sqlite3_stmt *WebkitCacher::cachedStatement(const std::string &sql){
+    return reuseOrPrepare(_runtimeStatementCache[sql], sql.c_str());
+}
 
-void WebkitCacher::cacheDirectory(std::string url, std::string dir){
-    int cacheID = 0;
+int WebkitCacher::step(sqlite3_stmt *stmt){
+    bool first = !sqlite3_stmt_busy(stmt);
+    int sqlite_err = 0;
+    
+    beginRowCount();
+    sqlite_err = sqlite3_step(stmt);
+    if (sqlite_err != SQLITE_ROW && sqlite_err != SQLITE_DONE) {
+        endRowCount(false);
+        return sqlite_err;
+    }
+    endRowCount(true);
+    if (first) {
+        _stats.add(BuildStats::StatementsExecuted);
+        if (sqlite3_column_count(stmt)) _stats.add(BuildStats::Queries); //SAVEPOINT, RELEASE and writes return no columns
+    }
+    return sqlite_err;
+}
 
-    if (url.back() != '/') url += '/';
-    if (dir.back() != '/') dir += '/';
+void WebkitCacher::rowChanged(void *ctx, int op, const char *database, const char *table, sqlite3_int64 rowid){
+    WebkitCacher *cacher = (WebkitCacher *)ctx;
+    switch (op) {
+        case SQLITE_INSERT: cacher->_pendingRows[0]++; break;
+        case SQLITE_UPDATE: cacher->_pendingRows[1]++; break;
+        case SQLITE_DELETE: cacher->_pendingRows[2]++; break;
+    }
+}
 
-    cacheID = cacheIDForUrl(url);
-    setCacheAllowsAllNetworkRequests0(cacheID);
-    addOrigin(url);
+void WebkitCacher::beginRowCount(){
+    _pendingRows[0] = _pendingRows[1] = _pendingRows[2] = 0;
+    _pendingChangesBase = sqlite3_total_changes(_db);
+}
 
-    addResourceToURL(url, RESOURCE_CACHEFILE, "application/octet-stream", "CACHE MANIFEST\n# v2.5.5 Self-Host\n");
+void WebkitCacher::endRowCount(bool succeeded){
+    uint64_t changes = 0;
+    uint64_t reported = 0;
     
-    addDirectoryResourcesRecursive(url, dir);
+    if (!succeeded) return; //sqlite rolled the statement back
+    changes = (uint64_t)(sqlite3_total_changes(_db) - _pendingChangesBase);
+    reported = _pendingRows[0] + _pendingRows[1] + _pendingRows[2];
+    _stats.add(BuildStats::RowsInserted, _pendingRows[0]);
+    _stats.add(BuildStats::RowsUpdated, _pendingRows[1]);
+    //a DELETE without WHERE clears the table without calling the update hook, its rows are only in the change count
+    _stats.add(BuildStats::RowsDeleted, _pendingRows[2] + (changes > reported ? changes - reported : 0));
 }
 
-void WebkitCacher::addRedirect(std::string url, std::string targetUrl){
-    int cacheID = 0;
-    int srcResourceID = 0;
-    int dstResourceID = 0;
+void WebkitCacher::setCacheAllowsAllNetworkRequests0(int cacheID){
+    sqlite3_stmt *stmt = NULL;
+    cleanup([&]{
+        safeFreeCustom(stmt, sqlite3_reset);
+    });
+    int sqlite_err = 0;
+    int wildcard = -1; //needs to be non 0 so we can detect 0 case from SQL query later
     
-    cacheID = cacheIDForUrl(url);
-    setCacheAllowsAllNetworkRequests0(cacheID);
-    addOrigin(url);
+    stmt = cachedStatement("SELECT * FROM CacheAllowsAllNetworkRequests WHERE cache = ?;");
+    retassure(!(sqlite_err = sqlite3_bind_int(stmt, 1, cacheID)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+    if (step(stmt) == SQLITE_ROW){
+        wildcard = sqlite3_column_int(stmt, 0);
+    }
+    safeFreeCustom(stmt, sqlite3_reset);
+    
+    if (wildcard) { // make sure wildcard entry 0 exists
+        stmt = cachedStatement("INSERT OR REPLACE INTO CacheAllowsAllNetworkRequests(wildcard, cache)"
+                               "VALUES(0, ?);");
+        retassure(!(sqlite_err = sqlite3_bind_int(stmt, 1, cacheID)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+        retassure((sqlite_err = step(stmt)) == SQLITE_DONE, "Failed to execute satement");
+        safeFreeCustom(stmt, sqlite3_reset);
+    }
+}
 
-    dstResourceID = resourceIDForUrl(targetUrl);
-    srcResourceID = getNextFreeCacheResourcesID();
+void WebkitCacher::addOrigin(std::string url){
+    sqlite3_stmt *stmt = NULL;
+    cleanup([&]{
+        safeFreeCustom(stmt, sqlite3_reset);
+    });
+    int sqlite_err = 0;
+    std::string origin;
     
-    std::string redirect = "you should not see this";
-    createCacheEntry(cacheID, ResourceType::Master, srcResourceID);
-    createCacheResource(srcResourceID, url, "text/html", 0, dstResourceID);
+    origin = originForUrl(url);
+
+    stmt = cachedStatement("INSERT INTO Origins (origin, quota) "
+                           "SELECT ?,0 "
+                           "WHERE NOT EXISTS (SELECT * FROM 'Origins' WHERE origin = ?);");
+    retassure(!(sqlite_err = sqlite3_bind_text(stmt, 1, origin.c_str(),(int)origin.size(),SQLITE_TRANSIENT)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+    retassure(!(sqlite_err = sqlite3_bind_text(stmt, 2, origin.c_str(),(int)origin.size(),SQLITE_TRANSIENT)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+    retassure((sqlite_err = step(stmt)) == SQLITE_DONE, "Failed to execute satement");
+    safeFreeCustom(stmt, sqlite3_reset);
+
+    stmt = cachedStatement("UPDATE Origins "
+                           "SET origin = ?, quota = 0 "
+                           "WHERE origin = ?;");
+    retassure(!(sqlite_err = sqlite3_bind_text(stmt, 1, origin.c_str(),(int)origin.size(),SQLITE_TRANSIENT)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+    retassure(!(sqlite_err = sqlite3_bind_text(stmt, 2, origin.c_str(),(int)origin.size(),SQLITE_TRANSIENT)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+    retassure((sqlite_err = step(stmt)) == SQLITE_DONE, "Failed to execute satement");
+    safeFreeCustom(stmt, sqlite3_reset);
+}
+
+
+int WebkitCacher::cacheIDForUrl(std::string url){
+    sqlite3_stmt *stmt = NULL;
+    cleanup([&]{
+        safeFreeCustom(stmt, sqlite3_reset);
+    });
+    std::string host;
+    unsigned int manifestHostHash = 0;
+    int sqlite_err = 0;
+    int latestId = 0;
+    
+    if (url.back() != '/') url += '/';
+
+    host = hostForUrl(url);
+    manifestHostHash = webkitHashString(host);
+    
+    {
+        auto it = _cacheIDForHostHash.find(manifestHostHash);
+        if (it != _cacheIDForHostHash.end()) {
+            return it->second;
+        }
+    }
+    
+    //When we got here, that means this host doesn't exist yet
+    latestId = _nextFreeCacheGroupID;
+    std::string origin = originForUrl(url);
+    
+    stmt = cachedStatement("INSERT INTO CacheGroups(id, manifestHostHash, manifestURL, newestCache, origin)"
+                           "VALUES(?,?,?,?,?);");
+    retassure(!(sqlite_err = sqlite3_bind_int(stmt, 1, latestId)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+    retassure(!(sqlite_err = sqlite3_bind_int(stmt, 2, manifestHostHash)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+    {
+        std::string arg = url+RESOURCE_CACHEFILE;
+        retassure(!(sqlite_err = sqlite3_bind_text(stmt, 3, arg.c_str(),(int)arg.size(),SQLITE_TRANSIENT)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+    }
+    retassure(!(sqlite_err = sqlite3_bind_int(stmt, 4, latestId)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+    retassure(!(sqlite_err = sqlite3_bind_text(stmt, 5, origin.c_str(),(int)origin.size(),SQLITE_TRANSIENT)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+    retassure((sqlite_err = step(stmt)) == SQLITE_DONE, "Failed to execute satement");
+    safeFreeCustom(stmt, sqlite3_reset);
+
+    _cacheIDForHostHash[manifestHostHash] = latestId;
+    _nextFreeCacheGroupID = latestId+1;
+    if (_fileUndo.recording) _fileUndo.cacheGroupHostHashes.push_back(manifestHostHash);
+    return latestId;
+}
+
+int WebkitCacher::prepareOrigin(const std::string &url){
+    std::string origin = originForUrl(url);
+    int cacheID = 0;
+    
+    {
+        auto it = _cacheIDForOrigin.find(origin);
+        if (it != _cacheIDForOrigin.end()) {
+            return it->second;
+        }
+    }
+    
+    cacheID = cacheIDForUrl(url);
+    setCacheAllowsAllNetworkRequests0(cacheID);
+    addOrigin(url);
+    _cacheIDForOrigin[origin] = cacheID;
+    return cacheID;
+}
+
+int WebkitCacher::resourceIDForUrl(std::string url){
+    auto it = _resourceIDForUrl.find(url);
+    retassure(it != _resourceIDForUrl.end(), "No resourceID found for URL '%s'",url.c_str());
+    return it->second;
+}
+
+int WebkitCacher::getNextFreeCacheResourcesID(){
+    return _nextFreeResourceID;
+}
+
+
+const std::string &WebkitCacher::headerTemplate(const char *mimeType){
+    auto it = _headerTemplates.find(mimeType);
+    if (it == _headerTemplates.end()) {
+        std::string headers;
+//        headers += "Last-Modified:Fri, 25 Dec 2020 10:51:00 GMT";
+//        headers += "Date:Sat, 26 Dec 2020 14:46:24 GMT";
+        headers += "Accept-Ranges:bytes\n";
+        headers += "Content-Type:";
+        headers += mimeType;
+        headers += "\n";
+        headers += "Content-Length:";
+        it = _headerTemplates.insert({mimeType,headers}).first;
+    }
+    return it->second;
+}
+
+void WebkitCacher::createCacheResource(int resourceID, const std::string &resourceURL, const char *mimeType, uint64_t dataSize, int dataresourceID){
+    BuildStats::Scope statsScope(_stats, BuildStats::Resources);
+    sqlite3_stmt *stmt = NULL;
+    cleanup([&]{
+        safeFreeCustom(stmt, sqlite3_reset);
+    });
+    int sqlite_err = 0;
+    char lengthStr[24] = {};
+    int lengthLen = 0;
+    
+    if (!dataresourceID) dataresourceID = resourceID;
+    
+    //the buffer keeps its capacity, so this doesn't allocate once it grew large enough
+    lengthLen = snprintf(lengthStr, sizeof(lengthStr), "%llu\n", (unsigned long long)dataSize);
+    _headerBuffer.assign(headerTemplate(mimeType));
+    _headerBuffer.append(lengthStr, lengthLen);
+    
+    if (_resourceIDs.find(resourceID) == _resourceIDs.end()) {
+        stmt = cachedStatement("INSERT INTO CacheResources (url, responseURL, mimeType, headers, data, id, statusCode, textEncodingName) "
+                               "VALUES(?,?,?,?,?,?,200,\"\");");
+    }else{
+        stmt = cachedStatement("UPDATE CacheResources "
+                               "SET url = ?, statusCode = 200, responseURL = ?, mimeType = ?, headers = ?, data = ? "
+                               "WHERE id = ?;");
+    }
+    //all bound strings outlive the sqlite3_step below, no need to let sqlite copy them
+    retassure(!(sqlite_err = sqlite3_bind_text(stmt, 1, resourceURL.c_str(),(int)resourceURL.size(),SQLITE_STATIC)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+    retassure(!(sqlite_err = sqlite3_bind_text(stmt, 2, resourceURL.c_str(),(int)resourceURL.size(),SQLITE_STATIC)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+    retassure(!(sqlite_err = sqlite3_bind_text(stmt, 3, mimeType,-1,SQLITE_STATIC)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+    retassure(!(sqlite_err = sqlite3_bind_text(stmt, 4, _headerBuffer.c_str(),(int)_headerBuffer.size(),SQLITE_STATIC)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+    retassure(!(sqlite_err = sqlite3_bind_int(stmt, 5, dataresourceID)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+    retassure(!(sqlite_err = sqlite3_bind_int(stmt, 6, resourceID)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+    retassure((sqlite_err = step(stmt)) == SQLITE_DONE, "Failed to execute satement");
+    safeFreeCustom(stmt, sqlite3_reset);
+    
+    _resourceIDs.insert(resourceID);
+    _resourceIDForUrl.insert({resourceURL,resourceID}); //first resource with this URL wins
+    _resourceSize[resourceID] = dataSize;
+    if (resourceID >= _nextFreeResourceID) _nextFreeResourceID = resourceID+1;
+    
+    {
+        auto it = _dataIDForResource.find(resourceID);
+        if (it == _dataIDForResource.end()) {
+            _dataIDForResource[resourceID] = dataresourceID;
+            _dataRefCount[dataresourceID]++;
+        }else if (it->second != dataresourceID){
+            int oldDataID = it->second;
+            it->second = dataresourceID;
+            _dataRefCount[dataresourceID]++;
+            releaseCacheResourceData(oldDataID);
+        }
+    }
+}
+
+int WebkitCacher::dataIDForWriting(int resourceID){
+    auto it = _dataIDForResource.find(resourceID);
+    if (it != _dataIDForResource.end() && _dataRefCount[it->second] == 1) {
+        //data row is only used by this resource, it can be overwritten in place
+        return it->second;
+    }
+    //data rows which are shared with other resources are never modified, a new row is created instead
+    if (_resourceDataIDs.find(resourceID) == _resourceDataIDs.end()) {
+        return resourceID;
+    }
+    return _nextFreeResourceDataID;
+}
+
+void WebkitCacher::releaseCacheResourceData(int dataID){
+    sqlite3_stmt *stmt = NULL;
+    cleanup([&]{
+        safeFreeCustom(stmt, sqlite3_reset);
+    });
+    int sqlite_err = 0;
+    
+    auto it = _dataRefCount.find(dataID);
+    if (it != _dataRefCount.end() && --it->second) return; //still in use
+    if (it != _dataRefCount.end()) _dataRefCount.erase(it);
+    if (_resourceDataIDs.find(dataID) == _resourceDataIDs.end()) return;
+    
+    stmt = cachedStatement("DELETE FROM CacheResourceData WHERE id = ?;");
+    retassure(!(sqlite_err = sqlite3_bind_int(stmt, 1, dataID)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+    retassure((sqlite_err = step(stmt)) == SQLITE_DONE, "Failed to execute satement");
+    safeFreeCustom(stmt, sqlite3_reset);
+    
+    _resourceDataIDs.erase(dataID);
+    _flatFileForDataID.erase(dataID); //path was queued in DeletedCacheResources by trigger
+    unregisterDataHash(dataID);
+}
+
+void WebkitCacher::registerDataHash(int dataID, uint64_t hash){
+    unregisterDataHash(dataID);
+    _dataIDsForHash.insert({hash,dataID});
+    _hashForDataID[dataID] = hash;
+}
+
+void WebkitCacher::unregisterDataHash(int dataID){
+    auto it = _hashForDataID.find(dataID);
+    if (it == _hashForDataID.end()) return;
+    auto range = _dataIDsForHash.equal_range(it->second);
+    for (auto e = range.first; e != range.second; ++e) {
+        if (e->second == dataID) {
+            _dataIDsForHash.erase(e);
+            break;
+        }
+    }
+    _hashForDataID.erase(it);
+}
+
+bool WebkitCacher::dataMatches(int dataID, ResourceSource &data){
+    BuildStats::Scope statsScope(_stats, BuildStats::Dedupe);
+    sqlite3_blob *blob = NULL;
+    int flatfd = -1;
+    cleanup([&]{
+        safeFreeCustom(blob, sqlite3_blob_close);
+        safeClose(flatfd);
+    });
+    uint64_t size = data.size();
+    const uint8_t *buf = (const uint8_t *)data.buffer();
+    std::function<bool(uint64_t offset, void *dst, size_t len)> readStored = nullptr;
+    
+    {
+        auto flat = _flatFileForDataID.find(dataID);
+        if (flat != _flatFileForDataID.end()) {
+            struct stat st = {};
+            if ((flatfd = open(_flatFiles.pathForName(flat->second).c_str(), O_RDONLY)) == -1) return false;
+            if (fstat(flatfd, &st) || (uint64_t)st.st_size != size) return false;
+            readStored = [&](uint64_t offset, void *dst, size_t len)->bool{
+                return FileResourceSource(flatfd, size).readAt(offset, dst, len) == len;
+            };
+        }else{
+            if (sqlite3_blob_open(_db, "main", "CacheResourceData", "data", dataID, 0, &blob)) return false;
+            if ((uint64_t)sqlite3_blob_bytes(blob) != size) return false;
+            readStored = [&](uint64_t offset, void *dst, size_t len)->bool{
+                return !sqlite3_blob_read(blob, dst, (int)len, (int)offset);
+            };
+        }
+    }
+    
+    if (_chunkBuffer.size() < RESOURCE_CHUNK_SIZE) _chunkBuffer.resize(RESOURCE_CHUNK_SIZE);
+    if (_compareBuffer.size() < RESOURCE_CHUNK_SIZE) _compareBuffer.resize(RESOURCE_CHUNK_SIZE);
+    
+    for (uint64_t offset = 0; offset < size;) {
+        size_t len = (size - offset < _compareBuffer.size()) ? (size_t)(size - offset) : _compareBuffer.size();
+        const uint8_t *cmp = NULL;
+        if (!readStored(offset, _compareBuffer.data(), len)) return false;
+        if (buf) {
+            cmp = buf + offset;
+        }else{
+            retassure(data.readAt(offset, _chunkBuffer.data(), len) == len, "Failed to read resource");
+            cmp = _chunkBuffer.data();
+        }
+        if (memcmp(cmp, _compareBuffer.data(), len)) return false;
+        offset += len;
+    }
+    return true;
+}
+
+int WebkitCacher::findIdenticalData(ResourceSource &data, uint64_t hash){
+    BuildStats::Scope statsScope(_stats, BuildStats::Dedupe);
+    auto range = _dataIDsForHash.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (dataMatches(it->second, data)) return it->second;
+    }
+    return 0;
+}
+
+int WebkitCacher::findIdenticalStoredData(int dataID, uint64_t hash){
+    int flatfd = -1;
+    cleanup([&]{
+        safeClose(flatfd);
+    });
+    std::unique_ptr<ResourceSource> stored;
+    
+    auto flat = _flatFileForDataID.find(dataID);
+    if (flat != _flatFileForDataID.end()) {
+        struct stat st = {};
+        std::string path = _flatFiles.pathForName(flat->second);
+        retassure((flatfd = open(path.c_str(), O_RDONLY)) != -1 && !fstat(flatfd, &st), "Failed to open flat file '%s' with err=%d (%s)",path.c_str(),errno,strerror(errno));
+        stored.reset(new FileResourceSource(flatfd, st.st_size));
+    }else{
+        stored.reset(new BlobResourceSource(_db, dataID));
+    }
+    return findIdenticalData(*stored, hash);
+}
+
+void WebkitCacher::createCacheResourceData(int dataID, ResourceSource &data, const std::string &resourceURL){
+    BuildStats::Scope statsScope(_stats, BuildStats::DataWrite);
+    sqlite3_stmt *stmt = NULL;
+    sqlite3_blob *blob = NULL;
+    cleanup([&]{
+        safeFreeCustom(blob, sqlite3_blob_close);
+        safeFreeCustom(stmt, sqlite3_reset);
+    });
+    int sqlite_err = 0;
+    uint64_t size = data.size();
+    const void *buf = data.buffer();
+    std::string flatFile;
+    
+    if (_chunkBuffer.size() < RESOURCE_CHUNK_SIZE) _chunkBuffer.resize(RESOURCE_CHUNK_SIZE);
+
+    if (_flatFileThreshold && size > _flatFileThreshold) {
+        BuildStats::Scope statsScope(_stats, BuildStats::FlatFile);
+        flatFile = _flatFiles.store(data, fileExtensionForUrl(resourceURL), _chunkBuffer.data(), _chunkBuffer.size());
+    }else{
+        retassure(size <= (uint64_t)sqlite3_limit(_db, SQLITE_LIMIT_LENGTH, -1), "Resource size %llu exceeds maximum sqlite blob size",(unsigned long long)size);
+    }
+
+    if (flatFile.size()) {
+        //body lives in the flat file
+    }else if (!buf && size <= RESOURCE_CHUNK_SIZE) {
+        //small resources are read at once and bound without copying them again
+        retassure(data.readAt(0, _chunkBuffer.data(), (size_t)size) == size, "Failed to read resource");
+        buf = _chunkBuffer.data();
+    }
+    
+    if (_resourceDataIDs.find(dataID) == _resourceDataIDs.end()) {
+        stmt = cachedStatement("INSERT INTO CacheResourceData (data, id, path) "
+                               "VALUES(?1,?2,?3);");
+    }else{
+        auto oldFlatFile = _flatFileForDataID.find(dataID);
+        if (oldFlatFile != _flatFileForDataID.end()) {
+            //same as the CacheResourceDataDeleted trigger does for deleted rows
+            stmt = cachedStatement("INSERT INTO DeletedCacheResources (path) VALUES(?);");
+            retassure(!(sqlite_err = sqlite3_bind_text(stmt, 1, oldFlatFile->second.c_str(), -1, SQLITE_TRANSIENT)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+            retassure((sqlite_err = step(stmt)) == SQLITE_DONE, "Failed to execute satement");
+            safeFreeCustom(stmt, sqlite3_reset);
+            if (_fileUndo.recording) _fileUndo.flatFiles.push_back(*oldFlatFile);
+            _flatFileForDataID.erase(oldFlatFile);
+        }
+        stmt = cachedStatement("UPDATE CacheResourceData "
+                               "SET data = ?1, path = ?3 "
+                               "WHERE id = ?2;");
+    }
+    if (flatFile.size()) {
+        retassure(!(sqlite_err = sqlite3_bind_zeroblob(stmt, 1, 0)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+        retassure(!(sqlite_err = sqlite3_bind_text(stmt, 3, flatFile.c_str(), -1, SQLITE_STATIC)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+    }else if (buf) {
+        retassure(!(sqlite_err = sqlite3_bind_blob64(stmt, 1, buf, size, SQLITE_STATIC)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+    }else{
+        //reserve space for large resources, data is streamed in below
+        retassure(!(sqlite_err = sqlite3_bind_zeroblob64(stmt, 1, size)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+    }
+    retassure(!(sqlite_err = sqlite3_bind_int(stmt, 2, dataID)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+    if ((sqlite_err = step(stmt)) != SQLITE_DONE) {
+        _flatFiles.remove(flatFile);
+        reterror("Failed to execute satement");
+    }
+    safeFreeCustom(stmt, sqlite3_reset);
+    
+    if (_resourceDataIDs.insert(dataID).second && _fileUndo.recording) _fileUndo.resourceDataIDs.push_back(dataID);
+    if (dataID >= _nextFreeResourceDataID) _nextFreeResourceDataID = dataID+1;
+    if (_fileUndo.recording) {
+        auto hash = _hashForDataID.find(dataID);
+        if (hash != _hashForDataID.end()) _fileUndo.dataHashes.push_back(*hash);
+    }
+    unregisterDataHash(dataID); //content changed
+
+    if (flatFile.size()) {
+        _flatFileForDataID[dataID] = flatFile;
+    }else if (!buf) {
+        retassure(!(sqlite_err = sqlite3_blob_open(_db, "main", "CacheResourceData", "data", dataID, 1, &blob)), "Failed to open blob with error=%d",sqlite_err);
+        for (uint64_t offset = 0; offset < size;) {
+            size_t didRead = data.readAt(offset, _chunkBuffer.data(), _chunkBuffer.size());
+            retassure(didRead, "Failed to read resource");
+            retassure(!(sqlite_err = sqlite3_blob_write(blob, _chunkBuffer.data(), (int)didRead, (int)offset)), "Failed to write blob with error=%d",sqlite_err);
+            offset += didRead;
+        }
+        safeFreeCustom(blob, sqlite3_blob_close);
+    }
+}
+
+void WebkitCacher::addCachesSize(int chaceID, int64_t size){
+    BuildStats::Scope statsScope(_stats, BuildStats::CachesSize);
+    sqlite3_stmt *stmt = NULL;
+    cleanup([&]{
+        safeFreeCustom(stmt, sqlite3_reset);
+    });
+    int sqlite_err = 0;
+    uint64_t currentCacheSize = 0;
+    
+    auto it = _cachesSize.find(chaceID);
+    if (it == _cachesSize.end()) {
+        stmt = cachedStatement("INSERT INTO Caches (size, id, cacheGroup) "
+                               "VALUES(?,?,?);");
+        retassure(!(sqlite_err = sqlite3_bind_int(stmt, 3, chaceID)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+    }else{
+        currentCacheSize = it->second;
+        stmt = cachedStatement("UPDATE Caches "
+                               "SET size = ? "
+                               "WHERE id = ?;");
+    }
+
+    if (size < 0 && (uint64_t)-size > currentCacheSize) {
+        currentCacheSize = 0;
+    }else{
+        currentCacheSize += size;
+    }
+    
+    retassure(!(sqlite_err = sqlite3_bind_int64(stmt, 1, (sqlite3_int64)currentCacheSize)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+    retassure(!(sqlite_err = sqlite3_bind_int(stmt, 2, chaceID)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+    retassure((sqlite_err = step(stmt)) == SQLITE_DONE, "Failed to execute satement");
+    safeFreeCustom(stmt, sqlite3_reset);
+    
+    _cachesSize[chaceID] = currentCacheSize;
+}
+
+
+void WebkitCacher::createCacheEntry(int cacheID, ResourceType resourceType, int resourceID){
+    BuildStats::Scope statsScope(_stats, BuildStats::Entries);
+    sqlite3_stmt *stmt = NULL;
+    cleanup([&]{
+        safeFreeCustom(stmt, sqlite3_reset);
+    });
+    int sqlite_err = 0;
+    
+    if (_cacheEntryResources.find(resourceID) == _cacheEntryResources.end()) {
+        stmt = cachedStatement("INSERT INTO CacheEntries (cache, type, resource) "
+                               "VALUES(?,?,?);");
+    }else{
+        stmt = cachedStatement("UPDATE CacheEntries "
+                               "SET cache = ?, type = ? "
+                               "WHERE resource = ?;");
+    }
+    retassure(!(sqlite_err = sqlite3_bind_int(stmt, 1, cacheID)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+    retassure(!(sqlite_err = sqlite3_bind_int(stmt, 2, resourceType)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+    retassure(!(sqlite_err = sqlite3_bind_int(stmt, 3, resourceID)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+    retassure((sqlite_err = step(stmt)) == SQLITE_DONE, "Failed to execute satement");
+    safeFreeCustom(stmt, sqlite3_reset);
+    
+    if (_cacheEntryResources.insert(resourceID).second && _fileUndo.recording) _fileUndo.cacheEntryResources.push_back(resourceID);
+}
+
+
+int WebkitCacher::addResourceToURL(std::string url, std::string resource, const char *mimeType, ResourceSource &data, uint64_t *hash){
+    BuildStats::Scope statsScope(_stats, BuildStats::Other);
+    int resourceID = 0; //real resourceIDs can't be zero
+    int cacheID = 0;
+    int dataID = 0;
+    int64_t sizeDelta = 0;
+    ResourceType resourceType = ResourceType::Master;
+    uint64_t payloadHash = hash ? *hash : 0;
+    bool hashWhileStoring = !payloadHash && data.readsOnce() && (_deduplicate || hash);
+    
+    if (resource.front() == '/') resource = resource.substr(1);
+    url = resourceURL(url, resource);
+    
+    if (resource == RESOURCE_CACHEFILE) {
+        resourceType = ResourceType::Manifest;
+    }
+    
+    try {
+        resourceID = resourceIDForUrl(url);
+    } catch (...) {
+        resourceID = getNextFreeCacheResourcesID();
+    }
+    
+    cacheID = cacheIDForUrl(url);
+    createCacheEntry(cacheID, resourceType, resourceID);
+
+    if (_deduplicate && !hashWhileStoring) {
+        if (_chunkBuffer.size() < RESOURCE_CHUNK_SIZE) _chunkBuffer.resize(RESOURCE_CHUNK_SIZE);
+        if (!payloadHash) {
+            BuildStats::Scope statsScope(_stats, BuildStats::Hash);
+            payloadHash = ContentHash::hash(data, _chunkBuffer.data(), _chunkBuffer.size());
+        }
+        if ((dataID = findIdenticalData(data, payloadHash))) {
+            _deduplicatedBytes += data.size();
+        }
+    }
+    
+    if (hashWhileStoring) {
+        HashingResourceSource hashing(data);
+        int identicalID = 0;
+        dataID = dataIDForWriting(resourceID);
+        createCacheResourceData(dataID, hashing, url);
+        retassure(hashing.complete(), "Payload of '%s' was not read completely",url.c_str());
+        payloadHash = hashing.digest();
+        //the payload can only be compared once it is stored, a duplicate row goes again
+        if (_deduplicate && (identicalID = findIdenticalStoredData(dataID, payloadHash))) {
+            if (_dataRefCount.find(dataID) == _dataRefCount.end()) releaseCacheResourceData(dataID);
+            dataID = identicalID;
+            _deduplicatedBytes += data.size();
+        }else if (_deduplicate) {
+            registerDataHash(dataID, payloadHash);
+        }
+    }else if (!dataID) {
+        dataID = dataIDForWriting(resourceID);
+        createCacheResourceData(dataID, data, url);
+        if (_deduplicate) registerDataHash(dataID, payloadHash);
+    }
+    if (hash) *hash = payloadHash;
+
+    {
+        auto size = _resourceSize.find(resourceID);
+        sizeDelta = (int64_t)data.size() - (size != _resourceSize.end() ? (int64_t)size->second : 0);
+    }
+    createCacheResource(resourceID, url, mimeType, data.size(), dataID);
+    addCachesSize(cacheID, sizeDelta);
+    return resourceID;
+}
+
+int WebkitCacher::addSharedResource(int cacheID, const std::string &resourceUrl, const char *mimeType, int dataID, uint64_t size){
+    static const std::string manifestSuffix = "/" RESOURCE_CACHEFILE;
+    int resourceID = 0;
+    int64_t sizeDelta = 0;
+    ResourceType resourceType = ResourceType::Master;
+    
+    if (resourceUrl.size() >= manifestSuffix.size() && resourceUrl.compare(resourceUrl.size()-manifestSuffix.size(), manifestSuffix.size(), manifestSuffix) == 0) {
+        resourceType = ResourceType::Manifest;
+    }
+    {
+        auto it = _resourceIDForUrl.find(resourceUrl);
+        resourceID = (it != _resourceIDForUrl.end()) ? it->second : getNextFreeCacheResourcesID();
+    }
+    
+    clearFingerprint(resourceID);
+    createCacheEntry(cacheID, resourceType, resourceID);
+    {
+        auto oldSize = _resourceSize.find(resourceID);
+        sizeDelta = (int64_t)size - (oldSize != _resourceSize.end() ? (int64_t)oldSize->second : 0);
+    }
+    //payload is shared, same as deduplicated resources
+    createCacheResource(resourceID, resourceUrl, mimeType, size, dataID);
+    addCachesSize(cacheID, sizeDelta);
+    return resourceID;
+}
+
+void WebkitCacher::addFileResource(std::string url, std::string name, ResourceSource &data, int64_t mtime, uint64_t hash){
+    int resourceID = 0;
+
+    //payloads which can only be read once are hashed while they are stored and always rewritten
+    if (_incremental && !data.readsOnce()) {
+        if (_chunkBuffer.size() < RESOURCE_CHUNK_SIZE) _chunkBuffer.resize(RESOURCE_CHUNK_SIZE);
+        if (!hash) {
+            BuildStats::Scope statsScope(_stats, BuildStats::Hash);
+            hash = ContentHash::hash(data, _chunkBuffer.data(), _chunkBuffer.size());
+        }
+        
+        //file was touched, but content is still the same. Only refresh the fingerprint
+        auto r = _resourceIDForUrl.find(resourceURL(url, name));
+        if (r != _resourceIDForUrl.end()) {
+            auto fp = _fingerprints.find(r->second);
+            if (fp != _fingerprints.end() && fp->second.size == data.size() && fp->second.hash == hash
+                && dataMatches(_dataIDForResource[r->second], data)) {
+                setFingerprint(r->second, {data.size(), mtime, hash});
+                _seenResources.insert(r->second);
+                _unchangedFiles++;
+                return;
+            }
+        }
+    }
+    
+    resourceID = addResourceToURL(url, name, _mimeTypes.typeForFilename(name), data, &hash);
+    _stats.add(BuildStats::Files);
+    _stats.add(BuildStats::FileBytes, data.size());
+    
+    if (_incremental) {
+        setFingerprint(resourceID, {data.size(), mtime, hash});
+        _seenResources.insert(resourceID);
+    }
+}
+
+void WebkitCacher::beginFileUndo(){
+    _fileUndo.cacheEntryResources.clear();
+    _fileUndo.resourceDataIDs.clear();
+    _fileUndo.cacheGroupHostHashes.clear();
+    _fileUndo.flatFiles.clear();
+    _fileUndo.dataHashes.clear();
+    _fileUndo.nextFreeResourceDataID = _nextFreeResourceDataID;
+    _fileUndo.nextFreeCacheGroupID = _nextFreeCacheGroupID;
+    _fileUndo.recording = true;
+}
+
+void WebkitCacher::undoFile(){
+    for (int resourceID : _fileUndo.cacheEntryResources) {
+        _cacheEntryResources.erase(resourceID);
+    }
+    for (int dataID : _fileUndo.resourceDataIDs) {
+        _resourceDataIDs.erase(dataID);
+        _flatFileForDataID.erase(dataID);
+    }
+    for (unsigned int hostHash : _fileUndo.cacheGroupHostHashes) {
+        _cacheIDForHostHash.erase(hostHash);
+    }
+    for (auto &flat : _fileUndo.flatFiles) {
+        _flatFileForDataID[flat.first] = flat.second;
+    }
+    for (auto &hash : _fileUndo.dataHashes) {
+        registerDataHash(hash.first, hash.second);
+    }
+    _nextFreeResourceDataID = _fileUndo.nextFreeResourceDataID;
+    _nextFreeCacheGroupID = _fileUndo.nextFreeCacheGroupID;
+}
+
+void WebkitCacher::addFileResourceOrSkip(const std::string &url, const std::string &name, const std::string &filepath, StatsResourceSource &data, int64_t mtime, uint64_t hash){
+    sqlite3_stmt *stmt = NULL;
+    cleanup([&]{
+        safeFreeCustom(stmt, sqlite3_reset);
+    });
+    int sqlite_err = 0;
+    
+    if (!_skipErrors) {
+        addFileResource(url, name, data, mtime, hash);
+        return;
+    }
+    
+    stmt = cachedStatement("SAVEPOINT WebkitCacherFile;");
+    retassure((sqlite_err = step(stmt)) == SQLITE_DONE, "Failed to execute satement");
+    safeFreeCustom(stmt, sqlite3_reset);
+    beginFileUndo();
+    try {
+        addFileResource(url, name, data, mtime, hash);
+    } catch (tihmstar::exception &err) {
+        //undo whatever the file wrote, the in-memory index may contain rows which were just rolled back
+        _fileUndo.recording = false;
+        sqlite3_exec(_db, "ROLLBACK TO WebkitCacherFile; RELEASE WebkitCacherFile;", NULL, NULL, NULL);
+        _sweepFlatFiles = true; //the file may already have been stored as flat file
+        if (!data.readFailed()) {
+            loadIndex(); //failed anywhere, not only where undo was recorded
+            throw;
+        }
+        undoFile();
+        skipFailedFile(filepath, resourceURL(url, name), err.what());
+        return;
+    }
+    _fileUndo.recording = false;
+    stmt = cachedStatement("RELEASE WebkitCacherFile;");
+    retassure((sqlite_err = step(stmt)) == SQLITE_DONE, "Failed to execute satement");
+    safeFreeCustom(stmt, sqlite3_reset);
+}
+
+void WebkitCacher::addWalkedFile(const DirectoryWalker &walker){
+    int fd = -1;
+    cleanup([&]{
+        if (fd > 0) {
+            close(fd);fd=-1;
+        }
+    });
+    struct stat st = {};
+    std::string name(walker.name(), walker.nameLength());
+    const std::string &url = walker.url();
+    const std::string &filepath = walker.path();
+    
+    //the walk already stat'ed the file, unchanged files are not even opened
+    if (_incremental && fileUnchanged(resourceURL(url, name), walker.size(), walker.modificationTime())) {
+        return;
+    }
+    
+    try {
+        retassure((fd = openat(walker.directory()->fd(), name.c_str(), O_RDONLY)) > 0, "Failed to open file '%s'",filepath.c_str());
+        retassure(!fstat(fd, &st), "Failed to stat file '%s'",filepath.c_str());
+    } catch (tihmstar::exception &err) {
+        if (!_skipErrors) throw;
+        skipFailedFile(filepath, resourceURL(url, name), err.what());
+        return;
+    }
+    
+    FileResourceSource filedata(fd, st.st_size, filepath.c_str());
+    StatsResourceSource data(filedata, _stats);
+    addFileResourceOrSkip(url, name, filepath, data, fileModificationTime(st));
+    transactionCheckpoint();
+}
+
+void WebkitCacher::addDirectoryResources(std::string url, std::string dir, const std::vector<std::string> *rootEntries){
+    BuildStats::Scope statsScope(_stats, BuildStats::Walk);
+    
+    bool sorted = _deterministic || _resume;
+    
+    if (url.back() != '/') url += '/';
+    if (dir.back() != '/') dir += '/';
+    
+    if (_jobs > 1) {
+        //files which become flat files are handed over as fd, so they can be linked or cloned
+        IngestPipeline pipeline(_jobs, (_flatFileThreshold && _flatFileThreshold < RESOURCE_CHUNK_SIZE) ? (size_t)_flatFileThreshold : RESOURCE_CHUNK_SIZE, sorted);
+        std::unordered_map<std::string, Fingerprint> known; //snapshot for the worker threads
+        std::function<bool(const IngestPipeline::Item &item)> unchanged = nullptr;
+        
+        if (_incremental) {
+            for (auto &r : _resourceIDForUrl) {
+                auto fp = _fingerprints.find(r.second);
+                if (fp != _fingerprints.end()) known[r.first] = fp->second;
+            }
+            unchanged = [&known](const IngestPipeline::Item &item)->bool{
+                auto fp = known.find(resourceURL(item.url, item.name));
+                return fp != known.end() && fp->second.size == item.size && fp->second.mtime == item.mtime;
+            };
+        }
+        
+        pipeline.setResumeAfter(_resumeAfter);
+        pipeline.setFollowSymlinks(_followSymlinks);
+        pipeline.setHashContent(_deduplicate || _incremental); //the only users of the hash
+        if (rootEntries) pipeline.setRootEntries(*rootEntries);
+        pipeline.run(url, dir, [&](IngestPipeline::Item &item){
+            if (_checkpointUrl.size() && item.name.size()) {
+                _checkpointPath = resourceURL(item.url, item.name).substr(_checkpointUrl.size());
+            }
+            if (item.err) {
+                if (!_skipErrors) std::rethrow_exception(item.err);
+                try {
+                    std::rethrow_exception(item.err);
+                } catch (tihmstar::exception &err) {
+                    skipFailedFile(item.filepath, item.name.size() ? resourceURL(item.url, item.name) : item.url, err.what());
+                }
+                return;
+            }
+            if (item.unchanged) {
+                fileUnchanged(resourceURL(item.url, item.name), item.size, item.mtime);
+                return;
+            }
+            if (item.preloaded) {
+                BufferResourceSource filedata(item.data.data(), item.size);
+                StatsResourceSource data(filedata, _stats);
+                addFileResourceOrSkip(item.url, item.name, item.filepath, data, item.mtime, item.hash);
+            }else{
+                FileResourceSource filedata(item.fd, item.size, item.filepath.c_str());
+                StatsResourceSource data(filedata, _stats);
+                addFileResourceOrSkip(item.url, item.name, item.filepath, data, item.mtime, item.hash);
+            }
+            transactionCheckpoint();
+        }, unchanged);
+        _stats.add(BuildStats::Directories, pipeline.directoriesWalked());
+        return;
+    }
+    
+    DirectoryWalker walker(url, dir, sorted);
+    walker.setFollowSymlinks(_followSymlinks);
+    walker.setPrefetchMetadata(_incremental);
+    walker.setResumeAfter(_resumeAfter);
+    if (rootEntries) walker.setRootEntries(*rootEntries);
+    
+    while (walker.next()) {
+        if (walker.type() == DirectoryWalker::Directory) {
+            continue;
+        }
+        if (_checkpointUrl.size() && !walker.isDirectory()) {
+            _checkpointPath = walker.relativePath();
+        }
+        if (walker.type() == DirectoryWalker::Error) {
+            if (!_skipErrors) walker.throwError();
+            try {
+                walker.throwError();
+            } catch (tihmstar::exception &err) {
+                skipFailedFile(walker.path(), walker.entryUrl(), err.what());
+            }
+            continue;
+        }
+        addWalkedFile(walker);
+    }
+    _stats.add(BuildStats::Directories, walker.directoriesWalked());
+}
+
+void WebkitCacher::addArchiveResources(std::string url, int fd){
+    BuildStats::Scope statsScope(_stats, BuildStats::Walk);
+    TarReader tar(fd);
+    TarReader::Entry entry;
+    bool skipping = _resumeAfter.size(); //archives can't be sorted, members are skipped until the checkpoint shows up
+    std::unordered_set<std::string> members; //files of the archive which are cached, links can only point to those
+    std::vector<TarReader::Entry> links;
+    
+    while (tar.next(entry)) {
+        size_t slash = entry.path.rfind('/');
+        std::string dirUrl = url + (slash == std::string::npos ? "" : entry.path.substr(0,slash+1));
+        std::string name = entry.path.substr(slash+1); //npos+1 is 0
+        
+        if (entry.type != TarReader::File) {
+            links.push_back(entry); //may point to a member further down the archive
+            continue;
+        }
+        if (skipping) {
+            if (_incremental) {
+                auto r = _resourceIDForUrl.find(resourceURL(dirUrl, name));
+                if (r != _resourceIDForUrl.end()) _seenResources.insert(r->second);
+            }
+            members.insert(entry.path);
+            if (entry.path == _resumeAfter) skipping = false;
+            continue;
+        }
+        if (_checkpointUrl.size()) _checkpointPath = entry.path;
+        
+        if (_incremental && fileUnchanged(resourceURL(dirUrl, name), entry.size, entry.mtime)) {
+            members.insert(entry.path);
+            continue;
+        }
+        
+        ResourceSource *member = NULL;
+        {
+            BuildStats::Scope readScope(_stats, BuildStats::Read); //members of streams are buffered here
+            member = &tar.data();
+        }
+        StatsResourceSource data(*member, _stats);
+        addFileResource(dirUrl, name, data, entry.mtime);
+        members.insert(entry.path);
+        transactionCheckpoint();
+    }
+    retassure(!skipping, "Archive doesn't contain '%s', which an interrupted run stopped at",_resumeAfter.c_str());
+    
+    //links share the payload of their target, links to links resolve once the link they point to did
+    for (bool resolved = true; resolved && links.size(); ) {
+        resolved = false;
+        for (auto it = links.begin(); it != links.end(); ) {
+            if (members.find(it->linkTarget) == members.end()) {
+                ++it;
+                continue;
+            }
+            addArchiveLink(url, it->path, it->linkTarget);
+            members.insert(it->path);
+            it = links.erase(it);
+            resolved = true;
+        }
+    }
+    for (auto &link : links) {
+        std::string error = "Link '" + link.path + "' doesn't point to a file in the archive";
+        retassure(_skipErrors, "%s",error.c_str());
+        skipFailedFile(link.path, url + link.path, error.c_str());
+    }
+    _stats.add(BuildStats::Directories, tar.directories());
+}
+
+void WebkitCacher::addArchiveLink(const std::string &url, const std::string &path, const std::string &target){
+    std::string resourceUrl = url + path;
+    int srcResourceID = resourceIDForUrl(url + target);
+    int resourceID = 0;
+    
+    resourceID = addSharedResource(cacheIDForUrl(resourceUrl), resourceUrl, _mimeTypes.typeForFilename(path.substr(path.rfind('/')+1)),
+                                   _dataIDForResource[srcResourceID], _resourceSize[srcResourceID]);
+    _stats.add(BuildStats::Files);
+    if (_incremental) _seenResources.insert(resourceID);
+    transactionCheckpoint();
+}
+
+void WebkitCacher::beginCacheURL(const std::string &url){
+    _seenResources.clear();
+    addManifest(url);
+}
+
+void WebkitCacher::finishCacheURL(const std::string &url){
+    if (_incremental) {
+        removeStaleResources(url);
+    }
+    
+    if (_checkpointUrl.size()) {
+        writeCheckpoint(true);
+        _checkpointUrl.clear();
+        _resumeAfter.clear();
+    }
+    
+    if (!_inTransaction && _staging == StagingMode::Direct) {
+        purgeDeletedFlatFiles(); //staged builds purge on publish, the published database may still reference the files
+    }
+}
+
+void WebkitCacher::transactionCheckpoint(){
+    int sqlite_err = 0;
+    if (!_inTransaction || !_commitInterval) return;
+    if (++_filesSinceCommit < _commitInterval) return;
+    
+    BuildStats::Scope statsScope(_stats, BuildStats::Commit);
+    if (_checkpointUrl.size()) {
+        writeCheckpoint(false);
+    }
+    sql_exec("COMMIT;");
+    _inTransaction = false;
+    sql_exec("BEGIN;");
+    _inTransaction = true;
+    _filesSinceCommit = 0;
+}
+
+
+void WebkitCacher::writeRedirect(const std::string &url, const std::string &targetUrl){
+    int cacheID = 0;
+    int srcResourceID = 0;
+    int dstResourceID = 0;
+    
+    cacheID = prepareOrigin(url);
+
+    dstResourceID = resourceIDForUrl(targetUrl);
+    {
+        auto it = _resourceIDForUrl.find(url);
+        srcResourceID = (it != _resourceIDForUrl.end()) ? it->second : getNextFreeCacheResourcesID();
+    }
+    
+    createCacheEntry(cacheID, ResourceType::Master, srcResourceID);
+    {
+        auto size = _resourceSize.find(srcResourceID);
+        if (size != _resourceSize.end() && size->second) {
+            addCachesSize(cacheID, -(int64_t)size->second);
+        }
+    }
+    createCacheResource(srcResourceID, url, "text/html", 0, _dataIDForResource[dstResourceID]);
+    _stats.add(BuildStats::Redirects);
+}
+
+#pragma mark public
+
+void WebkitCacher::cacheDirectory(std::string url, std::string dir){
+    BuildStats::Scope statsScope(_stats, BuildStats::Other);
+
+    if (url.back() != '/') url += '/';
+    if (dir.back() != '/') dir += '/';
+
+    if (_resume && resumeCheckpoint(url)) return; //finished by an interrupted run
+    beginCacheURL(url);
+    if (_incremental && _resumeAfter.size()) {
+        //files the interrupted run committed are not walked again, they must not be removed as stale
+        for (auto &r : _resourceIDForUrl) {
+            if (r.first.compare(0, url.size(), url)) continue;
+            std::string path = r.first.substr(url.size());
+            if (!walkOrderLess(_resumeAfter, path)) _seenResources.insert(r.second);
+        }
+    }
+    addDirectoryResources(url, dir);
+    finishCacheURL(url);
+}
+
+void WebkitCacher::cacheDirectoryEntries(std::string url, std::string dir, const std::vector<std::string> &names){
+    BuildStats::Scope statsScope(_stats, BuildStats::Other);
+    
+    retassure(!_incremental, "Caching single entries of a directory can't be incremental");
+    if (url.back() != '/') url += '/';
+    if (dir.back() != '/') dir += '/';
+    
+    beginCacheURL(url);
+    addDirectoryResources(url, dir, &names);
+    finishCacheURL(url);
+}
+
+void WebkitCacher::cacheArchive(std::string url, std::string archivePath){
+    BuildStats::Scope statsScope(_stats, BuildStats::Other);
+    int fd = -1;
+    cleanup([&]{
+        if (fd != STDIN_FILENO) safeClose(fd);
+    });
+
+    if (url.back() != '/') url += '/';
+    
+    if (archivePath == "-") {
+        fd = STDIN_FILENO;
+    }else{
+        retassure((fd = open(archivePath.c_str(), O_RDONLY)) != -1, "Failed to open archive '%s' with err=%d (%s)",archivePath.c_str(),errno,strerror(errno));
+    }
+
+    if (_resume && resumeCheckpoint(url)) return; //finished by an interrupted run
+    beginCacheURL(url);
+    addArchiveResources(url, fd);
+    finishCacheURL(url);
+}
+
+void WebkitCacher::updateFiles(std::string url, std::string dir, const std::vector<std::string> &paths){
+    BuildStats::Scope statsScope(_stats, BuildStats::Other);
+    bool ownTransaction = false;
+    cleanup([&]{
+        if (ownTransaction) rollbackTransaction();
+    });
+    
+    retassure(_incremental, "Updating single files requires incremental mode");
+    if (url.back() != '/') url += '/';
+    if (dir.back() != '/') dir += '/';
+    
+    prepareOrigin(url);
+    if (!_inTransaction) {
+        beginTransaction();
+        ownTransaction = true;
+    }
+    
+    std::vector<std::string> ordered = paths;
+    if (_deterministic) std::sort(ordered.begin(), ordered.end());
+    
+    for (auto &path : ordered) {
+        std::string filepath = dir + path;
+        struct stat st = {};
+        
+        if (!stat(filepath.c_str(), &st)) {
+            if (S_ISDIR(st.st_mode)) continue; //files inside are passed individually
+            if (!S_ISREG(st.st_mode)) continue;
+            int fd = -1;
+            cleanup([&]{
+                safeClose(fd);
+            });
+            size_t slash = path.rfind('/');
+            std::string dirUrl = url + (slash == std::string::npos ? "" : path.substr(0,slash+1));
+            std::string name = path.substr(slash+1); //npos+1 is 0
+            
+            if (fileUnchanged(resourceURL(dirUrl, name), st.st_size, fileModificationTime(st))) {
+                continue;
+            }
+            if ((fd = open(filepath.c_str(), O_RDONLY)) == -1) {
+                retassure(errno == ENOENT, "Failed to open file '%s'",filepath.c_str());
+                removeFileResources(url + path); //deleted while we were looking at it
+                continue;
+            }
+            retassure(!fstat(fd, &st), "Failed to stat file '%s'",filepath.c_str());
+            FileResourceSource filedata(fd, st.st_size, filepath.c_str());
+            StatsResourceSource data(filedata, _stats);
+            addFileResource(dirUrl, name, data, fileModificationTime(st));
+        }else{
+            retassure(errno == ENOENT || errno == ENOTDIR, "Failed to stat file '%s'",filepath.c_str());
+            removeFileResources(url + path);
+        }
+    }
+    
+    if (ownTransaction) {
+        commitTransaction();
+        ownTransaction = false;
+    }
+}
+
+void WebkitCacher::addRedirect(std::string url, std::string targetUrl){
+    BuildStats::Scope statsScope(_stats, BuildStats::Other);
+    writeRedirect(url, targetUrl);
+}
+
+void WebkitCacher::addRedirects(const std::vector<std::pair<std::string,std::string>> &redirects){
+    BuildStats::Scope statsScope(_stats, BuildStats::Other);
+    bool ownTransaction = false;
+    cleanup([&]{
+        if (ownTransaction) rollbackTransaction();
+    });
+    
+    //resolve all targets before writing anything, so a typo doesn't leave half of the redirects behind
+    {
+        std::unordered_set<std::string> sources;
+        for (auto &r : redirects) {
+            retassure(_resourceIDForUrl.find(r.second) != _resourceIDForUrl.end() || sources.find(r.second) != sources.end(),
+                      "No resourceID found for redirect target '%s'",r.second.c_str());
+            sources.insert(r.first); //redirects may point to redirects earlier in the list
+        }
+    }
+    
+    if (!_inTransaction) {
+        beginTransaction();
+        ownTransaction = true;
+    }
+    for (auto &r : redirects) {
+        writeRedirect(r.first, r.second);
+    }
+    if (ownTransaction) {
+        commitTransaction();
+        ownTransaction = false;
+    }
+}
+
+void WebkitCacher::addManifest(std::string url){
+    static const char manifest[] = "CACHE MANIFEST\n# v2.5.5 Self-Host\n";
+    BufferResourceSource manifestData(manifest, sizeof(manifest)-1);
+    
+    if (url.back() != '/') url += '/';
+    prepareOrigin(url);
+    addResourceToURL(url, RESOURCE_CACHEFILE, "application/octet-stream", manifestData);
+}
+
+void WebkitCacher::putResource(std::string resourceUrl, std::string mimeType, ResourceSource &data){
+    BuildStats::Scope statsScope(_stats, BuildStats::Other);
+    size_t slash = resourceUrl.rfind('/');
+    int resourceID = 0;
+    
+    retassure(slash != std::string::npos && slash+1 < resourceUrl.size(), "Invalid resource URL '%s'",resourceUrl.c_str());
+    prepareOrigin(resourceUrl.substr(0,slash+1)); //a new cache group gets its manifest next to the resource
+    {
+        std::string name = resourceUrl.substr(slash+1);
+        const char *type = mimeType.size() ? _mimeTypes.intern(mimeType) : _mimeTypes.typeForFilename(name);
+        resourceID = addResourceToURL(resourceUrl.substr(0,slash+1), name, type, data);
+    }
+    clearFingerprint(resourceID); //no longer matches the file it was created from
+}
+
+void WebkitCacher::putResource(std::string resourceUrl, std::string mimeType, const void *buf, size_t size){
+    BufferResourceSource data(buf, size);
+    putResource(resourceUrl, mimeType, data);
+}
+
+void WebkitCacher::putResource(std::string resourceUrl, std::string mimeType, int fd){
+    struct stat st = {};
+    retassure(!fstat(fd, &st), "Failed to stat fd %d for '%s' with err=%d (%s)",fd,resourceUrl.c_str(),errno,strerror(errno));
+    retassure(S_ISREG(st.st_mode), "fd %d for '%s' is not a regular file",fd,resourceUrl.c_str());
+    FileResourceSource filedata(fd, st.st_size);
+    StatsResourceSource data(filedata, _stats);
+    putResource(resourceUrl, mimeType, data);
+}
+
+void WebkitCacher::putResource(std::string resourceUrl, std::string mimeType, uint64_t size, CallbackResourceSource::ReadCallback read){
+    CallbackResourceSource data(size, read);
+    putResource(resourceUrl, mimeType, data);
+}
+
+void WebkitCacher::putResources(const std::vector<BufferResource> &resources){
+    BuildStats::Scope statsScope(_stats, BuildStats::Other);
+    bool ownTransaction = false;
+    cleanup([&]{
+        if (ownTransaction) rollbackTransaction();
+    });
+    
+    if (!_inTransaction) {
+        beginTransaction();
+        ownTransaction = true;
+    }
+    for (auto &r : resources) {
+        putResource(r.url, r.mimeType ? r.mimeType : "", r.buf, r.size);
+        transactionCheckpoint();
+    }
+    if (ownTransaction) {
+        commitTransaction();
+        ownTransaction = false;
+    }
+}
+
+void WebkitCacher::copyResource(std::string resourceUrl, std::string mimeType, std::string sourceUrl){
+    BuildStats::Scope statsScope(_stats, BuildStats::Other);
+    int srcResourceID = 0;
+    
+    srcResourceID = resourceIDForUrl(sourceUrl);
+    addSharedResource(prepareOrigin(resourceUrl.substr(0,resourceUrl.rfind('/')+1)), resourceUrl, _mimeTypes.intern(mimeType),
+                      _dataIDForResource[srcResourceID], _resourceSize[srcResourceID]);
+}
+
+void WebkitCacher::copyResources(const std::vector<ResourceCopy> &copies){
+    BuildStats::Scope statsScope(_stats, BuildStats::Other);
+    bool ownTransaction = false;
+    cleanup([&]{
+        if (ownTransaction) rollbackTransaction();
+    });
+    std::vector<std::pair<int, uint64_t>> sources; //data id and size of the source of every copy
+    
+    if (!_inTransaction) {
+        beginTransaction();
+        ownTransaction = true;
+    }
+    for (auto &c : copies) {
+        int srcResourceID = resourceIDForUrl(c.sourceUrl);
+        int dataID = _dataIDForResource[srcResourceID];
+        _dataRefCount[dataID]++; //keeps the payload while its resource is replaced by another copy
+        sources.push_back({dataID, _resourceSize[srcResourceID]});
+    }
+    for (size_t i=0; i<copies.size(); i++) {
+        const ResourceCopy &c = copies[i];
+        addSharedResource(prepareOrigin(c.url.substr(0,c.url.rfind('/')+1)), c.url, _mimeTypes.intern(c.mimeType),
+                          sources[i].first, sources[i].second);
+    }
+    for (auto &src : sources) {
+        releaseCacheResourceData(src.first);
+    }
+    if (ownTransaction) {
+        commitTransaction();
+        ownTransaction = false;
+    }
+}
+
+void WebkitCacher::deleteResource(std::string resourceUrl){
+    BuildStats::Scope statsScope(_stats, BuildStats::Remove);
+    auto it = _resourceIDForUrl.find(resourceUrl);
+    if (it == _resourceIDForUrl.end()) return;
+    removeResource(it->second, resourceUrl);
+}
+
+void WebkitCacher::mergeDatabase(std::string path){
+    BuildStats::Scope statsScope(_stats, BuildStats::Merge);
+    sqlite3_stmt *stmt = NULL;
+    bool attached = false;
+    bool ownTransaction = false;
+    cleanup([&]{
+        safeFreeCustom(stmt, sqlite3_reset);
+        if (ownTransaction) rollbackTransaction();
+        if (attached) sqlite3_exec(_db, "DETACH DATABASE WebkitCacherShard;", NULL, NULL, NULL);
+    });
+    int sqlite_err = 0;
+    std::vector<std::string> replaced;
+    std::vector<std::pair<int, uint64_t>> cachesSize; //target cache and size the shard adds to it
+    std::string resourceOffset;
+    std::string dataOffset;
+    
+    retassure(!_inTransaction, "Can't merge a database while a transaction is in progress");
+    
+    //sqlite can't attach inside of a transaction
+    stmt = cachedStatement("ATTACH DATABASE ? AS WebkitCacherShard;");
+    retassure(!(sqlite_err = sqlite3_bind_text(stmt, 1, path.c_str(), -1, SQLITE_STATIC)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+    retassure((sqlite_err = step(stmt)) == SQLITE_DONE, "Failed to attach '%s' with error=%d (%s)",path.c_str(),sqlite_err,sqlite3_errmsg(_db));
+    safeFreeCustom(stmt, sqlite3_reset);
+    attached = true;
+    
+    beginTransaction();
+    ownTransaction = true;
+    
+    //resources which exist on both sides are few (manifests, rebuilt files), removing them keeps refcounts and sizes right
+    stmt = cachedStatement("SELECT url FROM WebkitCacherShard.CacheResources WHERE id IN (" SHARD_RESOURCES ") "
+                           "AND url IN (SELECT url FROM main.CacheResources);");
+    while (step(stmt) == SQLITE_ROW) {
+        replaced.push_back((const char *)sqlite3_column_text(stmt, 0));
+    }
+    safeFreeCustom(stmt, sqlite3_reset);
+    for (auto &url : replaced) {
+        deleteResource(url);
+    }
+    
+    //map the caches of the shard to the caches of the same host here, creating missing groups on the way
+    sql_exec("CREATE TEMP TABLE WebkitCacherShardCaches (shard INTEGER PRIMARY KEY, target INTEGER NOT NULL);");
+    stmt = cachedStatement("SELECT c.id, c.size, g.manifestURL FROM WebkitCacherShard.Caches c "
+                           "JOIN WebkitCacherShard.CacheGroups g ON g.newestCache = c.id;");
+    while (step(stmt) == SQLITE_ROW) {
+        int shardCacheID = sqlite3_column_int(stmt, 0);
+        uint64_t size = (uint64_t)sqlite3_column_int64(stmt, 1);
+        const char *manifestURL = (const char *)sqlite3_column_text(stmt, 2);
+        std::string url = manifestURL ? manifestURL : "";
+        int cacheID = 0;
+        sqlite3_stmt *insert = NULL;
+        cleanup([&]{
+            safeFreeCustom(insert, sqlite3_reset);
+        });
+        
+        if (url.size() >= sizeof(RESOURCE_CACHEFILE)-1 && !url.compare(url.size()-(sizeof(RESOURCE_CACHEFILE)-1), std::string::npos, RESOURCE_CACHEFILE)) {
+            url.erase(url.size()-(sizeof(RESOURCE_CACHEFILE)-1));
+        }
+        cacheID = prepareOrigin(url);
+        cachesSize.push_back({cacheID, size});
+        
+        insert = cachedStatement("INSERT INTO WebkitCacherShardCaches (shard, target) VALUES(?,?);");
+        retassure(!(sqlite_err = sqlite3_bind_int(insert, 1, shardCacheID)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+        retassure(!(sqlite_err = sqlite3_bind_int(insert, 2, cacheID)),"Failed to bind arg to prepared SQL statement with error=%d",sqlite_err);
+        retassure((sqlite_err = step(insert)) == SQLITE_DONE, "Failed to execute satement");
+    }
+    safeFreeCustom(stmt, sqlite3_reset);
+    
+    //shard ids start at 1, shifting them behind the highest id here keeps them unique
+    resourceOffset = std::to_string(_nextFreeResourceID-1);
+    dataOffset = std::to_string(_nextFreeResourceDataID-1);
+    sql_exec(("INSERT INTO main.CacheResourceData (id, data, path) "
+              "SELECT id + " + dataOffset + ", data, path FROM WebkitCacherShard.CacheResourceData "
+              "WHERE id IN (SELECT data FROM WebkitCacherShard.CacheResources WHERE id IN (" SHARD_RESOURCES "));").c_str());
+    sql_exec(("INSERT INTO main.CacheResources (id, url, statusCode, responseURL, mimeType, textEncodingName, headers, data) "
+              "SELECT r.id + " + resourceOffset + ", r.url, r.statusCode, r.responseURL, r.mimeType, r.textEncodingName, r.headers, r.data + " + dataOffset + " "
+              "FROM WebkitCacherShard.CacheResources r WHERE r.id IN (" SHARD_RESOURCES ");").c_str());
+    sql_exec(("INSERT INTO main.CacheEntries (cache, type, resource) "
+              "SELECT m.target, e.type, e.resource + " + resourceOffset + " "
+              "FROM WebkitCacherShard.CacheEntries e JOIN WebkitCacherShardCaches m ON m.shard = e.cache;").c_str());
+    sql_exec("DROP TABLE temp.WebkitCacherShardCaches;");
+    
+    for (auto &c : cachesSize) {
+        addCachesSize(c.first, (int64_t)c.second);
+    }
+    
+    loadIndex();
+    commitTransaction();
+    ownTransaction = false;
+}
+
+void WebkitCacher::addBuildCounters(const BuildCounters &counters){
+    _stats.addCounters(counters.stats);
+    _deduplicatedBytes += counters.deduplicatedBytes;
+    for (int i=0; i<FlatFileStore::MethodCount; i++) {
+        _flatFiles.addFilesStored((FlatFileStore::Method)i, counters.flatFilesStored[i]);
+    }
+}
+
+void WebkitCacher::beginTransaction(size_t commitInterval){
+    int sqlite_err = 0;
+    retassure(!_inTransaction, "Transaction already in progress");
+    sql_exec("BEGIN;");
+    _inTransaction = true;
+    _commitInterval = commitInterval;
+    _filesSinceCommit = 0;
+}
+
+void WebkitCacher::setJobs(size_t jobs){
+    _jobs = jobs;
+}
+
+void WebkitCacher::setDeduplicate(bool deduplicate){
+    _deduplicate = deduplicate;
+}
+
+void WebkitCacher::setIncremental(bool incremental){
+    int sqlite_err = 0;
+    _incremental = incremental;
+    if (_incremental) {
+        sql_exec("CREATE TABLE IF NOT EXISTS WebkitCacherFingerprints (resource INTEGER PRIMARY KEY, size INTEGER NOT NULL, mtime INTEGER NOT NULL, hash INTEGER NOT NULL)");
+        loadFingerprints();
+    }
+}
+
+void WebkitCacher::setFlatFileThreshold(uint64_t threshold){
+    _flatFileThreshold = threshold;
+}
+
+void WebkitCacher::setFlatFileHardlinks(bool allowHardlinks){
+    _flatFiles.setAllowHardlink(allowHardlinks);
+}
+
+void WebkitCacher::setDeterministic(bool deterministic, uint64_t seed){
+    _deterministic = deterministic;
+    if (_deterministic) _flatFiles.setSeed(seed);
+}
+
+void WebkitCacher::setFollowSymlinks(bool followSymlinks){
+    _followSymlinks = followSymlinks;
+}
+
+void WebkitCacher::setResume(bool resume){
+    int sqlite_err = 0;
+    _resume = resume;
+    if (_resume) {
+        sql_exec("CREATE TABLE IF NOT EXISTS WebkitCacherCheckpoints (url TEXT PRIMARY KEY, path TEXT, done INTEGER NOT NULL)");
+    }
+}
+
+void WebkitCacher::clearCheckpoints(){
+    int sqlite_err = 0;
+    if (!hasTable("WebkitCacherCheckpoints")) return;
+    sql_exec("DELETE FROM WebkitCacherCheckpoints;");
+}
+
+void WebkitCacher::setSkipErrors(bool skipErrors){
+    _skipErrors = skipErrors;
+}
+
+void WebkitCacher::loadMimeTypes(std::string path){
+    _headerTemplates.clear(); //templates are keyed by the type strings, which overrides may replace
+    _mimeTypes.loadOverrides(path);
+}
+
+void WebkitCacher::commitTransaction(){
+    BuildStats::Scope statsScope(_stats, BuildStats::Commit);
+    int sqlite_err = 0;
+    retassure(_inTransaction, "No transaction in progress");
+    sql_exec("COMMIT;");
+    _inTransaction = false;
+    if (_staging == StagingMode::Direct) {
+        purgeDeletedFlatFiles();
+    }
+}
+
+void WebkitCacher::rollbackTransaction() noexcept{
+    if (!_inTransaction) return;
+    _inTransaction = false;
+    if (!sqlite3_get_autocommit(_db)) { //sqlite may already have rolled back on its own
+        sqlite3_exec(_db, "ROLLBACK;", NULL, NULL, NULL);
+    }
+    //in-memory index may contain rows which were just rolled back
+    try {
+        loadIndex();
+    } catch (...) {
+        //nothing we can do here
+    }
+}
+
+void WebkitCacher::publish(){
+    BuildStats::Scope statsScope(_stats, BuildStats::Publish);
+    sqlite3 *dst = NULL;
+    sqlite3_backup *backup = NULL;
+    int fd = -1;
+    std::string tmpPath = _applicationCachePath + ".XXXXXX";
+    bool didRename = false;
+    cleanup([&]{
+        safeFreeCustom(backup, sqlite3_backup_finish);
+        safeFreeCustom(dst, sqlite3_close);
+        safeClose(fd);
+        if (!didRename) unlink(tmpPath.c_str());
+    });
+    int sqlite_err = 0;
+    std::string dirPath = ".";
+    
+    retassure(_staging != StagingMode::Direct, "Nothing to publish, database is built in place");
+    retassure(!_inTransaction, "Can't publish while a transaction is in progress");
+    
+    {
+        struct stat st = {};
+        mode_t mode = 0;
+        retassure((fd = mkstemp(&tmpPath[0])) != -1, "Failed to create temporary file for '%s' with err=%d (%s)",_applicationCachePath.c_str(),errno,strerror(errno));
+        if (!stat(_applicationCachePath.c_str(), &st)) {
+            mode = st.st_mode & 0777;
+        }else{
+            mode = umask(0); umask(mode);
+            mode = 0666 & ~mode;
+        }
+        fchmod(fd, mode);
+    }
+    
+    retassure(!(sqlite_err = sqlite3_open(tmpPath.c_str(), &dst)), "Failed to open '%s' with error=%d",tmpPath.c_str(),sqlite_err);
+    //the file is fsync'ed and renamed as a whole, journaling it would only cost time
+    sqlite3_exec(dst, "PRAGMA journal_mode = OFF; PRAGMA synchronous = OFF;", NULL, NULL, NULL);
+    retassure(backup = sqlite3_backup_init(dst, "main", _db, "main"), "Failed to init backup with error=%d (%s)",sqlite3_errcode(dst),sqlite3_errmsg(dst));
+    retassure((sqlite_err = sqlite3_backup_step(backup, -1)) == SQLITE_DONE, "Failed to write '%s' with error=%d",tmpPath.c_str(),sqlite_err);
+    safeFreeCustom(backup, sqlite3_backup_finish);
+    if (_profile.pageSize && strtoul(pragmaValue("PRAGMA page_size;").c_str(), NULL, 10) != _profile.pageSize) {
+        //staging database was loaded from a file with a different page size, which sqlite can't change in place
+        std::string sql = "PRAGMA page_size = " + std::to_string(_profile.pageSize) + "; VACUUM;";
+        retassure(!(sqlite_err = sqlite3_exec(dst, sql.c_str(), NULL, NULL, NULL)), "Failed to change page size of '%s' with error=%d",tmpPath.c_str(),sqlite_err);
+    }
+    retassure(!(sqlite_err = sqlite3_close(dst)), "Failed to close '%s' with error=%d",tmpPath.c_str(),sqlite_err); dst = NULL;
+    
+    retassure(!fsync(fd), "Failed to sync '%s' with err=%d (%s)",tmpPath.c_str(),errno,strerror(errno));
+    retassure(!rename(tmpPath.c_str(), _applicationCachePath.c_str()), "Failed to rename '%s' to '%s' with err=%d (%s)",tmpPath.c_str(),_applicationCachePath.c_str(),errno,strerror(errno));
+    didRename = true;
+    
+    //a leftover journal belongs to the replaced file and must not be applied to the new one
+    unlink((_applicationCachePath + "-journal").c_str());
+    unlink((_applicationCachePath + "-wal").c_str());
+    unlink((_applicationCachePath + "-shm").c_str());
+
+    {
+        size_t lastSlash = _applicationCachePath.rfind('/');
+        if (lastSlash != std::string::npos) dirPath = _applicationCachePath.substr(0,lastSlash+1);
+        safeClose(fd);
+        if ((fd = open(dirPath.c_str(), O_RDONLY | O_DIRECTORY)) != -1) {
+            fsync(fd); //persist the rename
+        }
+    }
+    
+    purgeDeletedFlatFiles();
+}
+
+WebkitCacher::GarbageReport WebkitCacher::collectGarbage(){
+    BuildStats::Scope statsScope(_stats, BuildStats::Remove);
+    int sqlite_err = 0;
+    bool ownTransaction = false;
+    cleanup([&]{
+        if (ownTransaction) rollbackTransaction();
+    });
+    GarbageReport ret = {};
+    uint64_t caches = 0;
+    uint64_t entries = 0;
+    uint64_t resources = 0;
+    uint64_t data = 0;
+    
+    if (!_inTransaction) {
+        beginTransaction();
+        ownTransaction = true;
+    }
+    caches = rowCount("Caches");
+    entries = rowCount("CacheEntries");
+    resources = rowCount("CacheResources");
+    data = rowCount("CacheResourceData");
+    
+    //a resource is live if it is an entry of the newest cache of a group, its data is live if a live resource uses it
+    sql_exec("DELETE FROM CacheEntries WHERE resource NOT IN (SELECT id FROM CacheResources);");
+    sql_exec("CREATE TEMP TABLE WebkitCacherLiveResources (id INTEGER PRIMARY KEY);");
+    sql_exec("INSERT OR IGNORE INTO WebkitCacherLiveResources SELECT resource FROM CacheEntries "
+             "WHERE cache IN (SELECT newestCache FROM CacheGroups WHERE newestCache NOT NULL);");
+    
+    //detach everything else from its data, otherwise the CacheResourceDeleted trigger would delete data which is still shared
+    sql_exec("UPDATE CacheResources SET data = 0 WHERE id NOT IN (SELECT id FROM WebkitCacherLiveResources);");
+    
+    //triggers cascade from Caches to CacheEntries and from CacheEntries to CacheResources
+    sql_exec("DELETE FROM Caches WHERE id NOT IN (SELECT newestCache FROM CacheGroups WHERE newestCache NOT NULL);");
+    sql_exec("DELETE FROM CacheEntries WHERE cache NOT IN (SELECT id FROM Caches);");
+    sql_exec("DELETE FROM CacheResources WHERE id NOT IN (SELECT id FROM WebkitCacherLiveResources);");
+    sql_exec("DELETE FROM CacheWhitelistURLs WHERE cache NOT IN (SELECT id FROM Caches);");
+    sql_exec("DELETE FROM CacheAllowsAllNetworkRequests WHERE cache NOT IN (SELECT id FROM Caches);");
+    sql_exec("DELETE FROM FallbackURLs WHERE cache NOT IN (SELECT id FROM Caches);");
+    sql_exec("DELETE FROM CacheResourceData WHERE id NOT IN (SELECT data FROM CacheResources);");
+    sql_exec("DROP TABLE temp.WebkitCacherLiveResources;");
+    if (hasTable("WebkitCacherFingerprints")) {
+        sql_exec("DELETE FROM WebkitCacherFingerprints WHERE resource NOT IN (SELECT id FROM CacheResources);");
+    }
+    
+    //same accounting as addCachesSize: the sum of the Content-Length headers of all entries
+    sql_exec("UPDATE Caches SET size = (SELECT COALESCE(SUM(CAST(substr(r.headers, instr(r.headers, 'Content-Length:')+15) AS INTEGER)),0) "
+             "FROM CacheEntries e JOIN CacheResources r ON r.id = e.resource "
+             "WHERE e.cache = Caches.id AND instr(r.headers, 'Content-Length:') > 0);");
+    
+    ret.caches = caches - rowCount("Caches");
+    ret.entries = entries - rowCount("CacheEntries");
+    ret.resources = resources - rowCount("CacheResources");
+    ret.dataRows = data - rowCount("CacheResourceData");
+    
+    loadIndex();
+    _sweepFlatFiles = true; //on the next purge, which happens once no database on disk references the files anymore
+    if (ownTransaction) {
+        uint64_t purged = _purgedFlatFiles;
+        commitTransaction();
+        ownTransaction = false;
+        ret.flatFiles = _purgedFlatFiles - purged;
+    }
+    return ret;
+}
+
+void WebkitCacher::compact(){
+    BuildStats::Scope statsScope(_stats, BuildStats::Compact);
+    int sqlite_err = 0;
+    
+    retassure(!_inTransaction, "Can't compact while a transaction is in progress");
+    
+    //WAL mode is stored in the file and would be shipped to the device
+    if (pragmaValue("PRAGMA journal_mode;") == "wal") {
+        sql_exec("PRAGMA journal_mode = DELETE;");
+    }
+    sql_exec("VACUUM;");
+    sql_exec("ANALYZE;");
+    sql_exec("PRAGMA optimize;");
+}
+
+uint64_t WebkitCacher::statementsPrepared() const{
+    return _stats.counter(BuildStats::StatementsPrepared);
+}
+
+uint64_t WebkitCacher::statementsExecuted() const{
+    return _stats.counter(BuildStats::StatementsExecuted);
+}
+
+uint64_t WebkitCacher::deduplicatedBytes() const{
+    return _deduplicatedBytes;
+}
+
+uint64_t WebkitCacher::unchangedFiles() const{
+    return _unchangedFiles;
+}
+
+uint64_t WebkitCacher::removedResources() const{
+    return _removedResources;
+}
+
+uint64_t WebkitCacher::flatFilesStored(FlatFileStore::Method method) const{
+    return _flatFiles.filesStored(method);
+}
+
+const BuildStats &WebkitCacher::stats() const{
+    return _stats;
+}
+
+WebkitCacher::BuildCounters WebkitCacher::buildCounters() const{
+    BuildCounters ret = {};
+    ret.stats = _stats;
+    ret.deduplicatedBytes = _deduplicatedBytes;
+    for (int i=0; i<FlatFileStore::MethodCount; i++) {
+        ret.flatFilesStored[i] = _flatFiles.filesStored((FlatFileStore::Method)i);
+    }
+    return ret;
+}
+
+const std::vector<WebkitCacher::FailedFile> &WebkitCacher::failedFiles() const{
+    return _failedFiles;
 }
@@ -11,8 +11,58 @@
 #include <iostream>
 #include <sqlite3.h>
 #include <stdint.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "ResourceSource.hpp"
+#include "FlatFileStore.hpp"
+#include "StorageProfile.hpp"
+#include "BuildStats.hpp"
+#include "MimeTypes.hpp"
+
+class DirectoryWalker;
 
 class WebkitCacher {
+public:
+    enum StagingMode {
+        Direct = 0, //build in place in the target file
+        Memory,     //build in an in-memory database
+        TempFile    //build in a private temporary database, which sqlite may spill to disk
+    };
+    
+    struct BufferResource {
+        std::string url;
+        const void *buf;    //must stay valid until putResources returns, it is not copied
+        size_t size;
+        const char *mimeType; //NULL derives the type from the file extension
+    };
+    
+    struct ResourceCopy {
+        std::string url;
+        std::string mimeType;
+        std::string sourceUrl;
+    };
+    
+    struct GarbageReport {
+        uint64_t caches;
+        uint64_t entries;
+        uint64_t resources;
+        uint64_t dataRows;
+        uint64_t flatFiles; //only known here in Direct mode, staged builds remove them on publish
+    };
+    
+    struct FailedFile {
+        std::string path;
+        std::string error;
+    };
+    
+    struct BuildCounters {
+        BuildStats stats;
+        uint64_t deduplicatedBytes;
+        uint64_t flatFilesStored[FlatFileStore::MethodCount];
+    };
+    
+private:
     enum ResourceType {
         Master = 1 << 0,
         Manifest = 1 << 1,
@@ -23,30 +73,384 @@ class WebkitCacher {
     std::string _applicationCachePath;
     
     sqlite3 *_db;
+    StagingMode _staging;
+    StorageProfile _profile;
+    
+    void loadStagedDatabase();
+    std::string pragmaValue(sqlite3_stmt *stmt);
+    template<size_t N> std::string pragmaValue(const char (&pragma)[N]){return pragmaValue(cachedStatement(pragma));}
+    std::string pragmaValue(const std::string &pragma){return pragmaValue(cachedStatement(pragma));}
+    bool hasTable(const char *name);
+    uint64_t rowCount(const char *table);
+    void applyStorageProfile();
+    void createReadIndexes();
+    
+    bool _inTransaction;
+    size_t _commitInterval;
+    size_t _filesSinceCommit;
+    
+    std::unordered_map<const char *, sqlite3_stmt*> _statementCache; //SQL string literals, keyed by address
+    std::unordered_map<std::string, sqlite3_stmt*> _runtimeStatementCache; //SQL built at runtime, keyed by text
+    BuildStats _stats;
+    
+    sqlite3_stmt *reuseOrPrepare(sqlite3_stmt *&stmt, const char *sql);
+    
+    /*
+     String literals live as long as the program, so they are looked up by address without hashing the text.
+     SQL built at runtime goes through the std::string overload and is looked up by text.
+     */
+    template<size_t N> sqlite3_stmt *cachedStatement(const char (&sql)[N]){return reuseOrPrepare(_statementCache[sql], sql);}
+    sqlite3_stmt *cachedStatement(const std::string &sql);
+    
+    /*
+     sqlite3_step which counts the statement and the rows it wrote, including rows written by triggers.
+     Rows are only counted once the step succeeded.
+     */
+    int step(sqlite3_stmt *stmt);
+    
+    //rows reported by the update hook during the running step or sql_exec (inserted, updated, deleted)
+    uint64_t _pendingRows[3];
+    int _pendingChangesBase;
+    static void rowChanged(void *ctx, int op, const char *database, const char *table, sqlite3_int64 rowid);
+    void beginRowCount();
+    void endRowCount(bool succeeded);
+    
+    //in-memory index of the database, loaded once on open and kept in sync on every insert
+    std::unordered_map<std::string, int> _resourceIDForUrl;
+    std::unordered_map<unsigned int, int> _cacheIDForHostHash;
+    std::unordered_map<int, uint64_t> _cachesSize;
+    std::unordered_set<int> _resourceIDs;
+    std::unordered_set<int> _resourceDataIDs;
+    std::unordered_set<int> _cacheEntryResources;
+    std::unordered_map<int, int> _dataIDForResource;
+    std::unordered_map<int, size_t> _dataRefCount;
+    std::unordered_map<int, uint64_t> _resourceSize;
+    int _nextFreeResourceID;
+    int _nextFreeCacheGroupID;
+    int _nextFreeResourceDataID;
+    
+    void loadIndex();
+    
+    std::vector<uint8_t> _chunkBuffer;
+    std::vector<uint8_t> _compareBuffer;
+    
+    size_t _jobs;
+    
+    //payload deduplication
+    bool _deduplicate;
+    std::unordered_multimap<uint64_t, int> _dataIDsForHash;
+    std::unordered_map<int, uint64_t> _hashForDataID;
+    uint64_t _deduplicatedBytes;
+    
+    void registerDataHash(int dataID, uint64_t hash);
+    void unregisterDataHash(int dataID);
+    bool dataMatches(int dataID, ResourceSource &data);
+    int findIdenticalData(ResourceSource &data, uint64_t hash);
+    int findIdenticalStoredData(int dataID, uint64_t hash); //compares the stored row dataID instead of a source
+    
+    //incremental re-cache
+    struct Fingerprint {
+        uint64_t size;
+        int64_t mtime;
+        uint64_t hash;
+    };
+    bool _incremental;
+    std::unordered_map<int, Fingerprint> _fingerprints;
+    std::unordered_set<int> _seenResources;
+    uint64_t _unchangedFiles;
+    uint64_t _removedResources;
+    
+    void loadFingerprints();
+    void setFingerprint(int resourceID, const Fingerprint &fp);
+    void clearFingerprint(int resourceID);
+    bool fileUnchanged(const std::string &resourceUrl, uint64_t size, int64_t mtime);
+    void removeResource(int resourceID, std::string url);
+    void removeStaleResources(std::string url);
+    void removeFileResources(const std::string &resourceUrl);
+    
+    //resource bodies stored as flat files next to the database
+    FlatFileStore _flatFiles;
+    uint64_t _flatFileThreshold;
+    std::unordered_map<int, std::string> _flatFileForDataID;
+    
+    void purgeDeletedFlatFiles();
+    
+    //sorted walks and reproducible flat file names
+    bool _deterministic;
+    
+    bool _followSymlinks;
+    
+    //remove unreferenced files from the flat file directory on the next purge
+    bool _sweepFlatFiles;
+    uint64_t _purgedFlatFiles;
+    
+    //resumable ingest, progress of the current walk is written with every intermediate commit
+    bool _resume;
+    std::string _checkpointUrl;     //url of the walk whose progress is recorded, empty if there is none
+    std::string _checkpointPath;    //last path below _checkpointUrl the current transaction contains
+    std::string _resumeAfter;       //last path below _checkpointUrl an interrupted run committed
+    
+    bool resumeCheckpoint(const std::string &url);
+    void writeCheckpoint(bool done);
+    
+    //files which can't be read are skipped instead of aborting
+    bool _skipErrors;
+    std::vector<FailedFile> _failedFiles;
+    
+    void skipFailedFile(const std::string &path, const std::string &resourceUrl, const char *error);
+    
+    /*
+     Index entries a file added or dropped until reading it failed, so they can be undone together with its savepoint.
+     Reads only fail while hashing and while writing the data row, nothing after that is recorded.
+     */
+    struct FileUndo {
+        bool recording;
+        std::vector<int> cacheEntryResources;
+        std::vector<int> resourceDataIDs;
+        std::vector<unsigned int> cacheGroupHostHashes;
+        std::vector<std::pair<int, std::string>> flatFiles;    //flat files of rows which were overwritten
+        std::vector<std::pair<int, uint64_t>> dataHashes;      //hashes of rows which were overwritten
+        int nextFreeResourceDataID;
+        int nextFreeCacheGroupID;
+    };
+    FileUndo _fileUndo;
+    
+    void beginFileUndo();
+    void undoFile();
+    
+    //response headers
+    MimeTypes _mimeTypes;
+    std::unordered_map<const char *, std::string> _headerTemplates; //keyed by MIME type string, which are never freed
+    std::string _headerBuffer;
+    
+    const std::string &headerTemplate(const char *mimeType);
     
     void setCacheAllowsAllNetworkRequests0(int cacheID);
     void addOrigin(std::string url);
     int cacheIDForUrl(std::string url);
     
+    //per origin setup only needs to run once per origin
+    std::unordered_map<std::string, int> _cacheIDForOrigin;
+    int prepareOrigin(const std::string &url);
+    
     int resourceIDForUrl(std::string url);
     int getNextFreeCacheResourcesID();
     
-    void createCacheResource(int resourceID, std::string resourceURL, std::string mimeType, uint64_t dataSize, int dataresourceID = 0);
-    void createCacheResourceData(int resourceID, std::string data);
-    void addCachesSize(int chaceID, size_t size);
+    void createCacheResource(int resourceID, const std::string &resourceURL, const char *mimeType, uint64_t dataSize, int dataresourceID = 0);
+    int dataIDForWriting(int resourceID);
+    void createCacheResourceData(int dataID, ResourceSource &data, const std::string &resourceURL);
+    void releaseCacheResourceData(int dataID);
+    void addCachesSize(int chaceID, int64_t size);
 
     void createCacheEntry(int cacheID, ResourceType resourceType, int resourceID);
     
-    void addResourceToURL(std::string url, std::string resource, std::string mimeType = "text/html", std::string data = "");
+    /*
+     hash: hash of the payload if the caller knows it, 0 otherwise. Set to the hash once it is known,
+     payloads which can only be read once are hashed while they are stored.
+     */
+    int addResourceToURL(std::string url, std::string resource, const char *mimeType, ResourceSource &data, uint64_t *hash = NULL);
+    int addSharedResource(int cacheID, const std::string &resourceUrl, const char *mimeType, int dataID, uint64_t size); //payload is the data row dataID
+    void addFileResource(std::string url, std::string name, ResourceSource &data, int64_t mtime, uint64_t hash = 0);
+    void addFileResourceOrSkip(const std::string &url, const std::string &name, const std::string &filepath, StatsResourceSource &data, int64_t mtime, uint64_t hash = 0);
     
-    void addDirectoryResourcesRecursive(std::string url, std::string dir);
+    void addWalkedFile(const DirectoryWalker &walker);
+    void addDirectoryResources(std::string url, std::string dir, const std::vector<std::string> *rootEntries = NULL);
+    void addArchiveResources(std::string url, int fd);
+    void addArchiveLink(const std::string &url, const std::string &path, const std::string &target);
+    void beginCacheURL(const std::string &url);
+    void finishCacheURL(const std::string &url);
+    void writeRedirect(const std::string &url, const std::string &targetUrl);
+    
+    void transactionCheckpoint();
     
 public:
-    WebkitCacher(std::string applicationCachePath);
+    /*
+     In a staging mode other than Direct, the existing database is copied into a staging database on open
+     and nothing is written to applicationCachePath until publish is called.
+     The build settings of profile are applied on open, changing the page size of an existing database runs VACUUM.
+     */
+    WebkitCacher(std::string applicationCachePath, StagingMode staging = StagingMode::Direct, const StorageProfile &profile = StorageProfile());
     ~WebkitCacher();
     
     void cacheDirectory(std::string url, std::string dir);
+    
+    /*
+     Same as cacheDirectory, but only caches the given names of files and directories directly inside dir.
+     Used to split the build of one directory into several databases, see ShardedBuild. Requires a full build,
+     incremental mode would remove the resources of all other entries.
+     */
+    void cacheDirectoryEntries(std::string url, std::string dir, const std::vector<std::string> &names);
+    
+    /*
+     Adds everything the newest caches of the database at path contain, with set-based INSERT ... SELECT
+     through ATTACH. Resource, data and cache ids are renumbered, resources with a URL this database
+     already has replace the existing ones and Caches.size is kept in sync.
+     path must be next to this database, flat files are referenced by name and not moved.
+     Runs in its own transaction, none may be in progress.
+     */
+    void mergeDatabase(std::string path);
+    
+    /*
+     Adds the counters of the build which produced a database merged with mergeDatabase,
+     so stats, deduplicated bytes and flat files stored cover the whole build. Phase times are not added.
+     */
+    void addBuildCounters(const BuildCounters &counters);
+    
+    /*
+     Same as cacheDirectory, but reads the files from an uncompressed tar archive ("-" for stdin)
+     without extracting it. Members are read in archive order on the calling thread.
+     */
+    void cacheArchive(std::string url, std::string archivePath);
+    
+    /*
+     Applies changes of single files below dir to the cache of url without walking the whole directory.
+     paths are relative to dir: existing files are added or updated, missing paths remove the resources
+     of that file, or of all files below it if it was a directory.
+     Runs in a single transaction unless one is already in progress. Requires incremental mode.
+     */
+    void updateFiles(std::string url, std::string dir, const std::vector<std::string> &paths);
     void addRedirect(std::string url, std::string targetUrl);
+    
+    /*
+     Adds many redirects at once. All targets are resolved before anything is written
+     and the redirects are written in a single transaction, unless one is already in progress.
+     */
+    void addRedirects(const std::vector<std::pair<std::string,std::string>> &redirects);
+    
+    /*
+     Adds the manifest WebKit expects at url/cache.cache, cacheDirectory and cacheArchive do this on their own.
+     Caches built only from putResource need it once per url.
+     */
+    void addManifest(std::string url);
+    
+    /*
+     Single resource operations, independent of any cached directory, e.g. for applying patches
+     or for applications which generate resources in memory.
+     putResource adds or replaces the resource at resourceUrl with data, an empty mimeType derives
+     the type from the file extension. Payloads are streamed into the database, never copied as a whole.
+     fd must be a regular file, it is not closed and is read with pread, so its file offset doesn't matter.
+     copyResource adds or replaces the resource at resourceUrl with the payload sourceUrl currently has,
+     the payload is shared instead of copied.
+     */
+    void putResource(std::string resourceUrl, std::string mimeType, ResourceSource &data);
+    void putResource(std::string resourceUrl, std::string mimeType, const void *buf, size_t size);
+    void putResource(std::string resourceUrl, std::string mimeType, int fd);
+    void putResource(std::string resourceUrl, std::string mimeType, uint64_t size, CallbackResourceSource::ReadCallback read);
+    
+    /*
+     Adds many in-memory resources in a single transaction, unless one is already in progress.
+     Honors the commitInterval of beginTransaction.
+     */
+    void putResources(const std::vector<BufferResource> &resources);
+    void copyResource(std::string resourceUrl, std::string mimeType, std::string sourceUrl);
+    
+    /*
+     Applies many copies in a single transaction, unless one is already in progress.
+     Every source is resolved before the first copy is written, so all copies see the payloads from before,
+     even when a source is the target of another copy (e.g. two resources swapping their payloads).
+     */
+    void copyResources(const std::vector<ResourceCopy> &copies);
+    void deleteResource(std::string resourceUrl);
+    
+    /*
+     bulk ingest:
+     Everything between beginTransaction and commitTransaction is written in a single transaction.
+     If commitInterval is non-zero, the transaction is committed and reopened every commitInterval files.
+     */
+    void beginTransaction(size_t commitInterval = 0);
+    void commitTransaction();
+    void rollbackTransaction() noexcept;
+    
+    /*
+     Writes the staging database to a temporary file next to the target in one pass
+     and atomically renames it over the target. Not needed in Direct mode.
+     */
+    void publish();
+    
+    /*
+     Removes caches which are not the newest cache of their group, resources without entry in one of those,
+     data rows no remaining resource uses and flat files no remaining data row references.
+     Caches.size is recomputed from the remaining entries. Run compact afterwards to give the space back.
+     */
+    GarbageReport collectGarbage();
+    
+    /*
+     Runs VACUUM, ANALYZE and optimize, so the shipped database is compact and has statistics for lookups.
+     */
+    void compact();
+    
+    /*
+     Number of threads reading files in parallel during cacheDirectory.
+     Database writes always happen on the calling thread, the resulting database does not depend on this setting.
+     */
+    void setJobs(size_t jobs);
+    
+    /*
+     Resources with identical payloads share a single CacheResourceData row.
+     */
+    void setDeduplicate(bool deduplicate);
+    
+    /*
+     Keeps size, mtime and content hash of every cached file in the WebkitCacherFingerprints table.
+     cacheDirectory then skips unchanged files and removes resources whose files disappeared.
+     */
+    void setIncremental(bool incremental);
+    
+    /*
+     Resources larger than threshold bytes are stored as flat files in the ApplicationCache directory
+     next to the database, CacheResourceData only references them by path. Zero disables flat files.
+     */
+    void setFlatFileThreshold(uint64_t threshold);
+    void setFlatFileHardlinks(bool allowHardlinks);
+    
+    /*
+     Directories are walked in bytewise sorted order and flat file names are drawn from a fixed sequence,
+     so the same input and options produce a byte-identical database on every machine and filesystem.
+     seed selects the sequence of names, builds which store flat files in the same directory at the same time need different seeds.
+     */
+    void setDeterministic(bool deterministic, uint64_t seed = 0);
+    
+    /*
+     Symlinks to files are always cached with the content of their target.
+     If set, symlinks to directories are walked as well instead of being skipped, loops are skipped.
+     */
+    void setFollowSymlinks(bool followSymlinks);
+    
+    /*
+     cacheDirectory and cacheArchive record the last file they ingested in the WebkitCacherCheckpoints table
+     with every intermediate commit of beginTransaction(commitInterval). If a run is interrupted, the next run
+     with resume set skips everything up to that file, and urls the interrupted run finished completely.
+     Directories are walked in sorted order, so the order is the same in both runs.
+     */
+    void setResume(bool resume);
+    
+    /*
+     Forgets the progress recorded for resume, call it once every url of a run was cached.
+     */
+    void clearCheckpoints();
+    
+    /*
+     Files and directories which can't be read are skipped and reported by failedFiles instead of aborting
+     cacheDirectory, whatever a failing file already wrote is rolled back. Errors of the database still abort.
+     In incremental mode, the resources cached for skipped files by an earlier run are kept.
+     */
+    void setSkipErrors(bool skipErrors);
+    
+    /*
+     Content types are derived from the file extension, unknown extensions are served as text/html.
+     Entries of a mime.types style file take precedence over the built-in table.
+     */
+    void loadMimeTypes(std::string path);
+    
+    uint64_t statementsPrepared() const;
+    uint64_t statementsExecuted() const;
+    uint64_t deduplicatedBytes() const;
+    uint64_t unchangedFiles() const;
+    uint64_t removedResources() const;
+    uint64_t flatFilesStored(FlatFileStore::Method method) const;
+    const BuildStats &stats() const;
+    BuildCounters buildCounters() const;
+    const std::vector<FailedFile> &failedFiles() const;
 };
 
 #endif /* WebkitCacher_hpp */
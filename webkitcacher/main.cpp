@@ -6,16 +6,54 @@
 //
 
 #include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/stat.h>
 #include "WebkitCacher.hpp"
+#include "JobFile.hpp"
+#include "DirectoryWatcher.hpp"
+#include "CacheReader.hpp"
+#include "CachePatch.hpp"
+#include "ShardedBuild.hpp"
 #include <libgeneral/macros.h>
 #include <getopt.h>
 #include <vector>
+#include <memory>
+#include <chrono>
 
 static struct option longopts[] = {
     { "help",           no_argument,        NULL, 'h' },
     { "dir",            required_argument,  NULL, 'd' },
     { "url",            required_argument,  NULL, 'u' },
+    { "tar",            required_argument,  NULL, 't' },
     { "redirect",       required_argument,  NULL, 'r' },
+    { "job-file",       required_argument,  NULL, 'f' },
+    { "bulk",           no_argument,        NULL, 'b' },
+    { "commit-every",   required_argument,  NULL, 'n' },
+    { "resume",         no_argument,        NULL, 'R' },
+    { "skip-errors",    no_argument,        NULL, 'k' },
+    { "jobs",           required_argument,  NULL, 'j' },
+    { "shards",         required_argument,  NULL, 'Z' },
+    { "shard-by",       required_argument,  NULL, 'z' },
+    { "dedup",          no_argument,        NULL, 'D' },
+    { "incremental",    no_argument,        NULL, 'i' },
+    { "flat-files",     required_argument,  NULL, 'F' },
+    { "hardlink",       no_argument,        NULL, 'L' },
+    { "deterministic",  no_argument,        NULL, 'S' },
+    { "follow-symlinks", no_argument,       NULL, 'l' },
+    { "gc",             no_argument,        NULL, 'G' },
+    { "mime-types",     required_argument,  NULL, 'M' },
+    { "stage",          required_argument,  NULL, 's' },
+    { "profile",        required_argument,  NULL, 'p' },
+    { "stats",          no_argument,        NULL, 'T' },
+    { "stats-json",     required_argument,  NULL, 'J' },
+    { "watch",          no_argument,        NULL, 'w' },
+    { "extract",        required_argument,  NULL, 'x' },
+    { "verify",         required_argument,  NULL, 'V' },
+    { "debounce",       required_argument,  NULL, 'B' },
+    { "diff",           required_argument,  NULL, 'E' },
+    { "output",         required_argument,  NULL, 'o' },
+    { "patch",          required_argument,  NULL, 'P' },
     { NULL, 0, NULL, 0 }
 };
 
@@ -26,7 +64,45 @@ void cmd_help(){
     printf("  -h, --help\t\t\t\tprints usage information\n");
     printf("  -d, --dir <directory>\t\t\tdirectory to cache\n");
     printf("  -u, --url <url>\t\t\tURL where cached content will be accessible\n");
+    printf("  -t, --tar <archive>\t\t\tcache files of an uncompressed tar archive ('-' for stdin) without extracting it\n");
     printf("  -r, --redirect <srcurl=dsturl>\tadds a redirect from srcurl to cached dsturl\n");
+    printf("  -f, --job-file <file>\t\t\tread directories and redirects to cache from file, can be given multiple times\n");
+    printf("\t\t\t\t\t(lines 'cache <url> <directory>', 'tar <url> <archive>' and 'redirect <srcurl> <dsturl>')\n");
+    printf("  -b, --bulk\t\t\t\twrite the whole import in a single transaction\n");
+    printf("  -n, --commit-every <N>\t\tcommit bulk transaction every N files (implies --bulk)\n");
+    printf("  -R, --resume\t\t\t\trecord progress with every commit (every 1000 files unless -n is given)\n");
+    printf("\t\t\t\t\tand continue where an interrupted run with --resume stopped\n");
+    printf("  -k, --skip-errors\t\t\tskip and report files which can't be read instead of aborting\n");
+    printf("  -j, --jobs <N>\t\t\tread files with N threads in parallel\n");
+    printf("  -Z, --shards <N>\t\t\tbuild directories on N threads into separate databases and merge them\n");
+    printf("  -z, --shard-by <size|dir>\t\tsplit top-level entries into N shards of equal size (default),\n");
+    printf("\t\t\t\t\tor make every top-level directory a shard of its own\n");
+    printf("  -D, --dedup\t\t\t\tstore identical files only once\n");
+    printf("  -i, --incremental\t\t\tonly re-cache files which changed since the last run\n");
+    printf("  -F, --flat-files <bytes>\t\tstore files larger than <bytes> as flat files next to the database\n");
+    printf("  -L, --hardlink\t\t\thardlink flat files to the source files when possible\n");
+    printf("  -S, --deterministic\t\t\twalk directories in sorted order, identical input gives a byte-identical database\n");
+    printf("  -l, --follow-symlinks\t\t\twalk symlinks to directories instead of skipping them\n");
+    printf("  -G, --gc\t\t\t\tremove rows and flat files nothing references anymore, fix cache sizes and compact\n");
+    printf("  -M, --mime-types <file>\t\tMIME types in mime.types format, overriding the built-in table\n");
+    printf("  -s, --stage <memory|temp>\t\tbuild in a staging database and atomically replace the file when done\n");
+    printf("  -p, --profile <profile>\t\tstorage profile: default, fast, wal and/or comma separated key=value\n");
+    printf("\t\t\t\t\t(page_size, journal_mode, synchronous, cache_size, temp_store, compact, indexes)\n");
+    printf("  -T, --stats\t\t\t\tprint time spent per phase and counters\n");
+    printf("  -J, --stats-json <file>\t\twrite time spent per phase and counters as JSON\n");
+    printf("  -w, --watch\t\t\t\tkeep running and apply changes of the directory to the cache (implies --incremental)\n");
+    printf("  -B, --debounce <ms>\t\t\tcollect changes for <ms> milliseconds before applying them (default 100)\n");
+    printf("  -x, --extract <directory>\t\twrite the cached files to directory (only those below --url if given)\n");
+    printf("  -V, --verify <directory>\t\tcompare directory with the files cached at --url, uses --jobs threads\n");
+    printf("  -E, --diff <old database>\t\twrite a patch which turns old database into the database given last\n");
+    printf("  -o, --output <file>\t\t\tpatch file written by --diff\n");
+    printf("  -P, --patch <file>\t\t\tapply a patch written by --diff to the database\n");
+}
+
+static volatile sig_atomic_t gStopWatching = 0;
+
+static void stopWatching(int){
+    gStopWatching = 1;
 }
 
 int main_r(int argc, const char * argv[]) {
@@ -34,15 +110,44 @@ int main_r(int argc, const char * argv[]) {
     
     const char *directory = NULL;
     const char *url = NULL;
+    const char *archive = NULL;
     const char *lastArg = "ApplicationCache.db";
+    bool bulk = false;
+    size_t commitInterval = 0;
+    bool resume = false;
+    bool skipErrors = false;
+    size_t jobs = 1;
+    size_t shards = 0;
+    ShardedBuild::Partition shardBy = ShardedBuild::Partition::Size;
+    bool dedup = false;
+    bool incremental = false;
+    uint64_t flatFileThreshold = 0;
+    bool hardlink = false;
+    bool deterministic = false;
+    bool followSymlinks = false;
+    bool gc = false;
+    const char *mimeTypes = NULL;
+    WebkitCacher::StagingMode staging = WebkitCacher::StagingMode::Direct;
+    StorageProfile profile;
+    bool stats = false;
+    const char *statsJSON = NULL;
+    bool watch = false;
+    int debounceMs = 100;
+    const char *extractDir = NULL;
+    const char *verifyDir = NULL;
+    const char *diffBase = NULL;
+    const char *output = NULL;
+    const char *patch = NULL;
 
     int optindex = 0;
     int opt = 0;
     
+    std::vector<JobFile::Directory> directories;
+    std::vector<JobFile::Directory> archives;
     std::vector<std::pair<std::string,std::string>> redirects;
  
     
-    while ((opt = getopt_long(argc, (char* const *)argv, "hd:u:r:", longopts, &optindex)) > 0) {
+    while ((opt = getopt_long(argc, (char* const *)argv, "hd:u:t:r:f:bn:Rkj:Z:z:DiF:LSlGM:s:p:TJ:wB:x:V:E:o:P:", longopts, &optindex)) > 0) {
         switch (opt) {
             case 'h':
                 cmd_help();
@@ -53,6 +158,9 @@ int main_r(int argc, const char * argv[]) {
             case 'u':
                 url = optarg;
                 break;
+            case 't':
+                archive = optarg;
+                break;
             case 'r':
                 {
                     std::string cmd = optarg;
@@ -61,6 +169,106 @@ int main_r(int argc, const char * argv[]) {
                     redirects.push_back({cmd.substr(0,columnpos),cmd.substr(columnpos+1)});
                 }
                 break;
+            case 'f':
+                {
+                    JobFile job = JobFile::load(optarg);
+                    directories.insert(directories.end(), job.directories.begin(), job.directories.end());
+                    archives.insert(archives.end(), job.archives.begin(), job.archives.end());
+                    redirects.insert(redirects.end(), job.redirects.begin(), job.redirects.end());
+                }
+                break;
+            case 'b':
+                bulk = true;
+                break;
+            case 'n':
+                bulk = true;
+                commitInterval = strtoul(optarg, NULL, 0);
+                break;
+            case 'R':
+                resume = true;
+                break;
+            case 'k':
+                skipErrors = true;
+                break;
+            case 'j':
+                jobs = strtoul(optarg, NULL, 0);
+                break;
+            case 'Z':
+                shards = strtoul(optarg, NULL, 0);
+                break;
+            case 'z':
+                if (!strcmp(optarg, "size")) {
+                    shardBy = ShardedBuild::Partition::Size;
+                }else if (!strcmp(optarg, "dir")) {
+                    shardBy = ShardedBuild::Partition::TopLevel;
+                }else{
+                    reterror("unknown shard partition '%s'",optarg);
+                }
+                break;
+            case 'D':
+                dedup = true;
+                break;
+            case 'i':
+                incremental = true;
+                break;
+            case 'F':
+                flatFileThreshold = strtoull(optarg, NULL, 0);
+                break;
+            case 'L':
+                hardlink = true;
+                break;
+            case 'S':
+                deterministic = true;
+                break;
+            case 'l':
+                followSymlinks = true;
+                break;
+            case 'G':
+                gc = true;
+                break;
+            case 'M':
+                mimeTypes = optarg;
+                break;
+            case 's':
+                if (!strcmp(optarg, "memory")) {
+                    staging = WebkitCacher::StagingMode::Memory;
+                }else if (!strcmp(optarg, "temp")) {
+                    staging = WebkitCacher::StagingMode::TempFile;
+                }else{
+                    reterror("unknown staging mode '%s'",optarg);
+                }
+                break;
+            case 'p':
+                profile = StorageProfile::parse(optarg);
+                break;
+            case 'T':
+                stats = true;
+                break;
+            case 'J':
+                statsJSON = optarg;
+                break;
+            case 'w':
+                watch = true;
+                incremental = true;
+                break;
+            case 'B':
+                debounceMs = (int)strtol(optarg, NULL, 0);
+                break;
+            case 'x':
+                extractDir = optarg;
+                break;
+            case 'V':
+                verifyDir = optarg;
+                break;
+            case 'E':
+                diffBase = optarg;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'P':
+                patch = optarg;
+                break;
 
             default:
                 cmd_help();
@@ -74,24 +282,266 @@ int main_r(int argc, const char * argv[]) {
         lastArg = argv[0];
     }
     
-    if (!url && !directory && !redirects.size()) {
+    if (extractDir) {
+        CacheReader reader(lastArg);
+        printf("Extracting '%s' to '%s'\n",lastArg,extractDir);
+        auto report = reader.extract(url ? url : "", extractDir);
+        for (auto &u : report.skipped) {
+            printf("Skipped '%s'\n",u.c_str());
+        }
+        printf("Extracted %llu files, %llu bytes\n",(unsigned long long)report.files,(unsigned long long)report.bytes);
+        printf("done!\n");
+        return 0;
+    }
+    
+    if (verifyDir) {
+        retassure(url, "--verify needs --url");
+        CacheReader reader(lastArg);
+        printf("Verifying '%s' against '%s' at URL '%s'\n",lastArg,verifyDir,url);
+        auto report = reader.verify(url, verifyDir, jobs, followSymlinks);
+        for (auto &f : report.missing) {
+            printf("Missing: %s\n",f.c_str());
+        }
+        for (auto &f : report.mismatched) {
+            printf("Differs: %s\n",f.c_str());
+        }
+        for (auto &u : report.extra) {
+            printf("Not in directory: %s\n",u.c_str());
+        }
+        printf("Verified %llu files, %zu missing, %zu differ, %zu not in directory\n",
+               (unsigned long long)report.verified,report.missing.size(),report.mismatched.size(),report.extra.size());
+        return (report.missing.size() || report.mismatched.size()) ? 1 : 0;
+    }
+    
+    if (diffBase) {
+        retassure(output, "--diff needs --output");
+        printf("Writing patch '%s' from '%s' to '%s'\n",output,diffBase,lastArg);
+        auto summary = CachePatch::diff(diffBase, lastArg, output);
+        printf("Patch: %llu added or changed (%llu bytes), %llu copied, %llu redirects, %llu removed\n",
+               (unsigned long long)summary.puts,(unsigned long long)summary.payloadBytes,(unsigned long long)summary.copies,
+               (unsigned long long)summary.redirects,(unsigned long long)summary.removes);
+        printf("done!\n");
+        return 0;
+    }
+    
+    if (patch) {
+        WebkitCacher wk(lastArg, staging, profile);
+        wk.setFlatFileThreshold(flatFileThreshold);
+        wk.setFlatFileHardlinks(hardlink);
+        wk.setDeterministic(deterministic);
+        printf("Applying patch '%s' to '%s'\n",patch,lastArg);
+        auto summary = CachePatch::apply(wk, lastArg, patch);
+        if (profile.compact) {
+            printf("Compacting database\n");
+            wk.compact();
+        }
+        if (staging != WebkitCacher::StagingMode::Direct) {
+            printf("Publishing '%s'\n",lastArg);
+            wk.publish();
+        }
+        printf("Applied %llu added or changed, %llu copied, %llu redirects, %llu removed\n",
+               (unsigned long long)summary.puts,(unsigned long long)summary.copies,
+               (unsigned long long)summary.redirects,(unsigned long long)summary.removes);
+        printf("done!\n");
+        return 0;
+    }
+    
+    if (url && directory) {
+        directories.insert(directories.begin(), {url,directory});
+    }
+    if (url && archive) {
+        archives.insert(archives.begin(), {url,archive});
+    }
+    
+    if (!url && !directory && !directories.size() && !archives.size() && !redirects.size() && !gc) {
         cmd_help();
         return 0;
     }
 
-    WebkitCacher wk(lastArg);
+    if (watch) {
+        retassure(directories.size() == 1 && !archives.size(), "--watch needs exactly one directory");
+        retassure(staging == WebkitCacher::StagingMode::Direct, "--watch can't be combined with --stage");
+    }
+    
+    if (shards) {
+        //shards are built from scratch and merged, nothing knows which files changed
+        retassure(!incremental && !resume, "--shards can't be combined with --incremental, --watch or --resume");
+    }
+    
+    if (resume) {
+        //a staging database is lost when the run is interrupted, there would be nothing to resume
+        retassure(staging == WebkitCacher::StagingMode::Direct, "--resume can't be combined with --stage");
+        bulk = true;
+        if (!commitInterval) commitInterval = 1000;
+    }
 
-    if (url && directory) {
-        printf("Caching directoy '%s' to URL '%s'\n",directory,url);
-        wk.cacheDirectory(url, directory);
+    WebkitCacher wk(lastArg, staging, profile);
+    wk.setJobs(jobs);
+    wk.setDeduplicate(dedup);
+    wk.setIncremental(incremental);
+    wk.setFlatFileThreshold(flatFileThreshold);
+    wk.setFlatFileHardlinks(hardlink);
+    wk.setDeterministic(deterministic);
+    wk.setFollowSymlinks(followSymlinks);
+    wk.setResume(resume);
+    wk.setSkipErrors(skipErrors);
+    if (mimeTypes) wk.loadMimeTypes(mimeTypes);
+    
+    std::unique_ptr<DirectoryWatcher> watcher;
+    if (watch) {
+        //watch before the initial build, so changes made during the build are not missed
+        watcher.reset(new DirectoryWatcher(directories.front().dir, followSymlinks));
+    }
+    
+    auto start = std::chrono::steady_clock::now();
+    std::vector<WebkitCacher::FailedFile> failedFiles;
+    if (shards) {
+        //merging attaches the shards, which sqlite can't do inside of the bulk transaction
+        ShardedBuild sharded(wk, lastArg, shards, shardBy);
+        sharded.setConfigure([&](WebkitCacher &shard, size_t index){
+            shard.setDeduplicate(dedup);
+            shard.setFlatFileThreshold(flatFileThreshold);
+            shard.setFlatFileHardlinks(hardlink);
+            shard.setDeterministic(deterministic, index+1); //the target itself uses seed 0
+            shard.setFollowSymlinks(followSymlinks);
+            shard.setSkipErrors(skipErrors);
+            if (mimeTypes) shard.loadMimeTypes(mimeTypes);
+        });
+        for (auto &d : directories) {
+            printf("Caching directoy '%s' to URL '%s' in shards\n",d.dir.c_str(),d.url.c_str());
+            sharded.cacheDirectory(d.url, d.dir);
+        }
+        printf("Merged %zu shards\n",sharded.shardsBuilt());
+        directories.clear();
+        failedFiles = sharded.failedFiles();
+    }
+    if (bulk) {
+        wk.beginTransaction(commitInterval);
+    }
+
+    for (auto &d : directories) {
+        printf("Caching directoy '%s' to URL '%s'\n",d.dir.c_str(),d.url.c_str());
+        wk.cacheDirectory(d.url, d.dir);
+    }
+    for (auto &a : archives) {
+        printf("Caching archive '%s' to URL '%s'\n",a.dir.c_str(),a.url.c_str());
+        wk.cacheArchive(a.url, a.dir);
     }
     
-    for (auto r : redirects) {
+    for (auto &r : redirects) {
         printf("Redirecting '%s' to '%s'\n",r.first.c_str(),r.second.c_str());
-        wk.addRedirect(r.first, r.second);
+    }
+    wk.addRedirects(redirects);
+    
+    if (resume) {
+        wk.clearCheckpoints(); //in the same transaction as the last files
+    }
+    if (bulk) {
+        wk.commitTransaction();
+    }
+    
+    if (gc) {
+        printf("Collecting garbage\n");
+        auto report = wk.collectGarbage();
+        printf("Removed %llu caches, %llu entries, %llu resources, %llu data rows, %llu flat files\n",
+               (unsigned long long)report.caches,(unsigned long long)report.entries,(unsigned long long)report.resources,
+               (unsigned long long)report.dataRows,(unsigned long long)report.flatFiles);
+    }
+    auto imported = std::chrono::steady_clock::now();
+    
+    //freed pages are only given back by compacting
+    bool compact = profile.compact || gc;
+    if (compact) {
+        printf("Compacting database\n");
+        wk.compact();
+    }
+    auto compacted = std::chrono::steady_clock::now();
+    
+    if (staging != WebkitCacher::StagingMode::Direct) {
+        printf("Publishing '%s'\n",lastArg);
+        wk.publish();
+    }
+    {
+        std::chrono::duration<double> elapsed = imported - start;
+        printf("Import took %.3f seconds (%s)\n",elapsed.count(),bulk ? "bulk" : "autocommit");
+        if (compact) {
+            elapsed = compacted - imported;
+            printf("Compact took %.3f seconds\n",elapsed.count());
+        }
+        elapsed = std::chrono::steady_clock::now() - start;
+        printf("Build took %.3f seconds\n",elapsed.count());
+        {
+            struct stat st = {};
+            if (!stat(lastArg, &st)) {
+                printf("Database size: %llu bytes\n",(unsigned long long)st.st_size);
+            }
+        }
+        printf("SQL statements: %llu prepared, %llu executed\n",(unsigned long long)wk.statementsPrepared(),(unsigned long long)wk.statementsExecuted());
+        if (dedup) {
+            printf("Deduplication saved %llu bytes\n",(unsigned long long)wk.deduplicatedBytes());
+        }
+        if (incremental) {
+            printf("Incremental: %llu unchanged, %llu removed\n",(unsigned long long)wk.unchangedFiles(),(unsigned long long)wk.removedResources());
+        }
+        if (flatFileThreshold) {
+            printf("Flat files: %llu hardlinked, %llu cloned, %llu kernel copied, %llu copied\n",
+                   (unsigned long long)wk.flatFilesStored(FlatFileStore::Hardlink),
+                   (unsigned long long)wk.flatFilesStored(FlatFileStore::Reflink),
+                   (unsigned long long)wk.flatFilesStored(FlatFileStore::KernelCopy),
+                   (unsigned long long)wk.flatFilesStored(FlatFileStore::Copy));
+        }
+    }
+    failedFiles.insert(failedFiles.end(), wk.failedFiles().begin(), wk.failedFiles().end());
+    for (auto &f : failedFiles) {
+        printf("Skipped '%s': %s\n",f.path.c_str(),f.error.c_str());
+    }
+    if (failedFiles.size()) {
+        printf("Skipped %zu files which couldn't be read\n",failedFiles.size());
+    }
+    if (stats) {
+        printf("\n");
+        wk.stats().printSummary(stdout);
+        printf("\n");
+    }
+    if (statsJSON) {
+        FILE *f = NULL;
+        cleanup([&]{
+            safeFreeCustom(f, fclose);
+        });
+        retassure(f = fopen(statsJSON, "w"), "Failed to open '%s'",statsJSON);
+        wk.stats().writeJSON(f);
+    }
+    
+    if (watcher) {
+        struct sigaction sa = {};
+        sa.sa_handler = stopWatching; //no SA_RESTART, so waiting for changes is interrupted
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+        
+        printf("Watching '%s' for changes\n",directories.front().dir.c_str());
+        fflush(stdout);
+        while (!gStopWatching) {
+            auto changes = watcher->waitForChanges(debounceMs);
+            if (gStopWatching) break;
+            auto updateStart = std::chrono::steady_clock::now();
+            if (changes.overflow) {
+                printf("Too many changes, rescanning '%s'\n",directories.front().dir.c_str());
+                watcher->rewatch();
+                wk.beginTransaction();
+                wk.cacheDirectory(directories.front().url, directories.front().dir);
+                wk.commitTransaction();
+            }else if (changes.paths.size()) {
+                wk.updateFiles(directories.front().url, directories.front().dir, changes.paths);
+            }else{
+                continue;
+            }
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - updateStart;
+            printf("Updated %zu paths in %.3f ms\n",changes.paths.size(),elapsed.count());
+            fflush(stdout);
+        }
     }
     printf("done!\n");
-    return 0;
+    return failedFiles.size() ? 1 : 0;
 }
 
 int main(int argc, const char * argv[]) {